@@ -0,0 +1,237 @@
+#include "libraybox.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Batches smaller than this aren't worth splitting up for the thread pool:
+#define QUERY_MIN_PARALLEL 4096
+
+// Bins are 64x64 origin tiles (in Morton order, so neighbouring tiles get neighbouring bins)
+// times 8 direction octants:
+#define QUERY_TILE_BITS 6
+#define QUERY_BIN_COUNT (1 << (2*QUERY_TILE_BITS + 3))
+
+
+RayboxQuery::RayboxQuery(int threads) {
+  m_threads = threads;
+  if (m_threads <= 0) m_threads = std::thread::hardware_concurrency();
+  if (m_threads < 1) m_threads = 1;
+  m_chunk_rays = 1024;
+  m_sort = true;
+  m_sort_min = QUERY_MIN_PARALLEL;
+  m_sort_map_bytes = 1<<20;
+  m_accel = true;
+  if (m_threads > 1) m_pool.reset(new RayboxThreadPool(m_threads));
+}
+
+RayboxQuery::~RayboxQuery() {}
+
+
+// One arbitrary ray, traced with raybox_dda() just as raybox's scalar column tracer does with
+// N=float. The difference is that it stops at maxDist, and checks that it's still on the map (as
+// there's no guarantee that the map is closed, or that the ray starts inside it).
+template<int LAYOUT, bool ACCEL>
+static void trace_ray(const RayboxMap &map, const raybox_ray_t &ray, raybox_hit_t &hit) {
+  const float originX = ray.originX, originY = ray.originY;
+  const float rayDirX = ray.dirX, rayDirY = ray.dirY;
+  hit.color = 0;
+  hit.side = 0;
+  if (!(originX >= 0.0f && originY >= 0.0f && originX < float(map.m_width) && originY < float(map.m_height))) {
+    // Off the map (or NaN):
+    hit.dist = 0.0f;
+    hit.hitX = originX;
+    hit.hitY = originY;
+    hit.mapX = hit.mapY = -1;
+    hit.result = RAYBOX_RAY_EDGE;
+    return;
+  }
+  const float stepXdist = float(std::abs(1.0/rayDirX));
+  const float stepYdist = float(std::abs(1.0/rayDirY));
+  raybox_dda_t<float> dda;
+  raybox_dda<float, LAYOUT, ACCEL, true>(
+    map, originX, originY, rayDirX, rayDirY, stepXdist, stepYdist, ray.maxDist, dda
+  );
+  hit.side = dda.side;
+  hit.result = dda.result;
+  hit.dist = dda.dist;
+  hit.hitX = dda.dist*rayDirX + originX;
+  hit.hitY = dda.dist*rayDirY + originY;
+  hit.mapX = dda.mapX;
+  hit.mapY = dda.mapY;
+  if (dda.wallHit) hit.color = map.raw_color<LAYOUT>(dda.wallHit);
+}
+
+typedef void (*trace_ray_fn)(const RayboxMap &map, const raybox_ray_t &ray, raybox_hit_t &hit);
+
+template<bool ACCEL>
+static trace_ray_fn trace_ray_for_layout(int layout) {
+  switch (layout) {
+    case MAP_LAYOUT_ROWMAJOR32: return trace_ray<MAP_LAYOUT_ROWMAJOR32, ACCEL>;
+    case MAP_LAYOUT_TILED:      return trace_ray<MAP_LAYOUT_TILED, ACCEL>;
+    case MAP_LAYOUT_MORTON:     return trace_ray<MAP_LAYOUT_MORTON, ACCEL>;
+    default:                    return trace_ray<MAP_LAYOUT_ROWMAJOR8, ACCEL>;
+  }
+}
+
+static trace_ray_fn trace_ray_for(const RayboxMap &map, bool accel) {
+  return (accel && map.m_dist) ? trace_ray_for_layout<true>(map.m_layout) : trace_ray_for_layout<false>(map.m_layout);
+}
+
+
+void RayboxQuery::trace_one(const RayboxMap &map, const raybox_ray_t &ray, raybox_hit_t &hit, bool accel) {
+  trace_ray_for(map, accel)(map, ray, hit);
+}
+
+// Counting sort of the ray indices into m_order, by origin tile and direction octant. The tiles are
+// scaled to the map, so that it's covered by at most 64x64 of them:
+void RayboxQuery::bin_rays(const RayboxMap &map, const raybox_ray_t *rays, size_t count) {
+  int shift = 0;
+  while ((std::max(map.m_width, map.m_height)-1) >> shift >= (1 << QUERY_TILE_BITS)) ++shift;
+  const int tile_max = (1 << QUERY_TILE_BITS) - 1;
+  m_keys.resize(count);
+  m_bins.assign(QUERY_BIN_COUNT, 0);
+  for (size_t i = 0; i < count; ++i) {
+    const raybox_ray_t &ray = rays[i];
+    // (Off-map and NaN origins get clamped into the edge tiles; they're cheap anyway.)
+    int tx = (ray.originX >= 0.0f) ? std::min(int(std::min(ray.originX, float(MAP_MAX_SIZE))) >> shift, tile_max) : 0;
+    int ty = (ray.originY >= 0.0f) ? std::min(int(std::min(ray.originY, float(MAP_MAX_SIZE))) >> shift, tile_max) : 0;
+    int octant = (ray.dirX < 0.0f) | ((ray.dirY < 0.0f) << 1) | ((std::abs(ray.dirY) > std::abs(ray.dirX)) << 2);
+    uint16_t key = uint16_t((RayboxMap::morton_spread(tx) | (RayboxMap::morton_spread(ty) << 1)) << 3 | octant);
+    m_keys[i] = key;
+    ++m_bins[key];
+  }
+  uint32_t start = 0;
+  for (uint32_t &n : m_bins) {
+    uint32_t c = n;
+    n = start;
+    start += c;
+  }
+  m_order.resize(count);
+  for (size_t i = 0; i < count; ++i) m_order[m_bins[m_keys[i]]++] = uint32_t(i);
+}
+
+void RayboxQuery::trace(const RayboxMap &map, const raybox_ray_t *rays, raybox_hit_t *hits, size_t count) {
+  // Ray indices are 32-bit, so do really huge batches in parts:
+  const size_t max_batch = size_t(1) << 30;
+  while (count > max_batch) {
+    trace(map, rays, hits, max_batch);
+    rays += max_batch;
+    hits += max_batch;
+    count -= max_batch;
+  }
+  trace_ray_fn fn = trace_ray_for(map, m_accel);
+  const bool sorted = m_sort && count >= m_sort_min && map.cells_bytes() >= m_sort_map_bytes;
+  if (sorted) bin_rays(map, rays, count);
+  const uint32_t *order = sorted ? m_order.data() : NULL;
+  auto trace_range = [&](size_t i0, size_t i1) {
+    if (order) {
+      for (size_t i = i0; i < i1; ++i) fn(map, rays[order[i]], hits[order[i]]);
+    }
+    else {
+      for (size_t i = i0; i < i1; ++i) fn(map, rays[i], hits[i]);
+    }
+  };
+  if (!m_pool || count < QUERY_MIN_PARALLEL) {
+    trace_range(0, count);
+    return;
+  }
+  const size_t chunk = std::max(1, m_chunk_rays);
+  const int chunks = int((count + chunk-1) / chunk);
+  m_pool->run(chunks, [&](int c) {
+    size_t i0 = size_t(c)*chunk;
+    trace_range(i0, std::min(count, i0+chunk));
+  });
+}
+
+
+RayboxBatchRenderer::RayboxBatchRenderer(int threads) {
+  m_threads = threads;
+  if (m_threads <= 0) m_threads = std::thread::hardware_concurrency();
+  if (m_threads < 1) m_threads = 1;
+  m_chunk_cameras = 4;
+  m_accel = true;
+  m_sky_color = 0xff666666;
+  m_floor_color = 0xffcccccc;
+  m_trace = NULL;
+  m_map = NULL;
+  m_cams = NULL;
+  m_count = 0;
+  m_width = m_height = 0;
+  m_out = NULL;
+  if (m_threads > 1) m_pool.reset(new RayboxThreadPool(m_threads));
+  m_job = [this](int c) {
+    size_t i0 = size_t(c)*std::max(1, m_chunk_cameras);
+    size_t i1 = std::min(m_count, i0+std::max(1, m_chunk_cameras));
+    for (size_t i = i0; i < i1; ++i) render_view(i);
+  };
+}
+
+RayboxBatchRenderer::~RayboxBatchRenderer() {}
+
+bool RayboxBatchRenderer::render(const RayboxMap &map, const raybox_camera_t *cams, size_t count, int width, int height, uint32_t *out) {
+  if (width < 1 || width > RAYBOX_BATCH_MAX_WIDTH || height < 1) {
+    printf("ERROR: Batch views must be 1 to %d pixels wide: %dx%d\n", RAYBOX_BATCH_MAX_WIDTH, width, height);
+    return false;
+  }
+  m_trace = trace_ray_for(map, m_accel);
+  m_map = &map;
+  m_cams = cams;
+  m_count = count;
+  m_width = width;
+  m_height = height;
+  m_out = out;
+  const size_t chunk = std::max(1, m_chunk_cameras);
+  const size_t chunks = (count + chunk-1) / chunk;
+  if (!m_pool || chunks < 2) {
+    for (size_t c = 0; c < chunks; ++c) m_job(int(c));
+  }
+  else {
+    m_pool->run(int(chunks), m_job);
+  }
+  m_map = NULL;
+  m_cams = NULL;
+  m_out = NULL;
+  return true;
+}
+
+// As raybox's RENDER_OVERDRAW (i.e. reference) path draws a frame, but once all of the columns are
+// traced, the view is filled in row by row: Each pixel is then just a select between its column's
+// wall colour and the backdrop, which vectorises, and the stores are sequential.
+void RayboxBatchRenderer::render_view(size_t i) const {
+  const int W = m_width, H = m_height;
+  const raybox_camera_t &cam = m_cams[i];
+  int32_t top[RAYBOX_BATCH_MAX_WIDTH], stop[RAYBOX_BATCH_MAX_WIDTH];
+  uint32_t color[RAYBOX_BATCH_MAX_WIDTH];
+  for (int x = 0; x < W; ++x) {
+    const float cameraX = float(2*x) / float(W) - 1.0f;
+    const raybox_ray_t ray = { cam.x, cam.y, cam.headingX + cam.viewX*cameraX, cam.headingY + cam.viewY*cameraX, INFINITY };
+    raybox_hit_t hit;
+    m_trace(*m_map, ray, hit);
+    // The wall covers rows [2*(H/2)-s, s), just as raybox works it out:
+    const int s = (hit.result == RAYBOX_RAY_WALL) ? wall_stop_for_dist(H, hit.dist) : H/2;
+    top[x] = 2*(H/2) - s;
+    stop[x] = s;
+    color[x] = hit.color & (hit.side ? 0xffffffff : 0xffc0c0c0); // (Darker on X sides.)
+  }
+  uint32_t *row = m_out + i*size_t(W)*size_t(H);
+  for (int y = 0; y < H; ++y, row += W) {
+    const uint32_t back = (y < H/2) ? m_sky_color : m_floor_color;
+    int x = 0;
+#ifdef __SSE2__
+    //NOTE: GCC won't vectorise this at -O2, so it's done by hand, 4 pixels at a time:
+    const __m128i yv = _mm_set1_epi32(y), backv = _mm_set1_epi32(back);
+    for (; x+4 <= W; x += 4) {
+      // y >= top && y < stop, i.e. !(top > y) && stop > y:
+      __m128i wall = _mm_andnot_si128(
+        _mm_cmpgt_epi32(_mm_loadu_si128((const __m128i*)(top+x)), yv),
+        _mm_cmpgt_epi32(_mm_loadu_si128((const __m128i*)(stop+x)), yv)
+      );
+      __m128i c = _mm_loadu_si128((const __m128i*)(color+x));
+      _mm_storeu_si128((__m128i*)(row+x), _mm_or_si128(_mm_and_si128(wall, c), _mm_andnot_si128(wall, backv)));
+    }
+#endif
+    for (; x < W; ++x) {
+      row[x] = (y >= top[x] && y < stop[x]) ? color[x] : back;
+    }
+  }
+}
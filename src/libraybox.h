@@ -0,0 +1,1019 @@
+// libraybox: The map, and batched ray queries against it, for code that needs to know what a ray
+// hits without rendering anything (e.g. line-of-sight and hitscan checks in game logic), or batched
+// rendering of many small views without a window. This is also what raybox itself uses for its map
+// and worker threads. It doesn't need SDL.
+#ifndef LIBRAYBOX_H
+#define LIBRAYBOX_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <list>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <cmath>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define MAP_MAX_SIZE 65536 // Max map width/height (Morton offsets must fit in 32 bits).
+
+// typedef std::tuple<int,int> PlayerStart;
+typedef struct { int x, y; } PlayerStart;
+typedef std::list<PlayerStart> PlayerStarts;
+
+
+// Ways that RayboxMap can lay out its cells in memory:
+enum {
+  MAP_LAYOUT_ROWMAJOR32,  // Original layout: Row-major, 4 bytes (BGRX colour) per cell.
+  MAP_LAYOUT_ROWMAJOR8,   // Row-major, 1 byte (palette index) per cell.
+  MAP_LAYOUT_TILED,       // 8x8 tiles of 1-byte cells, i.e. each tile is one 64-byte cache line.
+  MAP_LAYOUT_MORTON,      // 1-byte cells in Morton (Z) order (padded out to a power-of-2 square).
+  MAP_LAYOUT_COUNT
+};
+
+inline const char *map_layout_name(int layout) {
+  switch (layout) {
+    case MAP_LAYOUT_ROWMAJOR32: return "rowmajor32";
+    case MAP_LAYOUT_ROWMAJOR8:  return "rowmajor8";
+    case MAP_LAYOUT_TILED:      return "tiled";
+    case MAP_LAYOUT_MORTON:     return "morton";
+  }
+  return "?";
+}
+
+#define MAP_TILE_BITS 3 // 8x8 cells per tile.
+
+
+// Binary map files (see RayboxMap::save_binary()) start with this header. The sections it points
+// to are 64-byte aligned, and hold the cells and distance field exactly as RayboxMap keeps them
+// in memory (in the given layout), so that they can be used straight from a memory-mapped file.
+// Everything is little-endian.
+enum { MAP_FILE_VERSION = 1 };
+
+enum {
+  MAP_FILE_DIST = 1,  // Has a distance field (see RayboxMap::build_distance_field()).
+};
+
+struct map_file_header_t {
+  char magic[4];            // "RBXM"
+  uint16_t version;         // MAP_FILE_VERSION
+  uint16_t layout;          // MAP_LAYOUT_*
+  uint32_t width, height;
+  uint32_t stride;          // RayboxMap::m_stride.
+  uint32_t flags;           // MAP_FILE_*
+  uint32_t palette_size;
+  uint32_t start_count;     // Player starts, each a uint32_t x then y.
+  uint64_t cells_offset, cells_bytes;
+  uint64_t dist_offset, dist_bytes;
+  uint64_t starts_offset;
+  uint32_t palette[256];
+};
+
+static_assert(sizeof(map_file_header_t) == 1096, "map_file_header_t must have no padding");
+
+// A whole file, read-only, memory-mapped where possible (otherwise just read into memory):
+class RayboxMappedFile {
+public:
+
+  const uint8_t *m_data;
+  size_t m_size;
+  std::vector<uint8_t> m_copy;  // (If it couldn't be mapped.)
+
+  RayboxMappedFile() {
+    m_data = NULL;
+    m_size = 0;
+  }
+
+  ~RayboxMappedFile() {
+#ifndef _WIN32
+    if (m_data && m_copy.empty()) munmap((void*)m_data, m_size);
+#endif
+  }
+
+  RayboxMappedFile(const RayboxMappedFile &) = delete;
+  RayboxMappedFile &operator=(const RayboxMappedFile &) = delete;
+
+  bool open(const char *filename) {
+#ifndef _WIN32
+    int fd = ::open(filename, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      //NOTE: MAP_PRIVATE, so that anything that writes to the map (e.g. set_cell()) only
+      // gets its own copy of that page, rather than writing to the file.
+      void *p = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED) {
+        m_data = (const uint8_t*)p;
+        m_size = st.st_size;
+      }
+    }
+    ::close(fd);
+    if (m_data) return true;
+#endif
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) return false;
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    m_copy.resize(size > 0 ? size : 0);
+    bool ok = size > 0 && fread(m_copy.data(), 1, size, fp) == size_t(size);
+    fclose(fp);
+    if (!ok) return false;
+    m_data = m_copy.data();
+    m_size = m_copy.size();
+    return true;
+  }
+
+  // Drops any of the file's pages from the OS's cache, so the next open() is a cold start:
+  static void evict(const char *filename) {
+#if !defined(_WIN32) && defined(POSIX_FADV_DONTNEED)
+    int fd = ::open(filename, O_RDONLY);
+    if (fd < 0) return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    ::close(fd);
+#endif
+  }
+
+};
+
+
+class RayboxMap {
+public:
+  int m_width, m_height;
+  int m_layout;                 // MAP_LAYOUT_*
+  int m_stride;                 // Cells per row (row-major layouts), or tiles per row (tiled layout).
+  uint8_t *m_cells;             // Cell data (see m_layout). For 1-byte layouts, 0 is always empty.
+  std::vector<uint8_t> m_store; // Backing storage for m_cells (unless they're in m_file).
+  const uint8_t *m_dist;        // Per-cell empty radius, in the same layout as m_cells (see build_distance_field()).
+  std::vector<uint8_t> m_dist_store;  // Backing storage for m_dist (unless it's in m_file).
+  std::unique_ptr<RayboxMappedFile> m_file; // Binary map file that the map was loaded from (see load_binary()).
+  uint32_t m_palette[256];      // Palette for 1-byte layouts. Colours are ARGB (i.e. BGRA in memory).
+  int m_palette_size;
+  int m_last_index;             // Last index returned by palette_index(), to speed up runs of the same colour.
+  PlayerStarts m_player_starts;
+
+  RayboxMap() {
+    // Init a usable, but dummy map.
+    resize(64, 64, MAP_LAYOUT_TILED);
+    // Fill map with red walls (BGRA order):
+    for (int x=0; x<m_width; ++x) {
+      for (int y=0; y<m_height; ++y) {
+        set_cell(x, y, 0x0000ffff);
+      }
+    }
+    // Start with a player position in the middle of the map:
+    PlayerStart start = { m_width>>1, m_height>>1 };
+    // Hollow out a part of the map around our player start position:
+    for (int x=start.x-3; x<start.x+3; ++x) {
+      for (int y=start.y-3; y<start.y+3; ++y) {
+        set_cell(x, y, 0);
+      }
+    }
+    m_player_starts.push_back(start);
+    build_distance_field();
+  }
+
+  // Default palette: Index 0 is empty, and 1..63 are the colours you get from the
+  // 0b00RRGGBB packing that dump_map() uses. Other colours get added after those.
+  void reset_palette() {
+    m_palette[0] = 0;
+    for (int i=1; i<64; ++i) {
+      m_palette[i] = 0xff000000 | ((i>>4)&3)*0x550000 | ((i>>2)&3)*0x5500 | (i&3)*0x55;
+    }
+    m_palette_size = 64;
+    m_last_index = 0;
+    for (int i=m_palette_size; i<256; ++i) m_palette[i] = 0;
+  }
+
+  // Returns the palette index for a colour, adding it to the palette if there's room,
+  // otherwise falling back to the nearest 0b00RRGGBB colour.
+  uint8_t palette_index(uint32_t color) {
+    if (color == 0) return 0;
+    if (m_palette[m_last_index] == color) return m_last_index;
+    for (int i=1; i<m_palette_size; ++i) {
+      if (m_palette[i] == color) return m_last_index = i;
+    }
+    if (m_palette_size < 256) {
+      m_palette[m_palette_size] = color;
+      return m_last_index = m_palette_size++;
+    }
+    uint8_t q = ((color>>18)&0x30) | ((color>>12)&0x0c) | ((color>>6)&0x03);
+    return q ? q : 0x15; // Don't let a dark wall become empty; use dark grey instead.
+  }
+
+  // Bytes of cell data (and the stride) for a map of the given size and layout:
+  static size_t layout_bytes(int width, int height, int layout, int &stride) {
+    switch (layout) {
+      case MAP_LAYOUT_ROWMAJOR32:
+        stride = width;
+        return size_t(width)*height*4;
+      case MAP_LAYOUT_TILED:
+        stride = (width + (1<<MAP_TILE_BITS)-1) >> MAP_TILE_BITS;
+        return size_t(stride) * ((height + (1<<MAP_TILE_BITS)-1) >> MAP_TILE_BITS) << (2*MAP_TILE_BITS);
+      case MAP_LAYOUT_MORTON: {
+        size_t side = 1;
+        while (side < size_t(width) || side < size_t(height)) side <<= 1;
+        stride = side;
+        return side*side;
+      }
+      default:
+        stride = width;
+        return size_t(width)*height;
+    }
+  }
+
+  // Reallocates the map as empty cells of the given size and layout:
+  void resize(int width, int height, int layout) {
+    m_width = width;
+    m_height = height;
+    m_layout = layout;
+    size_t bytes = layout_bytes(width, height, layout, m_stride);
+    //NOTE: Padded so that SIMD gathers (which read 4 bytes at a time) can't run off the end.
+    m_store.assign(bytes+4, 0);
+    m_cells = m_store.data();
+    m_dist = NULL;
+    m_dist_store.clear();
+    m_file.reset();
+    m_player_starts.clear();
+    reset_palette();
+  }
+
+  //NOTE: m_cells points into m_store (or m_file), so a plain copy would be wrong. Use copy_from() instead.
+  RayboxMap(const RayboxMap &) = delete;
+  RayboxMap &operator=(const RayboxMap &) = delete;
+  RayboxMap(RayboxMap &&) = default;
+  RayboxMap &operator=(RayboxMap &&) = default;
+
+  // Makes this a copy of another map, in the given layout:
+  void copy_from(const RayboxMap &src, int layout) {
+    resize(src.m_width, src.m_height, layout);
+    m_player_starts = src.m_player_starts;
+    for (int y=0; y<m_height; ++y) {
+      for (int x=0; x<m_width; ++x) {
+        set_cell(x, y, src.cell(x, y));
+      }
+    }
+    build_distance_field();
+  }
+
+  // Re-encodes the existing map in a different layout:
+  void relayout(int layout) {
+    if (layout == m_layout) return;
+    RayboxMap old = std::move(*this);
+    copy_from(old, layout);
+  }
+
+  // Spreads the low 16 bits of v out to the even bits of the result:
+  static uint32_t morton_spread(uint32_t v) {
+    v = (v | (v<<8)) & 0x00ff00ff;
+    v = (v | (v<<4)) & 0x0f0f0f0f;
+    v = (v | (v<<2)) & 0x33333333;
+    v = (v | (v<<1)) & 0x55555555;
+    return v;
+  }
+
+  // Offset of a cell within m_cells, in cells:
+  template<int LAYOUT>
+  size_t offset(int x, int y) const {
+    if (LAYOUT == MAP_LAYOUT_TILED) {
+      const int m = (1<<MAP_TILE_BITS)-1;
+      return ((size_t(y>>MAP_TILE_BITS)*m_stride + (x>>MAP_TILE_BITS)) << (2*MAP_TILE_BITS))
+        | ((y&m)<<MAP_TILE_BITS) | (x&m);
+    }
+    if (LAYOUT == MAP_LAYOUT_MORTON) return morton_spread(x) | (morton_spread(y)<<1);
+    return x + size_t(y)*m_stride;
+  }
+
+  // Raw cell value: The colour itself for MAP_LAYOUT_ROWMAJOR32, otherwise a palette index.
+  // Either way it's 0 for an empty cell, so the DDA only needs to look up the colour once it hits.
+  template<int LAYOUT>
+  uint32_t cell_raw(int x, int y) const {
+    if (LAYOUT == MAP_LAYOUT_ROWMAJOR32) return ((const uint32_t*)m_cells)[offset<LAYOUT>(x,y)];
+    return m_cells[offset<LAYOUT>(x,y)];
+  }
+
+  template<int LAYOUT>
+  uint32_t raw_color(uint32_t raw) const {
+    return (LAYOUT == MAP_LAYOUT_ROWMAJOR32) ? raw : m_palette[raw];
+  }
+
+  template<int LAYOUT>
+  uint32_t cell_at(int x, int y) const { return raw_color<LAYOUT>(cell_raw<LAYOUT>(x,y)); }
+
+  size_t offset_any(int x, int y) const {
+    switch (m_layout) {
+      case MAP_LAYOUT_TILED:  return offset<MAP_LAYOUT_TILED>(x,y);
+      case MAP_LAYOUT_MORTON: return offset<MAP_LAYOUT_MORTON>(x,y);
+      default:                return offset<MAP_LAYOUT_ROWMAJOR8>(x,y); // Same for ROWMAJOR32, in cells.
+    }
+  }
+
+  // Colour of a map cell (0 if empty), whatever the layout:
+  uint32_t cell(int x, int y) const {
+    switch (m_layout) {
+      case MAP_LAYOUT_ROWMAJOR32: return cell_at<MAP_LAYOUT_ROWMAJOR32>(x,y);
+      case MAP_LAYOUT_TILED:      return cell_at<MAP_LAYOUT_TILED>(x,y);
+      case MAP_LAYOUT_MORTON:     return cell_at<MAP_LAYOUT_MORTON>(x,y);
+      default:                    return cell_at<MAP_LAYOUT_ROWMAJOR8>(x,y);
+    }
+  }
+
+  bool in_bounds(int x, int y) const { return x >= 0 && y >= 0 && x < m_width && y < m_height; }
+
+  void set_cell(int x, int y, uint32_t color) {
+    switch (m_layout) {
+      case MAP_LAYOUT_ROWMAJOR32: ((uint32_t*)m_cells)[offset<MAP_LAYOUT_ROWMAJOR32>(x,y)] = color; break;
+      case MAP_LAYOUT_TILED:      m_cells[offset<MAP_LAYOUT_TILED>(x,y)] = palette_index(color); break;
+      case MAP_LAYOUT_MORTON:     m_cells[offset<MAP_LAYOUT_MORTON>(x,y)] = palette_index(color); break;
+      default:                    m_cells[offset<MAP_LAYOUT_ROWMAJOR8>(x,y)] = palette_index(color); break;
+    }
+  }
+
+  // Loads the map from RGB24 pixels (e.g. those of a PNG, see RayboxSystem::load_map()):
+  // Black is empty, magenta-ish (full red and blue) is a player start, and anything else is a wall.
+  bool load_from_rgb24(const uint8_t *pixels, int width, int height, int pitch, int layout) {
+    uint8_t r, g, b, a;
+    a = 255;
+    resize(width, height, layout);
+    for (int y=0; y<m_height; ++y) {
+      for (int x=0; x<m_width; ++x) {
+        r = pixels[y*pitch + x*3 + 0];
+        g = pixels[y*pitch + x*3 + 1];
+        b = pixels[y*pitch + x*3 + 2];
+        if (r==255 && b==255) {
+          // Player position:
+          set_cell(x, y, 0);
+          PlayerStart player = {x,y};
+          m_player_starts.push_back(player);
+        }
+        else {
+          set_cell(x, y, (r+g+b==0) ? 0 : (a<<24)|(r<<16)|(g<<8)|b);
+        }
+      }
+    }
+    build_distance_field();
+    return true;
+  }
+
+  // Generates a big, mostly-open map (for benchmarking): Solid outer walls, with scattered
+  // pillars and wall segments, and a clearing in the middle for the player start.
+  void generate(int width, int height, uint32_t seed, int layout) {
+    resize(width, height, layout);
+    uint32_t rng = seed;
+    auto rand_next = [&]() { rng = rng*1664525u + 1013904223u; return rng>>8; };
+    auto rand_color = [&]() { return m_palette[1 + rand_next()%63]; };
+    for (int x=0; x<width; ++x) {
+      set_cell(x, 0, 0xff555555);
+      set_cell(x, height-1, 0xff555555);
+    }
+    for (int y=0; y<height; ++y) {
+      set_cell(0, y, 0xff555555);
+      set_cell(width-1, y, 0xff555555);
+    }
+    // Pillars:
+    for (long n = long(width)*height/512; n > 0; --n) {
+      set_cell(1 + rand_next()%(width-2), 1 + rand_next()%(height-2), rand_color());
+    }
+    // Wall segments:
+    for (long n = long(width)*height/8192; n > 0; --n) {
+      int x = 1 + rand_next()%(width-2);
+      int y = 1 + rand_next()%(height-2);
+      int len = 4 + rand_next()%29;
+      bool horizontal = rand_next() & 1;
+      uint32_t c = rand_color();
+      for (int i=0; i<len; ++i, horizontal ? ++x : ++y) {
+        if (x >= width-1 || y >= height-1) break;
+        set_cell(x, y, c);
+      }
+    }
+    PlayerStart start = { width>>1, height>>1 };
+    for (int x=start.x-3; x<=start.x+3; ++x) {
+      for (int y=start.y-3; y<=start.y+3; ++y) {
+        set_cell(x, y, 0);
+      }
+    }
+    m_player_starts.push_back(start);
+    build_distance_field();
+  }
+
+  // For each cell, works out the Chebyshev distance d to the nearest wall, treating anything
+  // outside the map as a wall. That is, 0 for a wall, otherwise every cell within d-1 cells of
+  // it (in X and Y, i.e. the (2d-1)x(2d-1) square around it) is empty. The tracer uses this to
+  // leap over open space (see trace_columns_scalar()). This is a 2-pass chamfer transform with
+  // 8 neighbours. Distances saturate at 255, which only means leaps are shorter than they could be.
+  //NOTE: This must be called again after changing any cells.
+  void build_distance_field() {
+    std::vector<uint8_t> d(size_t(m_width)*m_height);
+    auto at = [&](int x, int y) -> int { return in_bounds(x,y) ? d[x + size_t(y)*m_width] : 0; };
+    for (int y=0; y<m_height; ++y) {
+      for (int x=0; x<m_width; ++x) {
+        int v = 0;
+        if (!cell(x,y)) {
+          v = std::min({ at(x-1,y-1), at(x,y-1), at(x+1,y-1), at(x-1,y) }) + 1;
+        }
+        d[x + size_t(y)*m_width] = std::min(v, 255);
+      }
+    }
+    for (int y=m_height-1; y>=0; --y) {
+      for (int x=m_width-1; x>=0; --x) {
+        int v = d[x + size_t(y)*m_width];
+        if (v) {
+          v = std::min({ v, at(x+1,y+1)+1, at(x,y+1)+1, at(x-1,y+1)+1, at(x+1,y)+1 });
+          d[x + size_t(y)*m_width] = std::min(v, 255);
+        }
+      }
+    }
+    // Store it in the map's own layout, so it's as cache-friendly as the cells themselves:
+    m_dist_store.assign(dist_bytes(), 0);
+    for (int y=0; y<m_height; ++y) {
+      for (int x=0; x<m_width; ++x) {
+        m_dist_store[offset_any(x,y)] = d[x + size_t(y)*m_width];
+      }
+    }
+    m_dist = m_dist_store.data();
+  }
+
+  // Bytes of cell data (including padding)...
+  size_t cells_bytes() const {
+    int stride;
+    return layout_bytes(m_width, m_height, m_layout, stride) + 4;
+  }
+
+  // ...and of distance field, which has one byte per cell:
+  size_t dist_bytes() const {
+    return (m_layout == MAP_LAYOUT_ROWMAJOR32) ? cells_bytes()/4 : cells_bytes();
+  }
+
+  // Writes the map to a binary map file (see map_file_header_t), optionally with its distance field:
+  bool save_binary(const char *filename, bool with_dist) const {
+    auto align = [](uint64_t n) { return (n + 63) & ~uint64_t(63); };
+    map_file_header_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "RBXM", 4);
+    h.version = MAP_FILE_VERSION;
+    h.layout = m_layout;
+    h.width = m_width;
+    h.height = m_height;
+    h.stride = m_stride;
+    h.flags = with_dist ? MAP_FILE_DIST : 0;
+    h.palette_size = m_palette_size;
+    h.start_count = m_player_starts.size();
+    h.cells_offset = align(sizeof(h));
+    h.cells_bytes = cells_bytes();
+    h.dist_offset = with_dist ? align(h.cells_offset + h.cells_bytes) : 0;
+    h.dist_bytes = with_dist ? dist_bytes() : 0;
+    h.starts_offset = align(with_dist ? h.dist_offset + h.dist_bytes : h.cells_offset + h.cells_bytes);
+    memcpy(h.palette, m_palette, sizeof(h.palette));
+    std::vector<uint32_t> starts;
+    for (PlayerStart p : m_player_starts) {
+      starts.push_back(p.x);
+      starts.push_back(p.y);
+    }
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+      printf("ERROR: Failed to open binary map file: %s\n", filename);
+      return false;
+    }
+    auto write_at = [&](uint64_t offset, const void *data, size_t bytes) {
+      static const uint8_t zeros[64] = {};
+      long pad = long(offset) - ftell(fp);
+      if (pad > 0) fwrite(zeros, 1, pad, fp);
+      fwrite(data, 1, bytes, fp);
+    };
+    write_at(0, &h, sizeof(h));
+    write_at(h.cells_offset, m_cells, h.cells_bytes);
+    if (with_dist) write_at(h.dist_offset, m_dist, h.dist_bytes);
+    write_at(h.starts_offset, starts.data(), starts.size()*4);
+    bool ok = !ferror(fp);
+    if (fclose(fp) != 0) ok = false;
+    if (!ok) printf("ERROR: Failed writing binary map file: %s\n", filename);
+    return ok;
+  }
+
+  // Loads a binary map file (see save_binary()). The cells and distance field are used in place,
+  // from the memory-mapped file, so all this does is check that the header makes sense. If the
+  // file has no distance field, it's worked out here (as load_from_rgb24() would).
+  //NOTE: The cells and distance field themselves aren't checked, so this trusts that the file was
+  // written by save_binary(): A distance field that doesn't match the cells could make --accel
+  // leap through walls.
+  bool load_binary(const char *filename) {
+    std::unique_ptr<RayboxMappedFile> file(new RayboxMappedFile());
+    if (!file->open(filename)) {
+      printf("ERROR: Failed to open binary map file: %s\n", filename);
+      return false;
+    }
+    const map_file_header_t &h = *(const map_file_header_t*)file->m_data;
+    auto section_ok = [&](uint64_t offset, uint64_t bytes) {
+      return offset % 64 == 0 && offset >= sizeof(h) && offset <= file->m_size && bytes <= file->m_size - offset;
+    };
+    if (file->m_size < sizeof(h) || memcmp(h.magic, "RBXM", 4) || h.version != MAP_FILE_VERSION) {
+      printf("ERROR: Not a (version %d) binary map file: %s\n", MAP_FILE_VERSION, filename);
+      return false;
+    }
+    int stride = 0;
+    size_t bytes = 0;
+    bool ok = h.layout < MAP_LAYOUT_COUNT && h.palette_size <= 256 &&
+      h.width >= 1 && h.height >= 1 && h.width <= MAP_MAX_SIZE && h.height <= MAP_MAX_SIZE;
+    if (ok) bytes = layout_bytes(h.width, h.height, h.layout, stride) + 4;
+    ok = ok && uint32_t(stride) == h.stride && h.cells_bytes == bytes && section_ok(h.cells_offset, h.cells_bytes);
+    if (ok && (h.flags & MAP_FILE_DIST)) {
+      ok = h.dist_bytes == ((h.layout == MAP_LAYOUT_ROWMAJOR32) ? bytes/4 : bytes) && section_ok(h.dist_offset, h.dist_bytes);
+    }
+    ok = ok && h.start_count <= file->m_size/8 && section_ok(h.starts_offset, uint64_t(h.start_count)*8);
+    if (!ok) {
+      printf("ERROR: Bad or truncated binary map file: %s\n", filename);
+      return false;
+    }
+    PlayerStarts starts;
+    const uint32_t *p = (const uint32_t*)(file->m_data + h.starts_offset);
+    for (uint32_t i=0; i<h.start_count; ++i, p += 2) {
+      if (p[0] >= h.width || p[1] >= h.height) {
+        printf("ERROR: Player start %u is outside the map: %s\n", i+1, filename);
+        return false;
+      }
+      starts.push_back({ int(p[0]), int(p[1]) });
+    }
+    m_width = h.width;
+    m_height = h.height;
+    m_layout = h.layout;
+    m_stride = h.stride;
+    m_store.clear();
+    m_store.shrink_to_fit();
+    m_cells = (uint8_t*)file->m_data + h.cells_offset;
+    memcpy(m_palette, h.palette, sizeof(m_palette));
+    m_palette_size = h.palette_size;
+    m_last_index = 0;
+    m_player_starts = starts;
+    m_dist_store.clear();
+    m_dist = (h.flags & MAP_FILE_DIST) ? file->m_data + h.dist_offset : NULL;
+    m_file = std::move(file);
+    if (!m_dist) build_distance_field();
+    return true;
+  }
+
+  // Distance from x,y to the nearest wall (see build_distance_field()); 0 for walls:
+  template<int LAYOUT>
+  int wall_distance(int x, int y) const { return m_dist[offset<LAYOUT>(x,y)]; }
+
+  void debug_print_map() {
+    int m;
+    for (int y=0; y<m_height; ++y) {
+      for (int x=0; x<m_width; ++x) {
+        m = 
+          ((cell(x,y)&0x000000ff) ? 1 : 0) | // blue.
+          ((cell(x,y)&0x0000ff00) ? 2 : 0) | // green.
+          ((cell(x,y)&0x00ff0000) ? 4 : 0);  // red.
+        putchar(m ? m+'0' : ' ');
+      }
+      printf("\n");
+    }
+    int n = 0;
+    for (PlayerStart p : m_player_starts) {
+      ++n;
+      printf("Player start %d: %d,%d\n", n, p.x, p.y);
+    }
+  }
+
+};
+
+
+// Leaps a ray (in raybox_dda()) through a square of empty cells: It takes all of the ray's
+// gridline crossings on two axes, a and b, until the next one would be its r+1th on either axis
+// (or, if BOUNDED, beyond maxDist). It sets na and nb to how many it took on each, advances their
+// tracking distances past them, and sets side to that of the last one, if it took any. aIsX says
+// whether a is the X axis, as the DDA crosses Y first on ties.
+// The distances are still accumulated one crossing at a time, as that's the only way to land on
+// exactly what stepping would have. But each axis' distances are the same however its crossings
+// interleave with the other's, so it can take one axis at a time, without the DDA's unpredictable
+// branch: It finds where a would leave (so a should be the axis with more crossings), takes b's
+// crossings up to there, and then, if b's next crossing comes first instead, a's up to that.
+template<typename N, bool BOUNDED>
+inline void raybox_leap(
+  N &trackAdist, N stepAdist, N &trackBdist, N stepBdist, bool aIsX, int r, N maxDist,
+  int &na, int &nb, int &side
+) {
+  // Does a's crossing at distance a come before b's at distance b?
+  auto aFirst = [aIsX](N a, N b) { return aIsX ? (a < b) : !(b < a); };
+  N aExit = trackAdist, aLast = trackAdist;
+  int aExits = 0;
+  while (aExits < r && !(BOUNDED && aExit > maxDist)) {
+    aLast = aExit;
+    aExit += stepAdist;
+    ++aExits;
+  }
+  N bLast = trackBdist;
+  nb = 0;
+  while (nb < r && !aFirst(aExit, trackBdist) && !(BOUNDED && trackBdist > maxDist)) {
+    bLast = trackBdist;
+    trackBdist += stepBdist;
+    ++nb;
+  }
+  if (aFirst(aExit, trackBdist)) {
+    na = aExits;
+    trackAdist = aExit;
+  }
+  else {
+    na = 0;
+    while (aFirst(trackAdist, trackBdist)) {
+      aLast = trackAdist;
+      trackAdist += stepAdist;
+      ++na;
+    }
+  }
+  // The last crossing taken (if any) is the later of each axis' last one:
+  const int aSide = aIsX ? 0 : 1;
+  if (na && (!nb || !aFirst(aLast, bLast))) side = aSide;
+  else if (nb) side = 1-aSide;
+}
+
+//SMELL: Work out height correctly re view aspect ratio and FOV:
+#define HEIGHT_FROM_DIST(d,view_height) ((view_height)/2/(d))
+
+// The wall hit at distance dist covers rows [2*(H/2)-stop, stop) of a view H rows high. (h is
+// checked while it's still a float, as a wall right up against the camera can be too tall for int.)
+inline int wall_stop_for_dist(int H, float dist) {
+  float h = HEIGHT_FROM_DIST(dist, H);
+  return (h < float(H)) ? std::max(H/2, std::min(H, H/2 + int(h))) : H;
+}
+
+// What a ray found (see raybox_dda_t::result, and raybox_hit_t::result):
+enum {
+  RAYBOX_RAY_NONE,  // Nothing within the ray's maxDist.
+  RAYBOX_RAY_WALL,  // Hit a wall.
+  RAYBOX_RAY_EDGE,  // Left the map (or started outside it) without hitting a wall.
+};
+
+// Where raybox_dda() took a ray:
+template<typename N>
+struct raybox_dda_t {
+  N dist;               // Distance to the last gridline crossed (or maxDist, if it stopped before the next one).
+  int mapX, mapY;       // The cell beyond that gridline.
+  int side;             // 0 if that was an X gridline, 1 if Y.
+  uint32_t wallHit;     // The cell's raw value (see RayboxMap::cell_raw()) if it's a wall, otherwise 0.
+  int result;           // RAYBOX_RAY_*
+  uint32_t iterations;  // DDA steps and leaps taken.
+  uint32_t cells;       // Gridlines crossed.
+};
+
+// The DDA (Digital Differential Analysis) that all of the scalar tracers share: raybox's column
+// tracer (with any of its numeric backends as N), RayboxQuery and RayboxBatchRenderer. It traces a ray from origin along
+// rayDir, given its step distances (i.e. |1/rayDir|, which the caller might look up rather than
+// divide for), to the first (nearest) edge it hits that belongs to an occupied map cell. The cell
+// the ray starts in isn't tested.
+// If ACCEL is true, it uses the map's distance field to skip over runs of empty cells (see
+// RayboxMap::build_distance_field()).
+// If BOUNDED is true, it also stops before crossing a gridline beyond maxDist, or on leaving the
+// map. Otherwise the map must be closed, and the ray must start inside it.
+template<typename N, int LAYOUT, bool ACCEL, bool BOUNDED>
+inline void raybox_dda(
+  const RayboxMap &map, N originX, N originY, N rayDirX, N rayDirY, N stepXdist, N stepYdist, N maxDist,
+  raybox_dda_t<N> &out
+) {
+  // Get the origin's map cell (but note that we'll modify these values in each iteration):
+  int mapX = int(originX);
+  int mapY = int(originY);
+  // Find out the distance our ray would normally travel to go from one full map grid line to the next,
+  // for grid lines on each of the X and Y axes. Work this out for the "forward" direction of the ray:
+  const int stepX = (rayDirX>N(0)) ? +1 : -1;
+  const int stepY = (rayDirY>N(0)) ? +1 : -1;
+  // Track separate distance counters for tracing through X gridlines and Y gridlines.
+  // Start with the initial distances for each that reach the first gridlines;
+  // these are scaled versions of stepXdist and stepYdist, based on on where the
+  // camera origin (i.e. player) is within the current map cell.
+  N trackXdist = ((rayDirX>N(0)) ? N(mapX+1)-originX : originX-N(mapX))*stepXdist;
+  N trackYdist = ((rayDirY>N(0)) ? N(mapY+1)-originY : originY-N(mapY))*stepYdist;
+  // Count the X and Y gridlines we've crossed (for raybox_dda_t::cells):
+  int crossedX = 0, crossedY = 0;
+  // With ACCEL, the distance field doubles as the wall test (so we only read one byte per cell
+  // visited), and the cell itself is only read once we've hit it:
+  int wallDist = ACCEL ? map.wall_distance<LAYOUT>(mapX, mapY) : 0;
+  uint32_t wallHit = 0, iterations = 0;
+  int side = 0;
+  int result = RAYBOX_RAY_WALL;
+  while (true) {
+    if (ACCEL) {
+      // Every cell within (Chebyshev) distance r of the current one is empty, so leap through
+      // that square without reading the map. Leaps land exactly where stepping would have (see
+      // raybox_leap()), so they can't change where a ray goes: They only save the map reads.
+      const int r = wallDist-1;
+      if (r > 0) {
+        int nx, ny;
+        if (stepXdist < stepYdist) {
+          raybox_leap<N, BOUNDED>(trackXdist, stepXdist, trackYdist, stepYdist, true, r, maxDist, nx, ny, side);
+        }
+        else {
+          raybox_leap<N, BOUNDED>(trackYdist, stepYdist, trackXdist, stepXdist, false, r, maxDist, ny, nx, side);
+        }
+        mapX += nx*stepX;
+        mapY += ny*stepY;
+        crossedX += nx;
+        crossedY += ny;
+        ++iterations;
+      }
+    }
+    if (trackXdist < trackYdist) {
+      if (BOUNDED && trackXdist > maxDist) {
+        result = RAYBOX_RAY_NONE;
+        break;
+      }
+      // If the X-tracking distance is currently the nearest, then it means our ray is intersecting
+      // now with an X gridline (vertical). In other words, it is entering the next X column
+      // so we'll want to inspect that first:
+      mapX += stepX;
+      // Meanwhile, make sure the next time we check our X-tracking distance, it has been
+      // advanced to match the start of the next X column, i.e. it is preemptively overshot:
+      trackXdist += stepXdist;
+      ++crossedX;
+      // We're inspecting an intersection at side 0 (X gridline, aka NS, aka vertical).
+      side = 0;
+    }
+    else {
+      if (BOUNDED && trackYdist > maxDist) {
+        result = RAYBOX_RAY_NONE;
+        side = 1; // (The gridline we'd have crossed next.)
+        break;
+      }
+      mapY += stepY;
+      trackYdist += stepYdist;
+      ++crossedY;
+      side = 1;
+    }
+    ++iterations;
+    if (BOUNDED && !map.in_bounds(mapX, mapY)) {
+      result = RAYBOX_RAY_EDGE;
+      break;
+    }
+    // Is there a wall at our updated mapX,Y?
+    if (ACCEL) {
+      wallDist = map.wall_distance<LAYOUT>(mapX, mapY);
+      if (wallDist) continue;
+    }
+    wallHit = map.cell_raw<LAYOUT>(mapX, mapY);
+    if (wallHit) break;
+  }
+  // "side" tells us which side (and hence which distance tracker) represents where the ray
+  // stopped. The distance to it is that of the last gridline we crossed on that axis, because
+  // the algorithm above overshoots by 1 extra step in each iteration (as it was preparing for
+  // the next iteration):
+  if (BOUNDED && result == RAYBOX_RAY_NONE) {
+    out.dist = maxDist;
+  }
+  else {
+    out.dist = (side==0) ? (trackXdist-stepXdist) : (trackYdist-stepYdist);
+  }
+  //NOTE: dist is the actual distance, but based on normalising the base ray length
+  // (i.e. inverse scaling such that the base ray length would be 1.0).
+  out.mapX = mapX;
+  out.mapY = mapY;
+  out.side = side;
+  out.wallHit = wallHit;
+  out.result = result;
+  out.iterations = iterations;
+  out.cells = uint32_t(crossedX + crossedY);
+}
+
+// Pool of persistent worker threads that runs a job over a number of chunks,
+// e.g. groups of screen columns. Each worker starts with its own contiguous
+// range of chunks, taking them from the front; once that's empty, it steals
+// chunks from the back of the other workers' ranges. The calling thread
+// takes part as worker 0, so a pool of N workers only spawns N-1 threads.
+class RayboxThreadPool {
+public:
+
+  // Each worker's remaining range of chunks is packed into one 64-bit word
+  // (head in the low half, tail in the high half) so that the owner (popping
+  // the head) and thieves (popping the tail) can both claim a chunk with a
+  // single CAS. Padded to a cache line each, to avoid false sharing:
+  struct alignas(64) chunk_queue_t {
+    std::atomic<uint64_t> range;
+  };
+
+  int m_count;
+  std::vector<std::thread> m_threads;
+  chunk_queue_t *m_queues;
+  const std::function<void(int)> *m_job;
+  std::mutex m_mutex;
+  std::condition_variable m_wake;
+  std::condition_variable m_done;
+  uint64_t m_generation;    // Bumped for each job; workers wait for it to change.
+  std::atomic<int> m_busy;  // Workers (other than the caller) still working on the current job.
+  bool m_quit;
+
+  RayboxThreadPool(int count) {
+    m_count = (count < 1) ? 1 : count;
+    m_queues = new chunk_queue_t[m_count];
+    m_job = NULL;
+    m_generation = 0;
+    m_busy = 0;
+    m_quit = false;
+    for (int i=1; i<m_count; ++i) {
+      m_threads.push_back(std::thread(&RayboxThreadPool::worker, this, i));
+    }
+  }
+
+  ~RayboxThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_quit = true;
+    }
+    m_wake.notify_all();
+    for (std::thread &t : m_threads) t.join();
+    delete[] m_queues;
+  }
+
+  static uint64_t pack(uint32_t head, uint32_t tail) { return uint64_t(tail)<<32 | head; }
+
+  // Claim the next chunk from the front of our own queue:
+  bool pop_own(int w, int &chunk) {
+    uint64_t r = m_queues[w].range.load(std::memory_order_relaxed);
+    while (true) {
+      uint32_t head = r, tail = r>>32;
+      if (head >= tail) return false;
+      if (m_queues[w].range.compare_exchange_weak(r, pack(head+1, tail), std::memory_order_acq_rel)) {
+        chunk = head;
+        return true;
+      }
+    }
+  }
+
+  // Claim the last chunk from the back of another worker's queue:
+  bool steal(int victim, int &chunk) {
+    uint64_t r = m_queues[victim].range.load(std::memory_order_relaxed);
+    while (true) {
+      uint32_t head = r, tail = r>>32;
+      if (head >= tail) return false;
+      if (m_queues[victim].range.compare_exchange_weak(r, pack(head, tail-1), std::memory_order_acq_rel)) {
+        chunk = tail-1;
+        return true;
+      }
+    }
+  }
+
+  // Work through our own chunks, then everyone else's, until there's nothing left:
+  void drain(int w) {
+    const std::function<void(int)> &job = *m_job;
+    int chunk;
+    while (pop_own(w, chunk)) job(chunk);
+    for (int n=1; n<m_count; ++n) {
+      int victim = (w+n) % m_count;
+      while (steal(victim, chunk)) job(chunk);
+    }
+  }
+
+  void worker(int w) {
+    uint64_t seen = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_wake.wait(lock, [&]{ return m_quit || m_generation != seen; });
+        if (m_quit) return;
+        seen = m_generation;
+      }
+      drain(w);
+      if (--m_busy == 0) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_done.notify_one();
+      }
+    }
+  }
+
+  // Runs job(chunk) for every chunk in [0,chunks), spread over all workers,
+  // and returns once they've all been done.
+  void run(int chunks, const std::function<void(int)> &job) {
+    if (m_count == 1) {
+      for (int c=0; c<chunks; ++c) job(c);
+      return;
+    }
+    for (int w=0; w<m_count; ++w) {
+      uint32_t head = uint64_t(chunks)*w/m_count;
+      uint32_t tail = uint64_t(chunks)*(w+1)/m_count;
+      m_queues[w].range.store(pack(head, tail), std::memory_order_relaxed);
+    }
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_job = &job;
+      m_busy = m_count-1;
+      ++m_generation;
+    }
+    m_wake.notify_all();
+    drain(0);
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [&]{ return m_busy == 0; });
+  }
+
+};
+
+
+// ---- Batched ray queries ----
+
+// A ray to query. Distances are in multiples of the direction's length, so with a unit direction
+// they're in cells. (With raybox's own column rays, i.e. heading + view*cameraX, they're the
+// perpendicular distances that it renders with.) The direction mustn't be zero, but maxDist can
+// be INFINITY.
+struct raybox_ray_t {
+  float originX, originY;
+  float dirX, dirY;
+  float maxDist;
+};
+
+struct raybox_hit_t {
+  float dist;         // Distance to the wall face hit (or to where the ray stopped).
+  float hitX, hitY;   // The point at that distance along the ray.
+  int32_t mapX, mapY; // Cell hit (or that the ray stopped in or left the map from).
+  uint32_t color;     // Colour of the wall hit (0 if none).
+  uint8_t side;       // Gridline that the ray hit (or last crossed): 0 for X, 1 for Y.
+  uint8_t result;     // RAYBOX_RAY_*
+};
+
+// Traces single rays or batches of them against a RayboxMap, with the same DDA (and the same float
+// arithmetic) as raybox's scalar column tracer, so a query along a screen column's ray gets exactly
+// the hit that was rendered. Like the renderer, the cell that a ray starts in isn't tested.
+// Big batches are first binned by origin tile and direction octant, so that rays visiting the same
+// cells are traced together, then split into chunks for the thread pool. The map must not change
+// during trace().
+class RayboxQuery {
+public:
+  int m_threads;            // Worker threads (including the caller). 0 means one per core.
+  int m_chunk_rays;         // Rays per chunk of work for the thread pool.
+  bool m_sort;              // Bin big batches for coherence? Only batches of at least m_sort_min
+  size_t m_sort_min;        // rays, on maps with at least m_sort_map_bytes of cells, get binned:
+  size_t m_sort_map_bytes;  // On maps that fit in cache, it costs more than it saves.
+  bool m_accel;             // Skip empty space with the map's distance field?
+
+  RayboxQuery(int threads=1);
+  ~RayboxQuery();
+
+  // Traces count rays, writing each one's result to the same index of hits:
+  void trace(const RayboxMap &map, const raybox_ray_t *rays, raybox_hit_t *hits, size_t count);
+
+  // Traces one ray on the calling thread:
+  static void trace_one(const RayboxMap &map, const raybox_ray_t &ray, raybox_hit_t &hit, bool accel=true);
+
+private:
+  std::unique_ptr<RayboxThreadPool> m_pool;
+  std::vector<uint32_t> m_order;  // Ray indices, sorted by bin (see bin_rays()).
+  std::vector<uint32_t> m_bins;   // Counts, then start offsets, for each bin.
+  std::vector<uint16_t> m_keys;   // Each ray's bin.
+
+  void bin_rays(const RayboxMap &map, const raybox_ray_t *rays, size_t count);
+};
+
+
+// ---- Batched rendering ----
+
+#define RAYBOX_BATCH_MAX_WIDTH 1024 // Widest view that RayboxBatchRenderer will render.
+
+// A camera to render a view from (cf. raybox's RayboxCamera): view is the view plane, i.e.
+// perpendicular to heading, and as long as heading times tan(FOV/2). Column x of a W-column view
+// looks along heading + view*cameraX, where cameraX = 2x/W - 1.
+struct raybox_camera_t {
+  float x, y;
+  float headingX, headingY;
+  float viewX, viewY;
+};
+
+// Renders lots of small views at once without a window, e.g. first-person observations for many
+// simulated agents. Each view is drawn just as raybox draws its own (with flat walls, and the same
+// tracer), so the same camera at the same size gets exactly the same pixels. They all go into one
+// contiguous output: camera i's view is the width*height pixels (row-major, BGRA as in raybox's
+// framebuffer) starting at out + i*width*height. Each view is rendered whole by one thread, with
+// chunks of cameras shared out among the pool. render() doesn't allocate anything.
+class RayboxBatchRenderer {
+public:
+  int m_threads;            // Worker threads (including the caller). 0 means one per core.
+  int m_chunk_cameras;      // Cameras per chunk of work for the thread pool.
+  bool m_accel;             // Skip empty space with the map's distance field?
+  uint32_t m_sky_color, m_floor_color;
+
+  RayboxBatchRenderer(int threads=1);
+  ~RayboxBatchRenderer();
+
+  // Renders count cameras' views into out, which must have room for count*width*height pixels.
+  // Returns false if the view size isn't supported:
+  bool render(const RayboxMap &map, const raybox_camera_t *cams, size_t count, int width, int height, uint32_t *out);
+
+private:
+  std::unique_ptr<RayboxThreadPool> m_pool;
+  std::function<void(int)> m_job;  // Renders a chunk of the current batch (made once, in the constructor).
+  void (*m_trace)(const RayboxMap &map, const raybox_ray_t &ray, raybox_hit_t &hit);
+  // The batch that render() is working on:
+  const RayboxMap *m_map;
+  const raybox_camera_t *m_cams;
+  size_t m_count;
+  int m_width, m_height;
+  uint32_t *m_out;
+
+  void render_view(size_t i) const;
+};
+
+#endif // LIBRAYBOX_H
@@ -1,10 +1,30 @@
 #include <stdio.h>
+#include <string.h>
 #include <stdexcept>
 #include <list>
 #include <tuple>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <type_traits>
+#include <string>
+#include <cmath>
+#include <memory>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
 #include <SDL2/SDL_ttf.h>
+#include "libraybox.h"
 
 // See also:
 // https://gamedev.stackexchange.com/a/135894
@@ -16,11 +36,18 @@
 // #define VIEW_WIDTH  1760
 // #define VIEW_HEIGHT 1320
 
+// Default view size, which can be changed at run time with --view (see view_shape_t for the sizes
+// that the trace/render core is specialised for), or at build time, e.g. make CXXFLAGS="-O2 -DVIEW_WIDTH=1680 -DVIEW_HEIGHT=1200"
+#ifndef VIEW_WIDTH
 #define VIEW_WIDTH  640
+#endif
+#ifndef VIEW_HEIGHT
 #define VIEW_HEIGHT 480
-#define FBSIZE (VIEW_WIDTH*VIEW_HEIGHT*4)
+#endif
+#define VIEW_MAX_SIZE 8192
 
-#define S(fb,x,y,n) (fb[((x)+((y)*VIEW_WIDTH))*4+(n)])
+// (For use in RayboxSystem, whose framebuffer rows are m_view_width pixels apart):
+#define S(fb,x,y,n) (fb[((x)+((y)*m_view_width))*4+(n)])
 #define T(fb,x,y) *(uint32_t*)(&S(fb,x,y,0))
 #define R(fb,x,y) S(fb,x,y,2)
 #define G(fb,x,y) S(fb,x,y,1)
@@ -29,16 +56,124 @@
 
 #define PI 3.141592653589793
 
-#define MAP_FILE "assets/raybox-map.png"
-#define MAP_WIDTH 64
-#define MAP_HEIGHT 64
-#define MAP_OVERLAY_SCALE int(VIEW_HEIGHT/MAP_HEIGHT)
+#define DEFAULT_MAP_FILE "assets/raybox-map.png" // (Not MAP_FILE, which <sys/mman.h> has.)
 
-//SMELL: Work out height correctly re view aspect ratio and FOV:
-#define HEIGHT_FROM_DIST(d) (VIEW_HEIGHT/2/(d))
+#define SPRITE_NEAR_DIST 0.05 // Sprites nearer than this (along the heading) aren't drawn.
 
 typedef float num;
 
+// Fixed-point format used by the "fixed" tracer backend, to model the datapath of the
+// FPGA raybox. These can be overridden at build time to match whatever the Verilog uses:
+#ifndef RAYBOX_FIXED_INT_BITS
+#define RAYBOX_FIXED_INT_BITS 12  // Including sign bit.
+#endif
+#ifndef RAYBOX_FIXED_FRAC_BITS
+#define RAYBOX_FIXED_FRAC_BITS 12
+#endif
+#ifndef RAYBOX_RECIP_LUT_BITS
+#define RAYBOX_RECIP_LUT_BITS 10  // Reciprocal LUT has 2^N entries.
+#endif
+
+// Signed QI.F fixed-point number, stored in an int32_t. All arithmetic saturates
+// (rather than wraps) at the limits of the format, and multiplies truncate towards
+// -inf (i.e. just an arithmetic right shift), as they would in hardware.
+template<int I, int F>
+class Fixed {
+public:
+  static_assert(I+F <= 32, "Fixed<I,F> must fit in 32 bits");
+  static const int64_t MAX = (int64_t(1) << (I+F-1)) - 1;
+  static const int64_t MIN = -(int64_t(1) << (I+F-1));
+  static const int LUT_BITS = RAYBOX_RECIP_LUT_BITS;
+
+  int32_t raw;
+
+  Fixed() : raw(0) {}
+  Fixed(int i) : raw(sat(int64_t(i) * (int64_t(1) << F))) {}
+  Fixed(double d) : raw(sat(int64_t(floor(d * double(int64_t(1) << F) + 0.5)))) {}
+
+  static int32_t sat(int64_t r) { return (r > MAX) ? MAX : (r < MIN) ? MIN : int32_t(r); }
+  static Fixed from_raw(int64_t r) { Fixed f; f.raw = sat(r); return f; }
+
+  Fixed operator+(Fixed b) const { return from_raw(int64_t(raw) + b.raw); }
+  Fixed operator-(Fixed b) const { return from_raw(int64_t(raw) - b.raw); }
+  Fixed operator*(Fixed b) const { return from_raw((int64_t(raw) * b.raw) >> F); }
+  Fixed operator/(Fixed b) const {
+    if (b.raw == 0) return from_raw(raw < 0 ? MIN : MAX);
+    return from_raw((int64_t(raw) * (int64_t(1) << F)) / b.raw);
+  }
+  Fixed &operator+=(Fixed b) { return *this = *this + b; }
+  bool operator<(Fixed b) const { return raw < b.raw; }
+  bool operator>(Fixed b) const { return raw > b.raw; }
+  explicit operator float() const { return float(raw) / float(int64_t(1) << F); }
+  explicit operator double() const { return double(raw) / double(int64_t(1) << F); }
+  explicit operator int() const { return raw >> F; } // Floor, not truncate.
+
+  Fixed abs() const { return from_raw(raw < 0 ? -int64_t(raw) : int64_t(raw)); }
+
+  // Table of 2^32/m for each (LUT_BITS+1)-bit mantissa m in [2^LUT_BITS, 2^(LUT_BITS+1)),
+  // taken at the middle of each mantissa's range to centre the error:
+  struct recip_lut_t {
+    uint32_t v[1<<LUT_BITS];
+    constexpr recip_lut_t() : v() {
+      for (int i=0; i<(1<<LUT_BITS); ++i) {
+        v[i] = uint32_t(4294967296.0 / (double((1<<LUT_BITS) + i) + 0.5) + 0.5);
+      }
+    }
+  };
+
+  // 1/x, via a LUT lookup on the top LUT_BITS+1 bits of |x| (as the hardware would):
+  Fixed recip() const {
+    static constexpr recip_lut_t lut;
+    if (raw == 0) return from_raw(MAX);
+    uint32_t a = (raw < 0) ? -int64_t(raw) : raw;
+    int msb = 31 - __builtin_clz(a);
+    // Normalise a into m in [2^LUT_BITS, 2^(LUT_BITS+1)), i.e. a ~= m * 2^(msb-LUT_BITS):
+    uint32_t m = (msb >= LUT_BITS) ? (a >> (msb-LUT_BITS)) : (a << (LUT_BITS-msb));
+    // raw(1/x) = 2^(2F) / a = lut[m] * 2^(2F + LUT_BITS - msb - 32):
+    int64_t r = lut.v[m - (1<<LUT_BITS)];
+    int shift = 2*F + LUT_BITS - msb - 32;
+    r = (shift >= 0) ? ((shift > 30) ? MAX : (r << shift)) : ((-shift > 62) ? 0 : (r >> -shift));
+    return from_raw(raw < 0 ? -r : r);
+  }
+};
+
+typedef Fixed<RAYBOX_FIXED_INT_BITS, RAYBOX_FIXED_FRAC_BITS> fixed_num;
+
+// The tracer can be built for any of these numeric types (see trace_columns_scalar<N>()):
+enum { BACKEND_FLOAT, BACKEND_DOUBLE, BACKEND_FIXED };
+
+// Default backend, e.g. make raybox-fixed (which defines RAYBOX_BACKEND=BACKEND_FIXED):
+#ifndef RAYBOX_BACKEND
+#define RAYBOX_BACKEND BACKEND_FLOAT
+#endif
+
+const char *backend_name(int backend) {
+  switch (backend) {
+    case BACKEND_FLOAT:  return "float";
+    case BACKEND_DOUBLE: return "double";
+    case BACKEND_FIXED:  return "fixed";
+  }
+  return "?";
+}
+
+// Per-backend helpers that the tracer needs. The float and double versions of
+// num_recip_abs() do the original double-precision division.
+inline float  num_recip_abs(float x)  { return abs(1.0/x); }
+inline double num_recip_abs(double x) { return abs(1.0/x); }
+template<int I, int F> inline Fixed<I,F> num_recip_abs(Fixed<I,F> x) { return x.recip().abs(); }
+
+// cameraX for column x of a view w wide. Fixed can't hold 2*x for views wider than 1024
+// (Q12.12 tops out just under 2048), so it converts the float version instead:
+template<typename N>
+struct camera_x_math_t {
+  static N at(int x, int w) { return N(2*x) / N(w) - N(1); }
+};
+
+template<int I, int F>
+struct camera_x_math_t<Fixed<I,F>> {
+  static Fixed<I,F> at(int x, int w) { return Fixed<I,F>(double(float(2*x) / float(w) - 1.0f)); }
+};
+
 void describe_pixel_format(Uint32 format) {
   printf("Pixel format: %d (%x)\n", format, format);
   printf(
@@ -62,556 +197,5096 @@ void describe_pixel_format(Uint32 format) {
 }
 
 
-// typedef std::tuple<int,int> PlayerStart;
-typedef struct { int x, y; } PlayerStart;
-typedef std::list<PlayerStart> PlayerStarts;
+typedef struct {
+  num dist;
+  num hx, hy;
+  int side;
+  uint32_t color;
+  int mapX, mapY; // The map cell that was hit.
+} traced_column_t;
+
+// Snapshot of the camera state that's needed to trace a frame:
+typedef struct {
+  num playerX, playerY;
+  num headingX, headingY;
+  num viewX, viewY;
+} RayboxCamera;
+
+// Each column's ray direction and step distances (i.e. |1/rayDir|) for one heading, as looked up
+// from a RayboxRayTable: Column x's ray direction is (signX*dirX[x], signY*dirY[x]).
+struct ray_row_t {
+  const float *dirX, *dirY;
+  const float *stepX, *stepY;
+  float signX, signY;
+};
+
+// A billboard sprite (see RayboxSystem::render_sprites()), standing on the floor at x,y:
+struct sprite_t {
+  num x, y;
+  num size;       // Width and height, in cells. It's drawn as a disc of that diameter.
+  uint32_t color;
+};
 
+// A sprite as the camera sees it (see RayboxSystem::project_sprites()):
+struct sprite_view_t {
+  float depth;        // Distance along the heading, i.e. comparable with traced_column_t::dist.
+  float left, width;  // The columns it spans...
+  int x0, x1;         // ...and the view's columns whose centres it covers, [x0,x1).
+  int top, height;    // Rows that it spans (not clipped to the view).
+};
 
-class RayboxMap {
-public:
-  uint32_t m_map[MAP_WIDTH*MAP_HEIGHT]; // Map is stored as BGRX. //SMELL: Use 2D array instead to simplify derefs?
-  PlayerStarts m_player_starts;
-
-  RayboxMap() {
-    // Init a usable, but dummy map.
-    // Fill map with red walls (BGRA order):
-    for (int x=0; x<MAP_WIDTH; ++x) {
-      for (int y=0; y<MAP_HEIGHT; ++y) {
-        *cell(x,y) = 0x0000ffff;
-      }
-    }
-    // Start with a player position in the middle of the map:
-    PlayerStart start = { MAP_WIDTH>>1, MAP_HEIGHT>>1 };
-    // Hollow out a part of the map around our player start position:
-    for (int x=start.x-3; x<start.x+3; ++x) {
-      for (int y=start.y-3; y<start.y+3; ++y) {
-        *cell(x,y) = 0;
-      }
-    }
-    m_player_starts.push_back(start);
-  }
-
-  uint32_t *cell(int x, int y) {
-    return &(m_map[x+y*MAP_WIDTH]);
-  }
-
-  // This assumes s->format->format==SDL_PIXELFORMAT_RGB24:
-  // See also: https://wiki.libsdl.org/SDL2/SDL_GetRGBA
-  bool load_from_surface(SDL_Surface *s) {
-    uint8_t r, g, b, a;
-    a = 255;
-    m_player_starts.clear();
-    SDL_LockSurface(s);
-    for (int y=0; y<MAP_HEIGHT; ++y) {
-      for (int x=0; x<MAP_WIDTH; ++x) {
-        r = ((uint8_t*)(s->pixels))[y*s->pitch + x*3 + 0];
-        g = ((uint8_t*)(s->pixels))[y*s->pitch + x*3 + 1];
-        b = ((uint8_t*)(s->pixels))[y*s->pitch + x*3 + 2];
-        if (r==255 && b==255) {
-          // Player position:
-          *cell(x,y) = 0;
-          PlayerStart player = {x,y};
-          m_player_starts.push_back(player);
-        }
-        else {
-          *cell(x,y) = (r+g+b==0) ? 0 : (a<<24)|(r<<16)|(g<<8)|b;
-        }
-      }
+// Stable LSD radix sort of items by their 32-bit keys, 8 bits at a time, skipping any byte
+// that's the same in every key. Sorts keys and items in place, using tmp_* as scratch space:
+static void radix_sort_u32(
+  std::vector<uint32_t> &keys, std::vector<uint32_t> &items,
+  std::vector<uint32_t> &tmp_keys, std::vector<uint32_t> &tmp_items
+) {
+  const size_t n = keys.size();
+  tmp_keys.resize(n);
+  tmp_items.resize(n);
+  for (int shift = 0; shift < 32; shift += 8) {
+    uint32_t count[256] = {0};
+    for (size_t i = 0; i < n; ++i) ++count[(keys[i] >> shift) & 0xff];
+    if (n == 0 || count[(keys[0] >> shift) & 0xff] == n) continue;
+    uint32_t start = 0;
+    for (int b = 0; b < 256; ++b) {
+      uint32_t c = count[b];
+      count[b] = start;
+      start += c;
     }
-    SDL_UnlockSurface(s);
-    return true;
+    for (size_t i = 0; i < n; ++i) {
+      uint32_t j = count[(keys[i] >> shift) & 0xff]++;
+      tmp_keys[j] = keys[i];
+      tmp_items[j] = items[i];
+    }
+    keys.swap(tmp_keys);
+    items.swap(tmp_items);
   }
+}
 
-  void debug_print_map() {
-    int m;
-    for (int y=0; y<MAP_HEIGHT; ++y) {
-      for (int x=0; x<MAP_WIDTH; ++x) {
-        m = 
-          ((*cell(x,y)&0x000000ff) ? 1 : 0) | // blue.
-          ((*cell(x,y)&0x0000ff00) ? 2 : 0) | // green.
-          ((*cell(x,y)&0x00ff0000) ? 4 : 0);  // red.
-        putchar(m ? m+'0' : ' ');
-      }
-      printf("\n");
+
+
+// Packet tracing: Trace 8 (AVX2) or 16 (AVX-512) adjacent screen columns at once,
+// doing the same DDA as RayboxSystem::trace_columns() in each SIMD lane. The
+// "step on X or Y?" choice is a masked compare/blend, map cells are fetched with
+// a masked gather, and lanes retire (drop out of the mask) as they hit walls.
+// Neighbouring columns mostly pass through the same cells, so lanes tend to
+// retire at around the same time.
+//
+//NOTE: Tolerance vs. the scalar tracer: Every lane does exactly the same
+// single-precision operations, in the same order, as the scalar code (the
+// scalar code's double-precision 1.0/rayDir and -1.0 round to the same float
+// results), so when built with -ffp-contract=off (as the Makefile does) the
+// output is bit-identical. Without that, GCC fuses multiply-adds into FMAs
+// wherever the target has them (which includes the AVX-512 path, and the scalar
+// path with -march=native), in which case dist/hx/hy may differ by a few ULPs,
+// and a ray that grazes a cell corner to within that error may report the other
+// side/cell. Use --bench-verify to check.
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RAYBOX_SIMD 1
+
+enum { SIMD_OFF = 1, SIMD_AVX2 = 8, SIMD_AVX512 = 16 }; // i.e. lanes per packet.
+
+// Spill lanes out to the AoS traces array:
+static inline void store_packet(
+  traced_column_t *out, int lanes,
+  const float *dist, const float *hx, const float *hy, const int32_t *side, const uint32_t *color,
+  const int32_t *mapX, const int32_t *mapY
+) {
+  for (int i=0; i<lanes; ++i) {
+    out[i].dist  = dist[i];
+    out[i].hx    = hx[i];
+    out[i].hy    = hy[i];
+    out[i].side  = side[i];
+    out[i].color = color[i];
+    out[i].mapX  = mapX[i];
+    out[i].mapY  = mapY[i];
+  }
+}
+
+// Gathers the raw cell values (see RayboxMap::cell_raw()) at mapX,mapY for each active lane:
+template<int LAYOUT>
+__attribute__((target("avx2")))
+static inline __m256i map_gather_avx2(const RayboxMap &map, __m256i mapX, __m256i mapY, __m256i active) {
+  const __m256i stride = _mm256_set1_epi32(map.m_stride);
+  if (LAYOUT == MAP_LAYOUT_ROWMAJOR32) {
+    __m256i index = _mm256_add_epi32(mapX, _mm256_mullo_epi32(mapY, stride));
+    return _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), (const int*)map.m_cells, index, active, 4);
+  }
+  __m256i offset;
+  if (LAYOUT == MAP_LAYOUT_TILED) {
+    const __m256i m = _mm256_set1_epi32((1<<MAP_TILE_BITS)-1);
+    __m256i tile = _mm256_add_epi32(
+      _mm256_mullo_epi32(_mm256_srli_epi32(mapY, MAP_TILE_BITS), stride),
+      _mm256_srli_epi32(mapX, MAP_TILE_BITS)
+    );
+    offset = _mm256_or_si256(
+      _mm256_slli_epi32(tile, 2*MAP_TILE_BITS),
+      _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(mapY, m), MAP_TILE_BITS), _mm256_and_si256(mapX, m))
+    );
+  }
+  else if (LAYOUT == MAP_LAYOUT_MORTON) {
+    __m256i v[2] = { mapX, mapY };
+    for (int i=0; i<2; ++i) {
+      v[i] = _mm256_and_si256(_mm256_or_si256(v[i], _mm256_slli_epi32(v[i], 8)), _mm256_set1_epi32(0x00ff00ff));
+      v[i] = _mm256_and_si256(_mm256_or_si256(v[i], _mm256_slli_epi32(v[i], 4)), _mm256_set1_epi32(0x0f0f0f0f));
+      v[i] = _mm256_and_si256(_mm256_or_si256(v[i], _mm256_slli_epi32(v[i], 2)), _mm256_set1_epi32(0x33333333));
+      v[i] = _mm256_and_si256(_mm256_or_si256(v[i], _mm256_slli_epi32(v[i], 1)), _mm256_set1_epi32(0x55555555));
+    }
+    offset = _mm256_or_si256(v[0], _mm256_slli_epi32(v[1], 1));
+  }
+  else {
+    offset = _mm256_add_epi32(mapX, _mm256_mullo_epi32(mapY, stride));
+  }
+  // 1-byte cells: Gather 4 bytes from each cell's address, and keep the low one:
+  __m256i raw = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), (const int*)map.m_cells, offset, active, 1);
+  return _mm256_and_si256(raw, _mm256_set1_epi32(0xff));
+}
+
+// Traces columns [x0,x1) in packets of 8, returning how many columns were done
+// (i.e. any remainder of less than 8 columns is left for the scalar tracer). Each column's
+// cameraX comes from camera_x if given (see view_shape_t), otherwise it's worked out from screenWidth,
+// unless rays is given, which has each column's ray direction and step distances already.
+template<int LAYOUT>
+__attribute__((target("avx2")))
+static int trace_packets_avx2(
+  const RayboxMap &map, const RayboxCamera &cam, int screenWidth, const float *camera_x, const ray_row_t *rays,
+  int x0, int x1, traced_column_t *out
+) {
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 signBit = _mm256_set1_ps(-0.0f);
+  const __m256 playerX = _mm256_set1_ps(cam.playerX);
+  const __m256 playerY = _mm256_set1_ps(cam.playerY);
+  const __m256i cellX0 = _mm256_set1_epi32(int(cam.playerX));
+  const __m256i cellY0 = _mm256_set1_epi32(int(cam.playerY));
+  const __m256 cellX0f = _mm256_cvtepi32_ps(cellX0);
+  const __m256 cellY0f = _mm256_cvtepi32_ps(cellY0);
+  const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  alignas(32) float dist[8], hx[8], hy[8];
+  alignas(32) int32_t side[8], hitX[8], hitY[8];
+  alignas(32) uint32_t color[8];
+  int x;
+  for (x = x0; x+8 <= x1; x += 8) {
+    __m256i screenX = _mm256_add_epi32(_mm256_set1_epi32(x), lane);
+    __m256 rayDirX, rayDirY, stepXdist, stepYdist;
+    if (rays) {
+      rayDirX = _mm256_mul_ps(_mm256_set1_ps(rays->signX), _mm256_loadu_ps(rays->dirX+x));
+      rayDirY = _mm256_mul_ps(_mm256_set1_ps(rays->signY), _mm256_loadu_ps(rays->dirY+x));
+      stepXdist = _mm256_loadu_ps(rays->stepX+x);
+      stepYdist = _mm256_loadu_ps(rays->stepY+x);
+    }
+    else {
+      __m256 cameraX = camera_x ? _mm256_loadu_ps(camera_x+x) : _mm256_sub_ps(
+        _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(screenX, screenX)), _mm256_set1_ps(float(screenWidth))),
+        one
+      );
+      rayDirX = _mm256_add_ps(_mm256_set1_ps(cam.headingX), _mm256_mul_ps(_mm256_set1_ps(cam.viewX), cameraX));
+      rayDirY = _mm256_add_ps(_mm256_set1_ps(cam.headingY), _mm256_mul_ps(_mm256_set1_ps(cam.viewY), cameraX));
+      stepXdist = _mm256_andnot_ps(signBit, _mm256_div_ps(one, rayDirX));
+      stepYdist = _mm256_andnot_ps(signBit, _mm256_div_ps(one, rayDirY));
+    }
+    __m256 posX = _mm256_cmp_ps(rayDirX, zero, _CMP_GT_OQ);
+    __m256 posY = _mm256_cmp_ps(rayDirY, zero, _CMP_GT_OQ);
+    // stepX/Y are +1 or -1 (i.e. all ones, then OR'd with 1):
+    __m256i stepX = _mm256_or_si256(_mm256_xor_si256(_mm256_castps_si256(posX), _mm256_set1_epi32(-1)), _mm256_set1_epi32(1));
+    __m256i stepY = _mm256_or_si256(_mm256_xor_si256(_mm256_castps_si256(posY), _mm256_set1_epi32(-1)), _mm256_set1_epi32(1));
+    __m256 trackXdist = _mm256_mul_ps(
+      _mm256_blendv_ps(_mm256_sub_ps(playerX, cellX0f), _mm256_sub_ps(_mm256_add_ps(cellX0f, one), playerX), posX),
+      stepXdist
+    );
+    __m256 trackYdist = _mm256_mul_ps(
+      _mm256_blendv_ps(_mm256_sub_ps(playerY, cellY0f), _mm256_sub_ps(_mm256_add_ps(cellY0f, one), playerY), posY),
+      stepYdist
+    );
+    __m256i mapX = cellX0;
+    __m256i mapY = cellY0;
+    __m256i sideV = _mm256_setzero_si256();
+    __m256i colorV = _mm256_setzero_si256();
+    __m256i active = _mm256_set1_epi32(-1);
+    while (!_mm256_testz_si256(active, active)) {
+      __m256i xStep = _mm256_castps_si256(_mm256_cmp_ps(trackXdist, trackYdist, _CMP_LT_OQ));
+      __m256i xMove = _mm256_and_si256(xStep, active);
+      __m256i yMove = _mm256_andnot_si256(xStep, active);
+      mapX = _mm256_add_epi32(mapX, _mm256_and_si256(stepX, xMove));
+      mapY = _mm256_add_epi32(mapY, _mm256_and_si256(stepY, yMove));
+      trackXdist = _mm256_blendv_ps(trackXdist, _mm256_add_ps(trackXdist, stepXdist), _mm256_castsi256_ps(xMove));
+      trackYdist = _mm256_blendv_ps(trackYdist, _mm256_add_ps(trackYdist, stepYdist), _mm256_castsi256_ps(yMove));
+      // side is 0 for an X step, 1 for a Y step (for lanes that are still active):
+      sideV = _mm256_blendv_epi8(sideV, _mm256_and_si256(yMove, _mm256_set1_epi32(1)), active);
+      __m256i cell = map_gather_avx2<LAYOUT>(map, mapX, mapY, active);
+      __m256i hit = _mm256_andnot_si256(_mm256_cmpeq_epi32(cell, _mm256_setzero_si256()), active);
+      colorV = _mm256_blendv_epi8(colorV, cell, hit);
+      active = _mm256_andnot_si256(hit, active);
+    }
+    __m256 ySide = _mm256_castsi256_ps(_mm256_cmpeq_epi32(sideV, _mm256_set1_epi32(1)));
+    __m256 distV = _mm256_blendv_ps(_mm256_sub_ps(trackXdist, stepXdist), _mm256_sub_ps(trackYdist, stepYdist), ySide);
+    _mm256_store_ps(dist, distV);
+    _mm256_store_ps(hx, _mm256_add_ps(_mm256_mul_ps(distV, rayDirX), playerX));
+    _mm256_store_ps(hy, _mm256_add_ps(_mm256_mul_ps(distV, rayDirY), playerY));
+    _mm256_store_si256((__m256i*)side, sideV);
+    if (LAYOUT != MAP_LAYOUT_ROWMAJOR32) {
+      // Look up the palette colours of the cells we hit:
+      colorV = _mm256_i32gather_epi32((const int*)map.m_palette, colorV, 4);
+    }
+    _mm256_store_si256((__m256i*)color, colorV);
+    _mm256_store_si256((__m256i*)hitX, mapX);
+    _mm256_store_si256((__m256i*)hitY, mapY);
+    store_packet(out+x, 8, dist, hx, hy, side, color, hitX, hitY);
+  }
+  return x-x0;
+}
+
+// As above, but 16 lanes:
+template<int LAYOUT>
+__attribute__((target("avx512f")))
+static inline __m512i map_gather_avx512(const RayboxMap &map, __m512i mapX, __m512i mapY, __mmask16 active) {
+  const __m512i stride = _mm512_set1_epi32(map.m_stride);
+  if (LAYOUT == MAP_LAYOUT_ROWMAJOR32) {
+    __m512i index = _mm512_add_epi32(mapX, _mm512_mullo_epi32(mapY, stride));
+    return _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), active, index, map.m_cells, 4);
+  }
+  __m512i offset;
+  if (LAYOUT == MAP_LAYOUT_TILED) {
+    const __m512i m = _mm512_set1_epi32((1<<MAP_TILE_BITS)-1);
+    __m512i tile = _mm512_add_epi32(
+      _mm512_mullo_epi32(_mm512_srli_epi32(mapY, MAP_TILE_BITS), stride),
+      _mm512_srli_epi32(mapX, MAP_TILE_BITS)
+    );
+    offset = _mm512_or_si512(
+      _mm512_slli_epi32(tile, 2*MAP_TILE_BITS),
+      _mm512_or_si512(_mm512_slli_epi32(_mm512_and_si512(mapY, m), MAP_TILE_BITS), _mm512_and_si512(mapX, m))
+    );
+  }
+  else if (LAYOUT == MAP_LAYOUT_MORTON) {
+    __m512i v[2] = { mapX, mapY };
+    for (int i=0; i<2; ++i) {
+      v[i] = _mm512_and_si512(_mm512_or_si512(v[i], _mm512_slli_epi32(v[i], 8)), _mm512_set1_epi32(0x00ff00ff));
+      v[i] = _mm512_and_si512(_mm512_or_si512(v[i], _mm512_slli_epi32(v[i], 4)), _mm512_set1_epi32(0x0f0f0f0f));
+      v[i] = _mm512_and_si512(_mm512_or_si512(v[i], _mm512_slli_epi32(v[i], 2)), _mm512_set1_epi32(0x33333333));
+      v[i] = _mm512_and_si512(_mm512_or_si512(v[i], _mm512_slli_epi32(v[i], 1)), _mm512_set1_epi32(0x55555555));
+    }
+    offset = _mm512_or_si512(v[0], _mm512_slli_epi32(v[1], 1));
+  }
+  else {
+    offset = _mm512_add_epi32(mapX, _mm512_mullo_epi32(mapY, stride));
+  }
+  __m512i raw = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), active, offset, map.m_cells, 1);
+  return _mm512_and_si512(raw, _mm512_set1_epi32(0xff));
+}
+
+// As trace_packets_avx2(), but 16 columns per packet:
+template<int LAYOUT>
+__attribute__((target("avx512f")))
+static int trace_packets_avx512(
+  const RayboxMap &map, const RayboxCamera &cam, int screenWidth, const float *camera_x, const ray_row_t *rays,
+  int x0, int x1, traced_column_t *out
+) {
+  const __m512 one = _mm512_set1_ps(1.0f);
+  const __m512 zero = _mm512_setzero_ps();
+  const __m512 playerX = _mm512_set1_ps(cam.playerX);
+  const __m512 playerY = _mm512_set1_ps(cam.playerY);
+  const __m512i cellX0 = _mm512_set1_epi32(int(cam.playerX));
+  const __m512i cellY0 = _mm512_set1_epi32(int(cam.playerY));
+  const __m512 cellX0f = _mm512_cvtepi32_ps(cellX0);
+  const __m512 cellY0f = _mm512_cvtepi32_ps(cellY0);
+  const __m512i lane = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  alignas(64) float dist[16], hx[16], hy[16];
+  alignas(64) int32_t side[16], hitX[16], hitY[16];
+  alignas(64) uint32_t color[16];
+  int x;
+  for (x = x0; x+16 <= x1; x += 16) {
+    __m512i screenX = _mm512_add_epi32(_mm512_set1_epi32(x), lane);
+    __m512 rayDirX, rayDirY, stepXdist, stepYdist;
+    if (rays) {
+      rayDirX = _mm512_mul_ps(_mm512_set1_ps(rays->signX), _mm512_loadu_ps(rays->dirX+x));
+      rayDirY = _mm512_mul_ps(_mm512_set1_ps(rays->signY), _mm512_loadu_ps(rays->dirY+x));
+      stepXdist = _mm512_loadu_ps(rays->stepX+x);
+      stepYdist = _mm512_loadu_ps(rays->stepY+x);
+    }
+    else {
+      __m512 cameraX = camera_x ? _mm512_loadu_ps(camera_x+x) : _mm512_sub_ps(
+        _mm512_div_ps(_mm512_cvtepi32_ps(_mm512_add_epi32(screenX, screenX)), _mm512_set1_ps(float(screenWidth))),
+        one
+      );
+      rayDirX = _mm512_add_ps(_mm512_set1_ps(cam.headingX), _mm512_mul_ps(_mm512_set1_ps(cam.viewX), cameraX));
+      rayDirY = _mm512_add_ps(_mm512_set1_ps(cam.headingY), _mm512_mul_ps(_mm512_set1_ps(cam.viewY), cameraX));
+      stepXdist = _mm512_abs_ps(_mm512_div_ps(one, rayDirX));
+      stepYdist = _mm512_abs_ps(_mm512_div_ps(one, rayDirY));
+    }
+    __mmask16 posX = _mm512_cmp_ps_mask(rayDirX, zero, _CMP_GT_OQ);
+    __mmask16 posY = _mm512_cmp_ps_mask(rayDirY, zero, _CMP_GT_OQ);
+    __m512i stepX = _mm512_mask_blend_epi32(posX, _mm512_set1_epi32(-1), _mm512_set1_epi32(1));
+    __m512i stepY = _mm512_mask_blend_epi32(posY, _mm512_set1_epi32(-1), _mm512_set1_epi32(1));
+    __m512 trackXdist = _mm512_mul_ps(
+      _mm512_mask_blend_ps(posX, _mm512_sub_ps(playerX, cellX0f), _mm512_sub_ps(_mm512_add_ps(cellX0f, one), playerX)),
+      stepXdist
+    );
+    __m512 trackYdist = _mm512_mul_ps(
+      _mm512_mask_blend_ps(posY, _mm512_sub_ps(playerY, cellY0f), _mm512_sub_ps(_mm512_add_ps(cellY0f, one), playerY)),
+      stepYdist
+    );
+    __m512i mapX = cellX0;
+    __m512i mapY = cellY0;
+    __m512i sideV = _mm512_setzero_si512();
+    __m512i colorV = _mm512_setzero_si512();
+    __mmask16 active = 0xffff;
+    while (active) {
+      __mmask16 xStep = _mm512_cmp_ps_mask(trackXdist, trackYdist, _CMP_LT_OQ);
+      __mmask16 xMove = xStep & active;
+      __mmask16 yMove = ~xStep & active;
+      mapX = _mm512_mask_add_epi32(mapX, xMove, mapX, stepX);
+      mapY = _mm512_mask_add_epi32(mapY, yMove, mapY, stepY);
+      trackXdist = _mm512_mask_add_ps(trackXdist, xMove, trackXdist, stepXdist);
+      trackYdist = _mm512_mask_add_ps(trackYdist, yMove, trackYdist, stepYdist);
+      sideV = _mm512_mask_mov_epi32(sideV, active, _mm512_maskz_set1_epi32(yMove, 1));
+      __m512i cell = map_gather_avx512<LAYOUT>(map, mapX, mapY, active);
+      __mmask16 hit = _mm512_test_epi32_mask(cell, cell) & active;
+      colorV = _mm512_mask_mov_epi32(colorV, hit, cell);
+      active &= ~hit;
     }
-    int n = 0;
-    for (PlayerStart p : m_player_starts) {
-      ++n;
-      printf("Player start %d: %d,%d\n", n, p.x, p.y);
+    __mmask16 ySide = _mm512_test_epi32_mask(sideV, sideV);
+    __m512 distV = _mm512_mask_blend_ps(ySide, _mm512_sub_ps(trackXdist, stepXdist), _mm512_sub_ps(trackYdist, stepYdist));
+    _mm512_store_ps(dist, distV);
+    _mm512_store_ps(hx, _mm512_add_ps(_mm512_mul_ps(distV, rayDirX), playerX));
+    _mm512_store_ps(hy, _mm512_add_ps(_mm512_mul_ps(distV, rayDirY), playerY));
+    _mm512_store_si512(side, sideV);
+    if (LAYOUT != MAP_LAYOUT_ROWMAJOR32) {
+      colorV = _mm512_i32gather_epi32(colorV, map.m_palette, 4);
     }
+    _mm512_store_si512(color, colorV);
+    _mm512_store_si512(hitX, mapX);
+    _mm512_store_si512(hitY, mapY);
+    store_packet(out+x, 16, dist, hx, hy, side, color, hitX, hitY);
   }
+  return x-x0;
+}
+
+// Picks the widest packet size this CPU supports:
+static int detect_simd_lanes() {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) return SIMD_AVX512;
+  if (__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+  return SIMD_OFF;
+}
+
+#else
 
+enum { SIMD_OFF = 1, SIMD_AVX2 = 8, SIMD_AVX512 = 16 };
+static int detect_simd_lanes() { return SIMD_OFF; }
+
+#endif // x86
+
+// Per-frame instrumentation (see RayboxStats). Build with -DRAYBOX_STATS=0 (e.g. make raybox-nostats)
+// to compile all of it out:
+#ifndef RAYBOX_STATS
+#define RAYBOX_STATS 1
+#endif
+
+#if RAYBOX_STATS
+
+// What RayboxStats records for each frame:
+enum {
+  // Time spent in each stage, in ms:
+  STAT_HANDLE_EVENTS,
+  STAT_HANDLE_INPUT,
+  STAT_TRACE,           // trace(), or trace_and_render_view() (which draws the view too).
+  STAT_RENDER_BACKDROP,
+  STAT_RENDER_VIEW,     // render_view(), or render_walls() drawing the backdrop and walls in one go.
+  STAT_RENDER_SPRITES,
+  STAT_RENDER_MAP,
+  STAT_UPLOAD,          // Getting m_fb into the texture (see present()).
+  STAT_PRESENT,         // SDL_RenderCopy() + SDL_RenderPresent(), or waiting for RayboxPresenter.
+  STAT_FRAME,           // The whole frame (not counting idle frames, which aren't recorded at all).
+  STAT_TIMERS,
+  // Counts:
+  STAT_DDA_MEAN = STAT_TIMERS,  // DDA steps per ray (see RayboxStats::record_traces())...
+  STAT_DDA_MAX,                 // ...and the most taken by any ray in the frame.
+  STAT_RAYS,                    // Rays cast by trace().
+  STAT_COLUMNS,                 // Columns trace() worked out (traced or reused).
+  STAT_PIXELS,                  // Pixels written by the backdrop and wall renderers.
+  STAT_COUNT
 };
 
-typedef struct {
-  num dist;
-  num hx, hy;
-  int side;
-  uint32_t color;
-} traced_column_t;
+const char *stat_name(int stat) {
+  static const char *names[STAT_COUNT] = {
+    "handle_events", "handle_input", "trace", "render_backdrop", "render_view", "render_sprites", "render_map",
+    "upload", "present", "frame",
+    "dda_steps_mean", "dda_steps_max", "rays", "columns", "pixels"
+  };
+  return (stat >= 0 && stat < STAT_COUNT) ? names[stat] : "?";
+}
 
-class RayboxSystem {
+// Keeps the last HISTORY recorded frames' stats, so that we can report rolling percentiles
+// (in the on-screen overlay, and in the periodic dump), plus a histogram of DDA steps per ray.
+class RayboxStats {
 public:
 
-  RayboxMap m_map;
-  SDL_Window *m_window;
-  SDL_Renderer *m_renderer;
-  SDL_Texture *m_texture;
-  uint8_t *m_fb;
-  bool m_video_init;
-  bool m_img_init;
-  bool m_show_map_overlay;
-  int m_frame;
-  num playerX, playerY;
-  num headingX, headingY;
-  num viewX, viewY;
-  num fov;
-  num viewMag;
-  uint64_t m_prevTime;
-  uint64_t m_thisTime;
-  uint64_t m_frequency;
-  traced_column_t m_traces[VIEW_WIDTH];
-  bool m_capture_traces;
+  enum { HISTORY = 128 };   // Frames kept.
+  enum { DDA_BUCKETS = 12 }; // Bucket 0 is 0 steps, bucket b>0 is [2^(b-1), 2^b), the last is everything beyond.
 
-  RayboxSystem() {
-    m_window = NULL;
-    m_renderer = NULL;
-    m_texture = NULL;
-    m_fb = NULL;
-    m_video_init = false;
-    m_img_init = false;
-    m_frame = 0;
-    m_show_map_overlay = false;
-    m_capture_traces = false;
-    playerX = MAP_WIDTH>>1;
-    playerY = MAP_HEIGHT>>1;
-    headingX = 0;
-    headingY = -1;
-    fov = 70.0 * PI / 180.0; // FOV in radians.
-    viewMag = tan(fov/2.0); // Magnitude of the view plane vector (half of the total viewplane).
-    viewX = viewMag;
-    viewY = 0;
+  // Adds the time from construction to destruction to a stage of the current frame:
+  struct scope_t {
+    RayboxStats &stats;
+    int stat;
+    uint64_t t0;
+    scope_t(RayboxStats &s, int st) : stats(s), stat(st), t0(SDL_GetPerformanceCounter()) {}
+    ~scope_t() { stats.add_ticks(stat, SDL_GetPerformanceCounter()-t0); }
+  };
+
+  double m_ms_per_tick;
+  double m_frame[STAT_COUNT];                 // The current frame.
+  uint32_t m_frame_dda[DDA_BUCKETS];
+  double m_history[HISTORY][STAT_COUNT];      // Ring buffer of recorded frames...
+  uint32_t m_history_dda[HISTORY][DDA_BUCKETS];
+  int m_recorded;                             // ...and how many have been recorded in total.
+  double m_budget_ms;                         // Frame time budget (e.g. for 60fps).
+  int m_over_budget;                          // Recorded frames that went over it (since the last dump).
+  int m_dumped;                               // m_recorded as of the last dump.
+  FILE *m_dump_fp;
+  bool m_dump_json;                           // JSON Lines rather than CSV?
+  std::vector<double> m_sorted;               // Scratch space for percentile().
+
+  RayboxStats() {
+    m_ms_per_tick = 1000.0 / double(SDL_GetPerformanceFrequency());
+    m_recorded = 0;
+    m_budget_ms = 1000.0/60.0;
+    m_over_budget = 0;
+    m_dumped = 0;
+    m_dump_fp = NULL;
+    m_dump_json = false;
+    begin_frame();
   }
 
-  ~RayboxSystem() {
-    printf("Shutting down RayboxSystem...\n");
-    if (m_fb) delete m_fb;
-    if (m_img_init) IMG_Quit();
-    if (m_texture) SDL_DestroyTexture(m_texture); //SMELL: Are we meant to do this? Not sure.
-    if (m_renderer) SDL_DestroyRenderer(m_renderer);
-    if (m_window) SDL_DestroyWindow(m_window);
-    if (m_video_init) SDL_Quit(); //SMELL: Match each SDL_InitSubSystem() instead?
-    printf("Goodbye\n");
+  ~RayboxStats() {
+    if (m_dump_fp) fclose(m_dump_fp);
   }
 
-  bool load_map(const char *map_file) {
-    SDL_Surface *s;
-    s = IMG_Load(map_file);
-    while (true) { //SMELL: Try throw instead of this old while/break style.
-      if (!s) {
-        printf("ERROR: Failed to load map image file: %s\n", map_file);
-        break;
-      }
-      if (s->w != MAP_WIDTH || s->h != MAP_HEIGHT) {
-        printf("ERROR: Map image file should be 64x64 pixels, but is: %dx%d\n", s->w, s->h);
-        break;
-      }
-      Uint32 f = s->format->format;
-      // Make sure the source image data is in a format we can process...
-      if (f != SDL_PIXELFORMAT_RGB24) {
-        printf("ERROR: Wrong pixel format. Was expecting %x but got %x\n", SDL_PIXELFORMAT_RGB24, f);
-        break;
-      }
-      // OK, at this point we can assume the image format can be converted by us into a map array.
-      m_map.load_from_surface(s);
-      printf("Loaded map from %s\n", map_file);
-      printf("%d player start(s)\n", (int)m_map.m_player_starts.size());
-      PlayerStart player = m_map.m_player_starts.back();
-      playerX = player.x + 0.5;
-      playerY = player.y + 0.5;
-      // m_map.debug_print_map();
-      SDL_FreeSurface(s);
-      s = NULL;
-      return true;
+  void begin_frame() {
+    for (int s=0; s<STAT_COUNT; ++s) m_frame[s] = 0;
+    for (int b=0; b<DDA_BUCKETS; ++b) m_frame_dda[b] = 0;
+  }
+
+  void add_ticks(int stat, uint64_t ticks) { m_frame[stat] += double(ticks) * m_ms_per_tick; }
+
+  // Works out the DDA steps that each ray took (i.e. the map cells it crossed) from where it ended up:
+  void record_traces(const traced_column_t *traces, int columns, int cellX, int cellY) {
+    uint64_t total = 0;
+    int most = 0;
+    for (int x=0; x<columns; ++x) {
+      int steps = abs(traces[x].mapX-cellX) + abs(traces[x].mapY-cellY);
+      total += steps;
+      most = std::max(most, steps);
+      ++m_frame_dda[dda_bucket(steps)];
     }
-    // describe_pixel_format(s->format->format);
-    if (s) SDL_FreeSurface(s);
-    return false;
+    m_frame[STAT_DDA_MEAN] = double(total)/double(columns);
+    m_frame[STAT_DDA_MAX] = most;
   }
 
-  bool prep() {
-    printf("Preparing RayboxSystem...\n");
-    //SMELL: This needs proper error handling!
-    printf("SDL_InitSubSystem(SDL_INIT_VIDEO): %d\n", SDL_InitSubSystem(SDL_INIT_VIDEO));
-    m_video_init = true;
-    //SMELL: Check each of the following for failure:
-    // Do full SDL video prep and window init:
-    m_window =
-      SDL_CreateWindow(
-        "Raybox",
-        SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
-        VIEW_WIDTH, VIEW_HEIGHT,
-        0
-      );
-    m_renderer =
-      SDL_CreateRenderer(
-        m_window,
-        -1,
-        SDL_RENDERER_ACCELERATED
-      );
-    SDL_SetRenderDrawColor(m_renderer, 0, 0, 0, SDL_ALPHA_OPAQUE);
-    SDL_RenderClear(m_renderer);
-    m_texture =
-      SDL_CreateTexture(
-        m_renderer,
-        SDL_PIXELFORMAT_ARGB8888,
-        SDL_TEXTUREACCESS_STREAMING,
-        VIEW_WIDTH, VIEW_HEIGHT
-      );
-    IMG_Init(IMG_INIT_PNG);
-    m_img_init = true;
-    // Create framebuffer:
-    m_fb = new uint8_t[FBSIZE];
-    printf("SDL window ready.\n");
-    return true;
+  static int dda_bucket(int steps) {
+    int b = 0;
+    while (steps && b < DDA_BUCKETS-1) { steps >>= 1; ++b; }
+    return b;
   }
 
-  uint32_t sky_color()   { return 0xff666666; }
-  uint32_t floor_color() { return 0xffcccccc; }
+  // Adds the current frame to the history, and starts the next one:
+  void end_frame() {
+    int i = m_recorded % HISTORY;
+    for (int s=0; s<STAT_COUNT; ++s) m_history[i][s] = m_frame[s];
+    for (int b=0; b<DDA_BUCKETS; ++b) m_history_dda[i][b] = m_frame_dda[b];
+    if (m_frame[STAT_FRAME] > m_budget_ms) ++m_over_budget;
+    ++m_recorded;
+    begin_frame();
+  }
 
+  int frames_kept() { return std::min<int>(m_recorded, HISTORY); }
 
-  bool render_backdrop() {
-    for (int x=0; x<VIEW_WIDTH; ++x) {
-      for (int y=0; y<VIEW_HEIGHT; ++y) {
-        uint32_t c = (y < VIEW_HEIGHT>>1) ? sky_color() : floor_color();
-        T(m_fb, x, y) = c;
-      }
-    }
-    return true;
+  // Returns the given percentile (0..100) of a stat over the frames kept:
+  double percentile(int stat, double pct) {
+    int n = frames_kept();
+    if (!n) return 0;
+    m_sorted.resize(n);
+    for (int i=0; i<n; ++i) m_sorted[i] = m_history[i][stat];
+    size_t k = size_t(pct/100.0 * (n-1) + 0.5);
+    std::nth_element(m_sorted.begin(), m_sorted.begin()+k, m_sorted.end());
+    return m_sorted[k];
   }
 
-  bool render_random(int l=0, int t=0, int r=0, int b=0) {
-    for (int x=l; x<VIEW_WIDTH-r; ++x) {
-      for (int y=t; y<VIEW_HEIGHT-b; ++y) {
-        R(m_fb, x, y) = rand()%256;
-        G(m_fb, x, y) = rand()%256;
-        B(m_fb, x, y) = rand()%256;
-        A(m_fb, x, y) = 255;
-      }
+  // Most recent first (age 0):
+  double recent(int age, int stat) { return m_history[(m_recorded-1-age) % HISTORY][stat]; }
+
+  bool open_dump(const char *filename) {
+    m_dump_fp = fopen(filename, "wb");
+    if (!m_dump_fp) {
+      printf("ERROR: Failed to open stats output file: %s\n", filename);
+      return false;
+    }
+    size_t len = strlen(filename);
+    m_dump_json = len >= 5 && !strcmp(filename+len-5, ".json");
+    if (!m_dump_json) {
+      fprintf(m_dump_fp, "time,frames,over_budget");
+      for (int s=0; s<STAT_COUNT; ++s) fprintf(m_dump_fp, ",%s_p50,%s_p99,%s_max", stat_name(s), stat_name(s), stat_name(s));
+      for (int b=0; b<DDA_BUCKETS; ++b) fprintf(m_dump_fp, ",dda_bucket%d", b);
+      fprintf(m_dump_fp, "\n");
     }
     return true;
   }
 
-  bool render_map() {
-    for (int x=0; x<VIEW_WIDTH; ++x) {
-      for (int y=0; y<VIEW_HEIGHT; ++y) {
-        if (x<=MAP_WIDTH*MAP_OVERLAY_SCALE && y<=MAP_HEIGHT*MAP_OVERLAY_SCALE) {
-          if (x%MAP_OVERLAY_SCALE==0 || y%MAP_OVERLAY_SCALE==0) {
-            // Black grid lines:
-            T(m_fb, x, y) = 0xff000000;
-          }
-          else {
-            uint32_t m = *(m_map.cell(x/MAP_OVERLAY_SCALE,y/MAP_OVERLAY_SCALE));
-            if (m) {
-              // Filled square:
-              T(m_fb, x, y) = m;
-            }
-            else {
-              T(m_fb, x, y) = ((x&y)&1) ? 0xff333333 : 0xff111111;
-            }
-          }
-        }
+  // Writes one line (CSV, or a JSON object) with the rolling percentiles, the frames recorded and
+  // over budget since the last dump, and the DDA histogram over the frames kept:
+  void dump(double time) {
+    if (!m_dump_fp) return;
+    uint64_t dda[DDA_BUCKETS] = {};
+    for (int i=0; i<frames_kept(); ++i) {
+      for (int b=0; b<DDA_BUCKETS; ++b) dda[b] += m_history_dda[i][b];
+    }
+    FILE *fp = m_dump_fp;
+    if (m_dump_json) {
+      fprintf(fp, "{ \"time\": %.3f, \"frames\": %d, \"over_budget\": %d", time, m_recorded-m_dumped, m_over_budget);
+      for (int s=0; s<STAT_COUNT; ++s) {
+        fprintf(
+          fp, ", \"%s\": { \"p50\": %.3f, \"p99\": %.3f, \"max\": %.3f }",
+          stat_name(s), percentile(s, 50), percentile(s, 99), percentile(s, 100)
+        );
       }
+      fprintf(fp, ", \"dda_histogram\": [");
+      for (int b=0; b<DDA_BUCKETS; ++b) fprintf(fp, "%s%llu", b ? ", " : "", (unsigned long long)dda[b]);
+      fprintf(fp, "] }\n");
     }
-    // Render player position:
-    num ppx = playerX*MAP_OVERLAY_SCALE;
-    num ppy = playerY*MAP_OVERLAY_SCALE;
-    T(m_fb, int(ppx), int(ppy)) = 0xff00ffff;
-    // Render view vector:
-    for (int n=0; n<MAP_OVERLAY_SCALE; ++n) {
-      num nn = num(n)/num(MAP_OVERLAY_SCALE);
-      num vvx = ppx+headingX*n;
-      num vvy = ppy+headingY*n;
-      T(m_fb, int(vvx), int(vvy)) = 0xff00ffff;
+    else {
+      fprintf(fp, "%.3f,%d,%d", time, m_recorded-m_dumped, m_over_budget);
+      for (int s=0; s<STAT_COUNT; ++s) fprintf(fp, ",%.3f,%.3f,%.3f", percentile(s, 50), percentile(s, 99), percentile(s, 100));
+      for (int b=0; b<DDA_BUCKETS; ++b) fprintf(fp, ",%llu", (unsigned long long)dda[b]);
+      fprintf(fp, "\n");
     }
-    return true;
+    fflush(fp);
+    m_dumped = m_recorded;
+    m_over_budget = 0;
   }
 
-  bool trace() {
-    // Trace a ray for each screen column:
-    int screenWidth = VIEW_WIDTH;
-    for (int screenX = 0; screenX < screenWidth; ++screenX) {
-      // Get player's current map cell (but note that we'll modify these values in each iteration):
-      int mapX = int(playerX);
-      int mapY = int(playerY);
-      // Convert screenX to cameraX (i.e. proportional position along the viewplane):
-      num cameraX = 2*screenX / num(screenWidth) - 1.0; // cx = [-1,1)
-      // Work out the base vector for the ray that goes from the player, through this slit of the viewplane:
-      num rayDirX = headingX + viewX*cameraX;
-      num rayDirY = headingY + viewY*cameraX;
-      // Find out the distance our ray would normally travel to go from one full map grid line to the next,
-      // for grid lines on each of the X and Y axes. Work this out for the "forward" direction of the ray:
-      num stepX = (rayDirX>0) ? +1 : -1;
-      num stepY = (rayDirY>0) ? +1 : -1;
-      // What respective distances will we travel along the ray, with each step on X or Y gridlines?
-      //NOTE: denominator could be 0!
-      //NOTE: Because we end up treating these distances as though they are based on a normalised base ray,
-      // we can just use 1/axis instead of ||rayDir||/axis.
-      num stepXdist = abs(1.0/rayDirX);
-      num stepYdist = abs(1.0/rayDirY);
-      // Track separate distance counters for tracing through X gridlines and Y gridlines.
-      // Start with the initial distances for each that reach the first gridlines;
-      // these are scaled versions of stepXdist and stepYdist, based on on where the
-      // camera origin (i.e. player) is within the current map cell.
-      num trackXdist = ((rayDirX>0) ? mapX+1-playerX : playerX-mapX)*stepXdist;
-      num trackYdist = ((rayDirY>0) ? mapY+1-playerY : playerY-mapY)*stepYdist;
-      // Now perform DDA (Digital Differential Analysis), to find the first (nearest) edge we hit
-      // that belongs to an occupied map cell:
-      uint32_t wallHit = 0;
-      int side = 0;
-      while (!wallHit) {
-        if (trackXdist < trackYdist) {
-          // If the X-tracking distance is currently the nearest, then it means our ray is intersecting
-          // now with an X gridline (vertical). In other words, it is entering the next X column
-          // so we'll want to inspect that first:
-          mapX += stepX;
-          // Meanwhile, make sure the next time we check our X-tracking distance, it has been
-          // advanced to match the start of the next X column, i.e. it is preemptively overshot:
-          trackXdist += stepXdist;
-          // We're inspecting an intersection at side 0 (X gridline, aka NS, aka vertical).
-          side = 0;
-        }
-        else {
-          mapY += stepY;
-          trackYdist += stepYdist;
-          side = 1;
-        }
-        // Is there a wall at our updated mapX,Y?
-        wallHit = *m_map.cell(mapX, mapY);
-      } // while
-      //NOTE: We assume the map has no holes, and that our player is not inside a wall,
-      // and hence we can assume we definitely have some wallHit value.
-      // Now, since we know we have a hit, "side" tells us which side (and hence which distance tracker)
-      // represents our hit. From this, we have to subtract one respective step distance
-      // because the algorithm above overshoots by 1 extra step in each iteration (as it was
-      // preparing for the next iteration):
-      num visualWallDist = ((side==0) ? (trackXdist-stepXdist) : (trackYdist-stepYdist));
-      //NOTE: visualWallDist is the actual distance, but based on normalising the base ray length
-      // (i.e. inverse scaling such that the base ray length would be 1.0).
-      m_traces[screenX].side  = side;
-      m_traces[screenX].color = wallHit;
-      m_traces[screenX].dist  = visualWallDist;
-      m_traces[screenX].hx    = visualWallDist*rayDirX + playerX;
-      m_traces[screenX].hy    = visualWallDist*rayDirY + playerY;
-    } // for
-    // Re hx,hy: Because visualWallDist is based on a normalised base ray...
-    //...then it is a real distance which we can multiply by the ray's X and Y to get a map-level hit position.
-    return true;
-  } // trace()
+};
 
+#define STATS_SCOPE(stat) RayboxStats::scope_t stats_scope(m_stats, stat)
 
-  bool render_view() {
-    // Render each column:
-    for (int x=0; x<VIEW_WIDTH; ++x) {
-      traced_column_t &col = m_traces[x];
-      uint32_t color = col.color & (col.side ? 0xffffffff : 0xffc0c0c0);
-      // .dist is the distance from the player to the wall hit.
-      // .color is the wall color.
-      // .hx,hy is the point of the hit, in map space.
-      // .side is 0 (NS) or 1 (EW) depending on which side of a wall we hit.
-      int h = HEIGHT_FROM_DIST(col.dist);
-      int stop = VIEW_HEIGHT/2+h;
-      if (stop > VIEW_HEIGHT) stop = VIEW_HEIGHT;
-      uint32_t *pxup, *pxdn;
-      int pitch = VIEW_WIDTH;
-      pxup = (uint32_t*)(m_fb+(VIEW_HEIGHT/2-1)*(pitch*4)+(x*4));
-      pxdn = pxup+pitch;
-      for (int v=VIEW_HEIGHT/2; v<stop; ++v) {
-        *pxup = color; pxup-=pitch;
-        *pxdn = color; pxdn+=pitch;
-      }
-      // int y1 = (VIEW_HEIGHT>>1)-h;
-      // if (y1<0) y1 = 0;
-      // // int y2 = (VIEW_HEIGHT>>1)+h;
-      // // if (y2>VIEW_HEIGHT) y2=VIEW_HEIGHT;
+#else
 
-      // for (int t=-h; t<h; ++t) {
-      //   int y = t+VIEW_HEIGHT/2;
-      //   if (y<0 || y>=VIEW_HEIGHT) continue;
-      //   num tt = num(t+h)/num(h*2);
-      //   // Darken, depending on the side we hit:
-      //   // T(m_fb, x, y) = col.color & (col.side ? 0xffffffff : 0xffc0c0c0);
-      //   int tx = int(64.0*(col.side ? col.hx : col.hy));
+#define STATS_SCOPE(stat)
+
+#endif // RAYBOX_STATS
+
+// Keys that handle_input() looks at, as bits of input_frame_t::keys:
+enum {
+  INPUT_LEFT        = 1<<0,
+  INPUT_RIGHT       = 1<<1,
+  INPUT_SHIFT       = 1<<2,
+  INPUT_W           = 1<<3,
+  INPUT_S           = 1<<4,
+  INPUT_A           = 1<<5,
+  INPUT_D           = 1<<6,
+  INPUT_MAP         = 1<<7,   // TAB: Map overlay.
+  INPUT_STATS       = 1<<8,   // `: Stats overlay.
+  INPUT_AUTO_TURN   = 1<<9    // Not a key: --auto-turn.
+};
+
+// One frame's input, i.e. everything that handle_input() needs to move the player:
+struct input_frame_t {
+  uint16_t keys;  // INPUT_*
+  float step;     // time_step(), in seconds.
+};
+
+// Input recorded frame by frame (--record), to be played back exactly (--replay). The file is
+// little-endian (i.e. as written on x86):
+//   "RBXI", uint16 version, uint16 view width, uint16 view height, uint16 backend (BACKEND_*),
+//   uint16 length + the map (as given to --map), double camera[6] (see RayboxCamera),
+//   then for each frame: uint16 keys, float step.
+// The camera is stored as double so that it's exact whatever num is.
+class RayboxInputLog {
+public:
+
+  enum { VERSION = 2 };
+
+  FILE *m_fp;
+  bool m_writing;
+  uint16_t m_view_width, m_view_height;  // Of the session that recorded it...
+  uint16_t m_backend;                    // ...and its tracer backend (BACKEND_*).
+  std::string m_map;
+  double m_camera[6];
+  int m_frames;
+
+  RayboxInputLog() {
+    m_fp = NULL;
+    m_writing = false;
+    m_view_width = m_view_height = 0;
+    m_backend = BACKEND_FLOAT;
+    m_frames = 0;
+  }
+
+  ~RayboxInputLog() {
+    if (m_fp) fclose(m_fp);
+  }
+
+  bool create(const char *filename, int view_width, int view_height, int backend, const char *map, const RayboxCamera &cam) {
+    m_fp = fopen(filename, "wb");
+    if (!m_fp) {
+      printf("ERROR: Failed to open input recording file: %s\n", filename);
+      return false;
+    }
+    m_writing = true;
+    m_view_width = view_width;
+    m_view_height = view_height;
+    m_backend = backend;
+    m_map = map;
+    m_camera[0] = cam.playerX;  m_camera[1] = cam.playerY;
+    m_camera[2] = cam.headingX; m_camera[3] = cam.headingY;
+    m_camera[4] = cam.viewX;    m_camera[5] = cam.viewY;
+    uint16_t version = VERSION, map_len = m_map.size();
+    fwrite("RBXI", 1, 4, m_fp);
+    fwrite(&version, 2, 1, m_fp);
+    fwrite(&m_view_width, 2, 1, m_fp);
+    fwrite(&m_view_height, 2, 1, m_fp);
+    fwrite(&m_backend, 2, 1, m_fp);
+    fwrite(&map_len, 2, 1, m_fp);
+    fwrite(m_map.data(), 1, map_len, m_fp);
+    fwrite(m_camera, 8, 6, m_fp);
+    return !ferror(m_fp);
+  }
+
+  bool open(const char *filename) {
+    m_fp = fopen(filename, "rb");
+    if (!m_fp) {
+      printf("ERROR: Failed to open input recording file: %s\n", filename);
+      return false;
+    }
+    char magic[4];
+    uint16_t version, map_len;
+    if (
+      fread(magic, 1, 4, m_fp) != 4 || memcmp(magic, "RBXI", 4) ||
+      fread(&version, 2, 1, m_fp) != 1 || version != VERSION ||
+      fread(&m_view_width, 2, 1, m_fp) != 1 || fread(&m_view_height, 2, 1, m_fp) != 1 ||
+      fread(&m_backend, 2, 1, m_fp) != 1 || fread(&map_len, 2, 1, m_fp) != 1
+    ) {
+      printf("ERROR: Not a (version %d) input recording: %s\n", VERSION, filename);
+      return false;
+    }
+    m_map.resize(map_len);
+    if (fread(&m_map[0], 1, map_len, m_fp) != map_len || fread(m_camera, 8, 6, m_fp) != 6) {
+      printf("ERROR: Truncated input recording: %s\n", filename);
+      return false;
+    }
+    return true;
+  }
+
+  RayboxCamera camera() {
+    return { num(m_camera[0]), num(m_camera[1]), num(m_camera[2]), num(m_camera[3]), num(m_camera[4]), num(m_camera[5]) };
+  }
+
+  bool write(const input_frame_t &in) {
+    fwrite(&in.keys, 2, 1, m_fp);
+    fwrite(&in.step, 4, 1, m_fp);
+    ++m_frames;
+    return !ferror(m_fp);
+  }
+
+  // Returns false at the end of the recording:
+  bool read(input_frame_t &in) {
+    if (fread(&in.keys, 2, 1, m_fp) != 1 || fread(&in.step, 4, 1, m_fp) != 1) return false;
+    ++m_frames;
+    return true;
+  }
+
+};
+
+
+// Wall height as captured for the verilog code (which clamps it to fit in a byte):
+static uint8_t capture_height(const traced_column_t &col, int view_height) {
+  int h = HEIGHT_FROM_DIST(col.dist, view_height);
+  return h<=240 ? h : 240;
+}
+
+// Writes one frame's captured height and side of each column (interleaved, i.e. as in a
+// RayboxTraceStream record) as a .hex file that we can use for testing in the raybox verilog code:
+static bool write_capture_hex(const char *filename, const uint8_t *height_side, int columns) {
+  FILE *fp = fopen(filename, "wb");
+  if (!fp) {
+    printf("ERROR: Failed to open capture file: %s\n", filename);
+    return false;
+  }
+  fprintf(fp, "@00000000\n");
+  for (int x=0; x<columns; ++x) {
+    fprintf(fp, "%02X %02X", height_side[x*2], height_side[x*2+1]);
+    fprintf(fp, (x%8==7) ? "\n" : " "); // Every 16 (i.e. 8x2) byte, start a new line.
+  }
+  fclose(fp);
+  return true;
+}
+
+// Streams every frame's traces to a file (--trace-stream), for co-simulation with the verilog
+// code. The frame loop only packs each frame into a preallocated ring of records; a background
+// thread encodes them and writes them out. File layout (little-endian):
+//   "RBXT", uint16 version, uint16 columns, uint16 flags (TRACE_STREAM_*),
+//   then for each frame: uint32 frame number, uint32 payload size, payload.
+// A record is the captured height and side of each column (2 bytes, interleaved), followed with
+// TRACE_STREAM_FULL by each column's dist, hx, hy (floats) and color. The payload is the record
+// itself or, with TRACE_STREAM_DELTA, its differences from the previous frame's: a series of
+// (uint16 bytes unchanged, uint16 bytes changed, the changed bytes).
+enum {
+  TRACE_STREAM_FULL  = 1,
+  TRACE_STREAM_DELTA = 2
+};
+
+class RayboxTraceStream {
+public:
+
+  enum { VERSION = 1 };
+  enum { SLOTS = 64 };  // Frames that can be waiting to be written.
+
+  FILE *m_fp;
+  int m_flags;
+  int m_columns;
+  int m_view_height;                    // (For capture_height().)
+  size_t m_record_size;
+  std::vector<uint8_t> m_ring;          // SLOTS records...
+  uint32_t m_frame_numbers[SLOTS];      // ...and their frame numbers.
+  uint64_t m_head, m_tail;              // Records pushed and written so far.
+  bool m_quit;
+  bool m_failed;
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  std::thread m_thread;
+  std::vector<uint8_t> m_prev, m_encoded; // Writer thread only.
+  uint64_t m_bytes_written;
+  int m_stalls;                         // Frames that had to wait for the writer (i.e. the ring was full).
+
+  RayboxTraceStream() {
+    m_fp = NULL;
+    m_flags = 0;
+    m_columns = 0;
+    m_view_height = 0;
+    m_record_size = 0;
+    m_head = m_tail = 0;
+    m_quit = false;
+    m_failed = false;
+    m_bytes_written = 0;
+    m_stalls = 0;
+  }
+
+  ~RayboxTraceStream() {
+    close();
+  }
+
+  static size_t record_size(int columns, int flags) {
+    return columns * ((flags & TRACE_STREAM_FULL) ? 2+16 : 2);
+  }
+
+  bool create(const char *filename, int columns, int view_height, int flags) {
+    m_fp = fopen(filename, "wb");
+    if (!m_fp) {
+      printf("ERROR: Failed to open trace stream file: %s\n", filename);
+      return false;
+    }
+    m_flags = flags;
+    m_columns = columns;
+    m_view_height = view_height;
+    m_record_size = record_size(columns, flags);
+    m_ring.resize(m_record_size * SLOTS);
+    m_prev.assign(m_record_size, 0);
+    uint16_t header[3] = { VERSION, uint16_t(columns), uint16_t(flags) };
+    fwrite("RBXT", 1, 4, m_fp);
+    fwrite(header, 2, 3, m_fp);
+    m_bytes_written = 4 + 6;
+    m_thread = std::thread([this] { write_loop(); });
+    return true;
+  }
+
+  // Writes out whatever is still in the ring, and closes the file:
+  void close() {
+    if (!m_fp) return;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_quit = true;
+    }
+    m_cv.notify_all();
+    m_thread.join();
+    fclose(m_fp);
+    m_fp = NULL;
+  }
+
+  // Packs a frame's traces into the ring (waiting for the writer if it's full):
+  void push(const traced_column_t *traces, uint32_t frame) {
+    uint8_t *rec;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      if (m_head - m_tail == SLOTS) {
+        ++m_stalls;
+        m_cv.wait(lock, [this] { return m_head - m_tail < SLOTS; });
+      }
+      rec = &m_ring[(m_head % SLOTS) * m_record_size];
+      m_frame_numbers[m_head % SLOTS] = frame;
+    }
+    // Only this thread writes to the slot between m_head and the writer's m_tail, so no lock needed:
+    for (int x=0; x<m_columns; ++x) {
+      rec[x*2]   = capture_height(traces[x], m_view_height);
+      rec[x*2+1] = traces[x].side;
+    }
+    if (m_flags & TRACE_STREAM_FULL) {
+      uint8_t *full = rec + m_columns*2;
+      for (int x=0; x<m_columns; ++x, full+=16) {
+        float f[3] = { float(traces[x].dist), float(traces[x].hx), float(traces[x].hy) };
+        memcpy(full, f, 12);
+        memcpy(full+12, &traces[x].color, 4);
+      }
+    }
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      ++m_head;
+    }
+    m_cv.notify_all();
+  }
+
+  void write_loop() {
+    for (;;) {
+      const uint8_t *rec;
+      uint32_t frame;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait(lock, [this] { return m_quit || m_head != m_tail; });
+        if (m_head == m_tail) break; // Quitting, and nothing left to write.
+        rec = &m_ring[(m_tail % SLOTS) * m_record_size];
+        frame = m_frame_numbers[m_tail % SLOTS];
+      }
+      const uint8_t *payload = rec;
+      uint32_t size = m_record_size;
+      if (m_flags & TRACE_STREAM_DELTA) {
+        encode_delta(rec);
+        memcpy(m_prev.data(), rec, m_record_size);
+        payload = m_encoded.data();
+        size = m_encoded.size();
+      }
+      uint32_t header[2] = { frame, size };
+      fwrite(header, 4, 2, m_fp);
+      fwrite(payload, 1, size, m_fp);
+      m_bytes_written += 8 + size;
+      if (ferror(m_fp)) m_failed = true;
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ++m_tail;
+      }
+      m_cv.notify_all();
+    }
+  }
+
+  // Encodes rec's differences from m_prev into m_encoded:
+  void encode_delta(const uint8_t *rec) {
+    m_encoded.clear();
+    size_t i = 0, n = m_record_size;
+    while (i < n) {
+      size_t same = 0, changed = 0;
+      while (i+same < n && same < 0xffff && rec[i+same] == m_prev[i+same]) ++same;
+      size_t j = i+same;
+      while (j+changed < n && changed < 0xffff && rec[j+changed] != m_prev[j+changed]) ++changed;
+      uint16_t run[2] = { uint16_t(same), uint16_t(changed) };
+      m_encoded.insert(m_encoded.end(), (const uint8_t*)run, (const uint8_t*)run+4);
+      m_encoded.insert(m_encoded.end(), rec+j, rec+j+changed);
+      i = j+changed;
+    }
+  }
+
+  // Converts a stream file back into one .hex file per frame (as capture_traces() writes), named
+  // with the given prefix and the frame's index in the stream. Returns the number of frames.
+  static int convert_to_hex(const char *filename, const char *prefix) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+      printf("ERROR: Failed to open trace stream file: %s\n", filename);
+      return -1;
+    }
+    char magic[4];
+    uint16_t header[3];
+    if (fread(magic, 1, 4, fp) != 4 || memcmp(magic, "RBXT", 4) || fread(header, 2, 3, fp) != 3 || header[0] != VERSION) {
+      printf("ERROR: Not a (version %d) trace stream: %s\n", VERSION, filename);
+      fclose(fp);
+      return -1;
+    }
+    int columns = header[1], flags = header[2];
+    size_t rec_size = record_size(columns, flags);
+    std::vector<uint8_t> rec(rec_size, 0), payload;
+    int frames = 0;
+    uint32_t frame_header[2];
+    while (fread(frame_header, 4, 2, fp) == 2) {
+      payload.resize(frame_header[1]);
+      if (fread(payload.data(), 1, payload.size(), fp) != payload.size()) {
+        printf("WARNING: Trace stream is truncated after %d frame(s)\n", frames);
+        break;
+      }
+      if (!(flags & TRACE_STREAM_DELTA)) {
+        if (payload.size() != rec_size) break;
+        rec = payload;
+      }
+      else if (!decode_delta(payload, rec)) {
+        printf("ERROR: Bad delta-encoded frame %d in trace stream\n", frames);
+        break;
+      }
+      char hex_filename[256];
+      snprintf(hex_filename, sizeof(hex_filename), "%s_%04d.hex", prefix, frames);
+      if (!write_capture_hex(hex_filename, rec.data(), columns)) break;
+      ++frames;
+    }
+    fclose(fp);
+    printf("Wrote %d frame(s) from %s to %s_*.hex\n", frames, filename, prefix);
+    return frames;
+  }
+
+  // Applies one frame's delta payload to rec (i.e. the previous frame's record):
+  static bool decode_delta(const std::vector<uint8_t> &payload, std::vector<uint8_t> &rec) {
+    size_t i = 0, p = 0;
+    while (p+4 <= payload.size()) {
+      uint16_t run[2];
+      memcpy(run, &payload[p], 4);
+      p += 4;
+      i += run[0];
+      if (i+run[1] > rec.size() || p+run[1] > payload.size()) return false;
+      memcpy(&rec[i], &payload[p], run[1]);
+      i += run[1];
+      p += run[1];
+    }
+    return p == payload.size();
+  }
+
+};
+
+
+// Writes every frame that gets presented (or, in replay(), drawn) to disk (--frame-dump), e.g. for
+// golden-image tests on a headless machine, or for making videos. As with RayboxTraceStream, the
+// frame loop only copies m_fb into one of a pool of preallocated buffers, and a background thread
+// encodes and writes them. But frames are much bigger than traces, so if the writer falls behind
+// and the pool is full, the frame is dropped (and counted) rather than waiting for the disk, unless
+// m_wait is set (as it is for replay(), which has no display to keep up with). Formats:
+//   FRAME_DUMP_RAW: "RBXF", uint16 version, width, height, flags (FRAME_DUMP_DELTA or 0), then
+//     for each frame: uint32 frame number, uint32 payload size, payload. The payload is the frame's
+//     pixels (RGBA bytes, row by row) or, with FRAME_DUMP_DELTA, the span of each column that
+//     changed since the previous frame: for each column, uint16 top row, uint16 rows, then those
+//     rows' pixels, top to bottom. (Walls move a column at a time, so the spans are tight.)
+//   FRAME_DUMP_Y4M: A YUV4MPEG2 (4:2:0, BT.601) video, that most video tools can read.
+//   FRAME_DUMP_PPM: One binary PPM file per frame, named with the frame number.
+enum {
+  FRAME_DUMP_RAW,
+  FRAME_DUMP_Y4M,
+  FRAME_DUMP_PPM
+};
+enum {
+  FRAME_DUMP_DELTA = 1
+};
+
+// Writes RGBA pixels as a binary PPM file:
+static bool write_ppm(const char *filename, const uint8_t *rgba, int width, int height) {
+  FILE *fp = fopen(filename, "wb");
+  if (!fp) {
+    printf("ERROR: Failed to open PPM file: %s\n", filename);
+    return false;
+  }
+  fprintf(fp, "P6\n%d %d\n255\n", width, height);
+  std::vector<uint8_t> row(width*3);
+  for (int y=0; y<height; ++y) {
+    const uint8_t *p = rgba + size_t(y)*width*4;
+    for (int x=0; x<width; ++x) {
+      row[x*3]   = p[x*4];
+      row[x*3+1] = p[x*4+1];
+      row[x*3+2] = p[x*4+2];
+    }
+    fwrite(row.data(), 1, row.size(), fp);
+  }
+  bool ok = !ferror(fp);
+  fclose(fp);
+  return ok;
+}
+
+class RayboxFrameDump {
+public:
+
+  enum { VERSION = 1 };
+  enum { SLOTS = 8 };   // Frames that can be waiting to be written.
+
+  FILE *m_fp;
+  std::string m_prefix;                 // FRAME_DUMP_PPM: File names are m_prefix + "_NNNNNN.ppm".
+  int m_format;
+  int m_flags;
+  int m_width, m_height;
+  size_t m_frame_size;
+  bool m_wait;                          // Wait for the writer (rather than dropping frames) if the pool is full?
+  std::vector<uint8_t> m_pool;          // SLOTS frames (as in m_fb)...
+  uint32_t m_frame_numbers[SLOTS];      // ...and their frame numbers.
+  uint64_t m_head, m_tail;              // Frames pushed and written so far.
+  bool m_quit;
+  bool m_failed;
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  std::thread m_thread;
+  std::vector<uint8_t> m_rgba, m_prev, m_encoded; // Writer thread only.
+  std::vector<int> m_top, m_bottom;               // (Ditto: each column's changed span...)
+  std::vector<size_t> m_offset;                   // (...and where its pixels go in m_encoded.)
+  uint64_t m_bytes_written;
+  int m_dropped;                        // Frames dropped because the pool was full...
+  int m_stalls;                         // ...or, with m_wait, that had to wait for the writer.
+  uint64_t m_push_ticks;                // Time spent copying in push() (i.e. the frame loop's overhead).
+  uint64_t m_start, m_end;              // When create() and close() were called.
+
+  RayboxFrameDump() {
+    m_fp = NULL;
+    m_format = FRAME_DUMP_RAW;
+    m_flags = 0;
+    m_width = m_height = 0;
+    m_frame_size = 0;
+    m_wait = false;
+    m_head = m_tail = 0;
+    m_quit = false;
+    m_failed = false;
+    m_bytes_written = 0;
+    m_dropped = 0;
+    m_stalls = 0;
+    m_push_ticks = 0;
+    m_start = m_end = 0;
+  }
+
+  ~RayboxFrameDump() {
+    close();
+  }
+
+  bool is_open() {
+    return m_thread.joinable();
+  }
+
+  // Picks the format from the filename: FILE.y4m, FILE.ppm (i.e. FILE_NNNNNN.ppm), or else raw:
+  bool create(const char *filename, int width, int height, int flags) {
+    size_t len = strlen(filename);
+    auto ends_with = [&](const char *ext) { return len > 4 && !strcmp(filename+len-4, ext); };
+    m_format = ends_with(".y4m") ? FRAME_DUMP_Y4M : ends_with(".ppm") ? FRAME_DUMP_PPM : FRAME_DUMP_RAW;
+    if ((flags & FRAME_DUMP_DELTA) && m_format != FRAME_DUMP_RAW) {
+      printf("WARNING: Only raw frame dumps can be delta-encoded, so writing whole frames\n");
+      flags &= ~FRAME_DUMP_DELTA;
+    }
+    if (m_format == FRAME_DUMP_PPM) {
+      m_prefix.assign(filename, len-4);
+    }
+    else {
+      m_fp = fopen(filename, "wb");
+      if (!m_fp) {
+        printf("ERROR: Failed to open frame dump file: %s\n", filename);
+        return false;
+      }
+    }
+    m_flags = flags;
+    m_width = width;
+    m_height = height;
+    m_frame_size = size_t(width)*height*4;
+    m_pool.resize(m_frame_size * SLOTS);
+    m_rgba.resize(m_frame_size);
+    m_encoded.reserve(m_frame_size + width*4);
+    if (flags & FRAME_DUMP_DELTA) {
+      m_prev.assign(m_frame_size, 0);
+      m_top.resize(width);
+      m_bottom.resize(width);
+      m_offset.resize(width);
+    }
+    if (m_format == FRAME_DUMP_RAW) {
+      uint16_t header[4] = { VERSION, uint16_t(width), uint16_t(height), uint16_t(flags) };
+      fwrite("RBXF", 1, 4, m_fp);
+      fwrite(header, 2, 4, m_fp);
+      m_bytes_written = 4 + 8;
+    }
+    else if (m_format == FRAME_DUMP_Y4M) {
+      m_bytes_written = fprintf(m_fp, "YUV4MPEG2 W%d H%d F60:1 Ip A1:1 C420jpeg\n", width, height);
+    }
+    m_start = SDL_GetPerformanceCounter();
+    m_thread = std::thread([this] { write_loop(); });
+    return true;
+  }
+
+  // Writes out whatever is still in the pool, and closes the file:
+  void close() {
+    if (!is_open()) return;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_quit = true;
+    }
+    m_cv.notify_all();
+    m_thread.join();
+    m_end = SDL_GetPerformanceCounter();
+    if (m_fp) fclose(m_fp);
+    m_fp = NULL;
+  }
+
+  // Copies a frame (in m_fb's layout) into the pool, or drops it if the pool is full (see m_wait):
+  void push(const uint8_t *fb, uint32_t frame) {
+    uint64_t t0 = SDL_GetPerformanceCounter();
+    uint8_t *slot;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      if (m_head - m_tail == SLOTS) {
+        if (!m_wait) {
+          ++m_dropped;
+          return;
+        }
+        ++m_stalls;
+        m_cv.wait(lock, [this] { return m_head - m_tail < SLOTS; });
+        t0 = SDL_GetPerformanceCounter(); // (The wait is counted as stalls, not overhead.)
+      }
+      slot = &m_pool[(m_head % SLOTS) * m_frame_size];
+      m_frame_numbers[m_head % SLOTS] = frame;
+    }
+    // Only this thread writes to the slot between m_head and the writer's m_tail, so no lock needed:
+    memcpy(slot, fb, m_frame_size);
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      ++m_head;
+    }
+    m_cv.notify_all();
+    m_push_ticks += SDL_GetPerformanceCounter() - t0;
+  }
+
+  void write_loop() {
+    for (;;) {
+      const uint8_t *fb;
+      uint32_t frame;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait(lock, [this] { return m_quit || m_head != m_tail; });
+        if (m_head == m_tail) break; // Quitting, and nothing left to write.
+        fb = &m_pool[(m_tail % SLOTS) * m_frame_size];
+        frame = m_frame_numbers[m_tail % SLOTS];
+      }
+      // m_fb holds 0xAARRGGBB words, i.e. BGRA bytes (on little-endian machines):
+      const uint32_t *src = (const uint32_t*)fb;
+      for (size_t i=0; i<m_frame_size/4; ++i) {
+        m_rgba[i*4]   = uint8_t(src[i] >> 16);
+        m_rgba[i*4+1] = uint8_t(src[i] >> 8);
+        m_rgba[i*4+2] = uint8_t(src[i]);
+        m_rgba[i*4+3] = 0xff;
+      }
+      if (!write_frame(frame)) m_failed = true;
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ++m_tail;
+      }
+      m_cv.notify_all();
+    }
+  }
+
+  // Writes m_rgba, in m_format:
+  bool write_frame(uint32_t frame) {
+    if (m_format == FRAME_DUMP_PPM) {
+      char filename[512];
+      snprintf(filename, sizeof(filename), "%s_%06u.ppm", m_prefix.c_str(), frame);
+      if (!write_ppm(filename, m_rgba.data(), m_width, m_height)) return false;
+      m_bytes_written += m_frame_size/4*3 + snprintf(NULL, 0, "P6\n%d %d\n255\n", m_width, m_height);
+      return true;
+    }
+    if (m_format == FRAME_DUMP_Y4M) {
+      encode_yuv420();
+      m_bytes_written += fprintf(m_fp, "FRAME\n");
+      fwrite(m_encoded.data(), 1, m_encoded.size(), m_fp);
+      m_bytes_written += m_encoded.size();
+      return !ferror(m_fp);
+    }
+    const uint8_t *payload = m_rgba.data();
+    uint32_t size = m_frame_size;
+    if (m_flags & FRAME_DUMP_DELTA) {
+      encode_delta();
+      payload = m_encoded.data();
+      size = m_encoded.size();
+    }
+    uint32_t header[2] = { frame, size };
+    fwrite(header, 4, 2, m_fp);
+    fwrite(payload, 1, size, m_fp);
+    m_bytes_written += 8 + size;
+    return !ferror(m_fp);
+  }
+
+  // Encodes each column's span of m_rgba that differs from m_prev into m_encoded (see above),
+  // then makes m_prev the current frame. Both passes go row by row, to read memory in order:
+  // the first finds the spans, and the second copies each row's part of them into place.
+  void encode_delta() {
+    const uint32_t *cur = (const uint32_t*)m_rgba.data(), *prev = (const uint32_t*)m_prev.data();
+    std::fill(m_top.begin(), m_top.end(), m_height);
+    std::fill(m_bottom.begin(), m_bottom.end(), -1);
+    for (int y=0; y<m_height; ++y, cur+=m_width, prev+=m_width) {
+      for (int x=0; x<m_width; ++x) {
+        if (cur[x] == prev[x]) continue;
+        if (m_top[x] > y) m_top[x] = y;
+        m_bottom[x] = y;
+      }
+    }
+    size_t size = 0;
+    for (int x=0; x<m_width; ++x) {
+      if (m_bottom[x] < 0) m_top[x] = m_height; // (No span.)
+      int rows = std::max(0, m_bottom[x] - m_top[x] + 1);
+      m_offset[x] = size + 4;
+      size += 4 + size_t(rows)*4;
+    }
+    m_encoded.resize(size);
+    for (int x=0; x<m_width; ++x) {
+      uint16_t span[2] = { uint16_t(m_bottom[x] < 0 ? 0 : m_top[x]), uint16_t(std::max(0, m_bottom[x] - m_top[x] + 1)) };
+      memcpy(&m_encoded[m_offset[x] - 4], span, 4);
+    }
+    cur = (const uint32_t*)m_rgba.data();
+    for (int y=0; y<m_height; ++y, cur+=m_width) {
+      for (int x=0; x<m_width; ++x) {
+        if (y < m_top[x] || y > m_bottom[x]) continue;
+        memcpy(&m_encoded[m_offset[x]], &cur[x], 4);
+        m_offset[x] += 4;
+      }
+    }
+    memcpy(m_prev.data(), m_rgba.data(), m_frame_size);
+  }
+
+  // Converts m_rgba into m_encoded as 4:2:0 planes, with (limited range) BT.601 coefficients, in
+  // 8-bit fixed-point. Each chroma sample is the average of its 2x2 pixels:
+  void encode_yuv420() {
+    int cw = (m_width+1)/2, ch = m_height/2;
+    m_encoded.resize(size_t(m_width)*m_height + size_t(cw)*ch*2);
+    uint8_t *py = m_encoded.data(), *pu = py + size_t(m_width)*m_height, *pv = pu + size_t(cw)*ch;
+    for (int y=0; y<m_height; ++y) {
+      const uint8_t *p = &m_rgba[size_t(y)*m_width*4];
+      for (int x=0; x<m_width; ++x, p+=4) {
+        py[size_t(y)*m_width+x] = uint8_t(((66*p[0] + 129*p[1] + 25*p[2] + 128) >> 8) + 16);
+      }
+    }
+    for (int y=0; y<ch; ++y) {
+      for (int x=0; x<cw; ++x) {
+        int r = 0, g = 0, b = 0, n = 0;
+        for (int dy=0; dy<2; ++dy) {
+          for (int dx=0; dx<2 && x*2+dx<m_width; ++dx, ++n) {
+            const uint8_t *p = &m_rgba[(size_t(y*2+dy)*m_width + x*2+dx)*4];
+            r += p[0], g += p[1], b += p[2];
+          }
+        }
+        r /= n, g /= n, b /= n;
+        pu[size_t(y)*cw+x] = uint8_t(((-38*r - 74*g + 112*b + 128) >> 8) + 128);
+        pv[size_t(y)*cw+x] = uint8_t(((112*r - 94*g - 18*b + 128) >> 8) + 128);
+      }
+    }
+  }
+
+  // Converts a raw frame dump back into one PPM file per frame, named with the given prefix and
+  // the frame's number. Returns the number of frames:
+  static int convert_to_ppm(const char *filename, const char *prefix) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+      printf("ERROR: Failed to open frame dump file: %s\n", filename);
+      return -1;
+    }
+    char magic[4];
+    uint16_t header[4];
+    if (fread(magic, 1, 4, fp) != 4 || memcmp(magic, "RBXF", 4) || fread(header, 2, 4, fp) != 4 || header[0] != VERSION) {
+      printf("ERROR: Not a (version %d) raw frame dump: %s\n", VERSION, filename);
+      fclose(fp);
+      return -1;
+    }
+    int width = header[1], height = header[2], flags = header[3];
+    std::vector<uint8_t> rgba(size_t(width)*height*4, 0), payload;
+    int frames = 0;
+    uint32_t frame_header[2];
+    while (fread(frame_header, 4, 2, fp) == 2) {
+      payload.resize(frame_header[1]);
+      if (fread(payload.data(), 1, payload.size(), fp) != payload.size()) {
+        printf("WARNING: Frame dump is truncated after %d frame(s)\n", frames);
+        break;
+      }
+      if (!(flags & FRAME_DUMP_DELTA)) {
+        if (payload.size() != rgba.size()) break;
+        rgba = payload;
+      }
+      else if (!decode_delta(payload, rgba, width, height)) {
+        printf("ERROR: Bad delta-encoded frame %d in frame dump\n", frames);
+        break;
+      }
+      char ppm_filename[512];
+      snprintf(ppm_filename, sizeof(ppm_filename), "%s_%06u.ppm", prefix, frame_header[0]);
+      if (!write_ppm(ppm_filename, rgba.data(), width, height)) break;
+      ++frames;
+    }
+    fclose(fp);
+    printf("Wrote %d frame(s) from %s to %s_*.ppm\n", frames, filename, prefix);
+    return frames;
+  }
+
+  // Applies one frame's column spans to rgba (i.e. the previous frame):
+  static bool decode_delta(const std::vector<uint8_t> &payload, std::vector<uint8_t> &rgba, int width, int height) {
+    size_t p = 0;
+    for (int x=0; x<width; ++x) {
+      uint16_t span[2];
+      if (p+4 > payload.size()) return false;
+      memcpy(span, &payload[p], 4);
+      p += 4;
+      if (span[0]+span[1] > height || p+size_t(span[1])*4 > payload.size()) return false;
+      for (int y=span[0]; y<span[0]+span[1]; ++y, p+=4) {
+        memcpy(&rgba[(size_t(y)*width+x)*4], &payload[p], 4);
+      }
+    }
+    return p == payload.size();
+  }
+
+};
+
+
+// Ways that render_walls() can draw the backdrop (sky/floor) and walls for m_traces:
+enum {
+  RENDER_OVERDRAW,  // Original: Fill the backdrop column by column, then draw the walls over it.
+  RENDER_SPANS,     // Per chunk of columns, write the sky, wall and floor spans of each column once.
+  RENDER_ROWS,      // Row by row, so that stores are sequential (and vectorisable).
+  RENDER_MODE_COUNT
+};
+
+const char *render_mode_name(int mode) {
+  switch (mode) {
+    case RENDER_OVERDRAW: return "overdraw";
+    case RENDER_SPANS:    return "spans";
+    case RENDER_ROWS:     return "rows";
+  }
+  return "?";
+}
+
+// View sizes that the trace/render core is specialised for (see view_shape_t):
+enum {
+  VIEW_GENERIC,   // Any other size (or --view-generic).
+  VIEW_640x480,
+  VIEW_1680x1200, // 7:5 gives us square walls with an FOV of 70deg.
+  VIEW_1760x1320,
+  VIEW_VARIANT_COUNT
+};
+
+const char *view_variant_name(int variant) {
+  switch (variant) {
+    case VIEW_GENERIC:   return "generic";
+    case VIEW_640x480:   return "640x480";
+    case VIEW_1680x1200: return "1680x1200";
+    case VIEW_1760x1320: return "1760x1320";
+  }
+  return "?";
+}
+
+// Each column's cameraX (i.e. proportional position along the viewplane, in [-1,1)), worked out at
+// compile time exactly as the tracers would work it out at run time:
+template<typename N, int W>
+struct camera_x_lut_t {
+  N v[W];
+  constexpr camera_x_lut_t() : v() {
+    for (int x=0; x<W; ++x) v[x] = N(2*x) / N(W) - N(1);
+  }
+};
+
+template<typename N, int W>
+struct camera_x_table_t {
+  static const N *get() { return NULL; } // (Fixed isn't constexpr, so it divides at run time.)
+};
+
+template<int W>
+struct camera_x_table_t<float, W> {
+  static const float *get() { static constexpr camera_x_lut_t<float, W> lut; return lut.v; }
+};
+
+template<int W>
+struct camera_x_table_t<double, W> {
+  static const double *get() { static constexpr camera_x_lut_t<double, W> lut; return lut.v; }
+};
+
+// The size of the view, as the trace/render core sees it. For the sizes in VIEW_*, it's a
+// compile-time constant, so the compiler can fold the per-row and per-column arithmetic (and unroll
+// and vectorise the row loops), and cameraX comes from a constexpr table rather than a divide.
+// view_shape_t<0,0> is the generic fallback for any other size, which works it all out at run time.
+//NOTE: Keep the arithmetic the same in both, so that they trace and draw exactly the same pixels.
+template<int W, int H>
+struct view_shape_t {
+  static_assert(H % 2 == 0, "View height must be even"); // render_rows() draws mirrored pairs of rows.
+  enum { FIXED = true, WIDTH = W, HEIGHT = H };
+  int width() const { return W; }
+  int height() const { return H; }
+  template<typename N> const N *camera_x_table() const { return camera_x_table_t<N, W>::get(); }
+  template<typename N> N camera_x(int x) const {
+    const N *table = camera_x_table<N>();
+    return table ? table[x] : camera_x_math_t<N>::at(x, W);
+  }
+};
+
+template<>
+struct view_shape_t<0, 0> {
+  enum { FIXED = false, WIDTH = 0, HEIGHT = 0 };
+  int w, h;
+  int width() const { return w; }
+  int height() const { return h; }
+  template<typename N> const N *camera_x_table() const { return NULL; }
+  template<typename N> N camera_x(int x) const { return camera_x_math_t<N>::at(x, w); }
+};
+
+typedef view_shape_t<0, 0> generic_view_t;
+
+
+// Table-driven tracing (--ray-table N), as the FPGA version has to do it: The heading is quantised
+// to one of N angles, and for each of those (and each column of the view) the table has the ray's
+// direction and step distances, so the tracers don't have to work them out (and rotate() doesn't
+// need any trig). Turning by a quarter turn swaps and negates the components, so only the first
+// quarter of the angles is stored.
+//NOTE: The table is worked out with exactly the same float arithmetic as the tracers, from the
+// same camera that set_heading() gives, so tracing from it gives bit-identical results. Only the
+// float backend uses it.
+class RayboxRayTable {
+public:
+
+  int m_angles;       // Headings per full turn (a multiple of 4), or 0 if there's no table.
+  int m_width;        // Columns (i.e. the view width) it was built for...
+  num m_view_mag;     // ...and the magnitude of the view plane vector (see RayboxSystem::set_fov()).
+  std::vector<float> m_heading_x, m_heading_y;  // For each of the first quarter of the angles...
+  std::vector<float> m_dir_x, m_dir_y;          // ...and, for each of those, each column's ray
+  std::vector<float> m_step_x, m_step_y;        // direction and step distances (m_width apart).
+
+  RayboxRayTable() {
+    m_angles = 0;
+    m_width = 0;
+    m_view_mag = 0;
+  }
+
+  bool matches(int angles, int width, num view_mag) const {
+    return m_angles == angles && m_width == width && m_view_mag == view_mag;
+  }
+
+  void build(int angles, int width, num view_mag) {
+    m_angles = angles;
+    m_width = width;
+    m_view_mag = view_mag;
+    const int quarter = angles/4;
+    const generic_view_t view = { width, 2 };
+    m_heading_x.resize(quarter);
+    m_heading_y.resize(quarter);
+    m_dir_x.resize(size_t(quarter)*width);
+    m_dir_y.resize(m_dir_x.size());
+    m_step_x.resize(m_dir_x.size());
+    m_step_y.resize(m_dir_x.size());
+    for (int a=0; a<quarter; ++a) {
+      // Turning left by t from facing north (0,-1), as rotate() does:
+      double t = 2.0*PI*a/angles;
+      num headingX = 0.0f - num(sin(t)); // (i.e. +0 rather than -0 when facing north)
+      num headingY = -num(cos(t));
+      num viewX = -headingY * view_mag;
+      num viewY =  headingX * view_mag;
+      m_heading_x[a] = headingX;
+      m_heading_y[a] = headingY;
+      for (int x=0; x<width; ++x) {
+        num cameraX = view.camera_x<num>(x);
+        num rayDirX = headingX + viewX*cameraX;
+        num rayDirY = headingY + viewY*cameraX;
+        size_t i = size_t(a)*width + x;
+        m_dir_x[i] = rayDirX;
+        m_dir_y[i] = rayDirY;
+        m_step_x[i] = num_recip_abs(rayDirX);
+        m_step_y[i] = num_recip_abs(rayDirY);
+      }
+    }
+  }
+
+  // The heading for angle (0..m_angles-1), i.e. that of the first quarter turned by 90deg to the
+  // left (x,y -> y,-x) for each quarter that it's in:
+  void heading(int angle, num &headingX, num &headingY) const {
+    const int quarter = m_angles/4;
+    num x = m_heading_x[angle % quarter], y = m_heading_y[angle % quarter];
+    switch (angle / quarter) {
+      case 0: headingX =  x; headingY =  y; break;
+      case 1: headingX =  y; headingY = -x; break;
+      case 2: headingX = -x; headingY = -y; break;
+      default: headingX = -y; headingY =  x; break;
+    }
+  }
+
+  // The rays for angle, which are those of the first quarter turned in the same way:
+  ray_row_t rays(int angle) const {
+    const int quarter = m_angles/4;
+    size_t i = size_t(angle % quarter)*m_width;
+    const float *dx = &m_dir_x[i], *dy = &m_dir_y[i], *sx = &m_step_x[i], *sy = &m_step_y[i];
+    switch (angle / quarter) {
+      case 0:  return { dx, dy, sx, sy, +1.0f, +1.0f };
+      case 1:  return { dy, dx, sy, sx, +1.0f, -1.0f };
+      case 2:  return { dx, dy, sx, sy, -1.0f, -1.0f };
+      default: return { dy, dx, sy, sx, -1.0f, +1.0f };
+    }
+  }
+
+  // The nearest angle to a heading (this is the only place that needs trig, and only to snap
+  // a heading that came from elsewhere, e.g. a recording, to the table):
+  int nearest_angle(num headingX, num headingY) const {
+    double t = atan2(-double(headingX), -double(headingY));
+    int angle = int(floor(t * m_angles / (2.0*PI) + 0.5));
+    return ((angle % m_angles) + m_angles) % m_angles;
+  }
+
+};
+
+// Wall textures, for --textures: TEXTURE_COUNT procedural TEXTURE_SIZE^2 textures, each with its
+// mip levels (down to 1x1), all in one atlas. Texels are stored column-major, so that drawing a
+// screen column of wall reads one texture column, in order.
+#define TEXTURE_BITS 6
+#define TEXTURE_SIZE (1<<TEXTURE_BITS)
+#define TEXTURE_LEVELS (TEXTURE_BITS+1)
+#define TEXTURE_COUNT 8
+#define FLOOR_TEXTURE 1   // Grey stone (see RayboxTextures::texel()).
+#define CEILING_TEXTURE 2 // Wooden planks.
+
+class RayboxTextures {
+public:
+
+  std::vector<uint32_t> m_texels;
+  size_t m_offset[TEXTURE_COUNT][TEXTURE_LEVELS]; // Where each level of each texture starts in m_texels.
+
+  // What to draw for one column of wall (see column()): Its rows y0..y1-1 are texels[pos>>16],
+  // with pos (16.16 fixed-point) starting at pos and going up by step each row, masked by shade.
+  struct column_t {
+    const uint32_t *texels;
+    uint32_t pos, step;
+    int y0, y1;
+    uint32_t shade;
+  };
+
+  // What to draw for one pair of floor and ceiling rows (see row()): Pixel x of each is
+  // texels[index(u + x*du, v + x*dv)], from the floor or ceiling texture at the same mip level.
+  struct row_t {
+    const uint32_t *floor, *ceiling;
+    uint32_t u, v, du, dv;  // World x,y in 16.16 fixed-point texels (of the top level, so they wrap every cell).
+    int shift, bits;        // 16 + mip level, and log2 of that level's size.
+    uint32_t mask;          // That level's size - 1.
+    size_t index(uint32_t pu, uint32_t pv) const {
+      return size_t(((pu >> shift) & mask) << bits | ((pv >> shift) & mask));
+    }
+  };
+
+  RayboxTextures() {
+    size_t size = 0;
+    for (int t = 0; t < TEXTURE_COUNT; ++t) {
+      for (int m = 0; m < TEXTURE_LEVELS; ++m) {
+        m_offset[t][m] = size;
+        size += size_t(TEXTURE_SIZE>>m) * (TEXTURE_SIZE>>m);
+      }
+    }
+    m_texels.resize(size);
+    for (int t = 0; t < TEXTURE_COUNT; ++t) {
+      uint32_t *top = &m_texels[m_offset[t][0]];
+      for (int u = 0; u < TEXTURE_SIZE; ++u) {
+        for (int v = 0; v < TEXTURE_SIZE; ++v) top[u*TEXTURE_SIZE + v] = texel(t, u, v);
+      }
+      // Each mip level is a 2x2 box filter of the one above it:
+      for (int m = 1; m < TEXTURE_LEVELS; ++m) {
+        const int s = TEXTURE_SIZE>>m;
+        const uint32_t *src = &m_texels[m_offset[t][m-1]];
+        uint32_t *dst = &m_texels[m_offset[t][m]];
+        for (int u = 0; u < s; ++u) {
+          for (int v = 0; v < s; ++v) {
+            uint32_t a = src[(2*u)*2*s + 2*v], b = src[(2*u)*2*s + 2*v+1];
+            uint32_t c = src[(2*u+1)*2*s + 2*v], d = src[(2*u+1)*2*s + 2*v+1];
+            uint32_t out = 0xff000000;
+            for (int shift = 0; shift < 24; shift += 8) {
+              uint32_t sum = ((a>>shift)&0xff) + ((b>>shift)&0xff) + ((c>>shift)&0xff) + ((d>>shift)&0xff);
+              out |= ((sum+2)/4) << shift;
+            }
+            dst[u*s + v] = out;
+          }
+        }
+      }
+    }
+  }
+
+  // Small hash, for texture noise:
+  static uint32_t noise(int t, int u, int v) {
+    uint32_t h = uint32_t(t)*0x9e3779b1u ^ uint32_t(u)*0x85ebca6bu ^ uint32_t(v)*0xc2b2ae35u;
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+    return h;
+  }
+
+  // Scales an 0xRRGGBB colour by (256+delta)/256, clamped:
+  static uint32_t tint(uint32_t rgb, int delta) {
+    uint32_t out = 0xff000000;
+    for (int shift = 0; shift < 24; shift += 8) {
+      int c = int((rgb>>shift)&0xff) * (256+delta) / 256;
+      out |= uint32_t(std::max(0, std::min(255, c))) << shift;
+    }
+    return out;
+  }
+
+  // Texel u,v (u across, v down) of texture t's top level:
+  static uint32_t texel(int t, int u, int v) {
+    int n = int(noise(t, u, v) & 31) - 16; // Grain.
+    switch (t) {
+      case 0: { // Red brick: 32x16 bricks, every other row offset by half a brick.
+        int row = v/16;
+        bool mortar = (v%16 == 15) || ((u + (row&1)*16) % 32 == 31);
+        return mortar ? tint(0xa0a090, n) : tint(0x9c4030, n*2 - (row%3)*12);
+      }
+      case 1: { // Grey stone blocks.
+        bool seam = (u%32 == 0) || (v%32 == 0);
+        return seam ? tint(0x404040, n) : tint(0x808080, n*3 + int(noise(t, u/32, v/32) & 31));
+      }
+      case 2: { // Vertical wooden planks.
+        bool gap = (u%16 == 0);
+        int grain = int(noise(t, u, 0) & 15) + ((v + u*7) % 11 == 0 ? -40 : 0);
+        return gap ? tint(0x302010, 0) : tint(0x8a5a2b, grain + n);
+      }
+      case 3: // Green check (as the old procedural texture in render_view_columns() had it).
+        return ((u&4)^(v&4)) ? 0xff00ff00 : 0xff007000;
+      case 4: { // Blue tiles, with light grout.
+        bool grout = (u%16 == 0) || (v%16 == 0);
+        return grout ? tint(0xc0c8d0, n) : tint(0x2850a0, n + int(noise(t, u/16, v/16) & 31) - 16);
+      }
+      case 5: { // Metal panels, with rivets in the corners.
+        int pu = u%32, pv = v%32;
+        bool rivet = (pu == 3 || pu == 28) && (pv == 3 || pv == 28);
+        bool edge = pu == 0 || pv == 0;
+        return rivet ? 0xffe0e0e0 : edge ? tint(0x505860, 0) : tint(0x8890a0, n/2 - pv);
+      }
+      case 6: { // Mossy stone: stone with green patches.
+        bool moss = (noise(t, u/8, v/8) & 3) == 0;
+        return moss ? tint(0x4a7a30, n*2) : tint(0x7a7468, n*3);
+      }
+      default: { // Purple diamonds.
+        int du = std::abs(u%16 - 8), dv = std::abs(v%16 - 8);
+        return (du + dv < 7) ? tint(0x9040b0, n) : tint(0x301840, n);
+      }
+    }
+  }
+
+  // Which texture a wall of the given colour gets:
+  static int for_color(uint32_t color) {
+    uint32_t h = (color ^ (color>>7) ^ (color>>17)) * 0x9e3779b1u;
+    return int((h >> 24) % TEXTURE_COUNT);
+  }
+
+  // Works out how to draw the wall for a traced column in a view H pixels high: The mip level is
+  // the biggest one that's no taller than the (unclipped) wall, and u comes from where the ray hit
+  // along the wall's face. The only division is the step, once per column.
+  column_t column(const traced_column_t &col, int H) const {
+    column_t c;
+    c.shade = col.side ? 0xffffffff : 0xffc0c0c0; // (As for flat walls: see RayboxSystem::wall_color().)
+    // (h is clamped while it's still a float, as a wall right up against the camera can be too tall
+    // for int. At the limit, the step is 1/65536 of a texel per row, so the middle texel fills the view.)
+    const float hf = HEIGHT_FROM_DIST(col.dist, H);
+    const int h = (hf < float(TEXTURE_SIZE<<15)) ? int(hf) : TEXTURE_SIZE<<15;
+    if (h <= 0) {
+      c.texels = &m_texels[0];
+      c.pos = c.step = 0;
+      c.y0 = c.y1 = H/2;
+      return c;
+    }
+    int m = 0;
+    while (m < TEXTURE_LEVELS-1 && (TEXTURE_SIZE>>m) > 2*h) ++m;
+    const int s = TEXTURE_SIZE>>m;
+    num f = col.side ? col.hx : col.hy;
+    f -= floor(f);
+    int u = std::min(int(f*num(s)), s-1);
+    c.texels = &m_texels[m_offset[for_color(col.color)][m] + size_t(u)*s];
+    c.step = uint32_t((uint64_t(s) << 16) / (2*uint64_t(h)));
+    const int top = H/2 - h;
+    c.y0 = std::max(0, top);
+    c.y1 = std::min(H, H/2 + h);
+    c.pos = uint32_t(uint64_t(c.y0 - top) * c.step);
+    return c;
+  }
+
+  // Works out how to draw the floor row k rows below the horizon of a view W x H, and the ceiling
+  // row k rows above it: Both are at distance (H/2)/(k+0.5) (as HEIGHT_FROM_DIST() has it, at the
+  // middle of the row), and go from where the leftmost column's ray meets them to the rightmost
+  // one's, in equal steps. The mip level is the biggest one with no more than a texel per pixel.
+  row_t row(const RayboxCamera &cam, int k, int W, int H) const {
+    row_t r;
+    const float d = float(H/2) / (float(k) + 0.5f);
+    const double scale = double(TEXTURE_SIZE << 16);
+    r.u = uint32_t(int64_t(std::floor(double(cam.playerX + d*(cam.headingX - cam.viewX)) * scale)));
+    r.v = uint32_t(int64_t(std::floor(double(cam.playerY + d*(cam.headingY - cam.viewY)) * scale)));
+    r.du = uint32_t(int64_t(std::floor(double(2.0f*d*cam.viewX / float(W)) * scale + 0.5)));
+    r.dv = uint32_t(int64_t(std::floor(double(2.0f*d*cam.viewY / float(W)) * scale + 0.5)));
+    const uint32_t step = std::max(uint32_t(std::abs(int32_t(r.du))), uint32_t(std::abs(int32_t(r.dv))));
+    int m = 0;
+    while (m < TEXTURE_LEVELS-1 && (step >> m) > (1u << 16)) ++m;
+    r.floor = &m_texels[m_offset[FLOOR_TEXTURE][m]];
+    r.ceiling = &m_texels[m_offset[CEILING_TEXTURE][m]];
+    r.shift = 16 + m;
+    r.bits = TEXTURE_BITS - m;
+    r.mask = (TEXTURE_SIZE >> m) - 1;
+    return r;
+  }
+
+};
+
+
+#ifdef RAYBOX_SIMD
+// Draws the floor row y of a pair (see RayboxTextures::row()), and its mirror image in the ceiling
+// row up, 8 pixels at a time: The texel indices are worked out in vector registers and gathered
+// from both textures, then stored only to the columns whose walls (see stop) don't reach row y, or,
+// given each column's wall colour, blended with that. Returns how many columns it did (a multiple
+// of 8), leaving any others to the caller:
+__attribute__((target("avx2")))
+static int render_floor_row_avx2(
+  const RayboxTextures::row_t &r, uint32_t *up, uint32_t *dn, const int *stop, const uint32_t *color, int y, int W
+) {
+  const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256i u = _mm256_add_epi32(_mm256_set1_epi32(r.u), _mm256_mullo_epi32(lane, _mm256_set1_epi32(r.du)));
+  __m256i v = _mm256_add_epi32(_mm256_set1_epi32(r.v), _mm256_mullo_epi32(lane, _mm256_set1_epi32(r.dv)));
+  const __m256i du8 = _mm256_set1_epi32(r.du*8), dv8 = _mm256_set1_epi32(r.dv*8);
+  const __m128i shift = _mm_cvtsi32_si128(r.shift), bits = _mm_cvtsi32_si128(r.bits);
+  const __m256i mask = _mm256_set1_epi32(r.mask), yv = _mm256_set1_epi32(y), ones = _mm256_set1_epi32(-1);
+  int x = 0;
+  for (; x+8 <= W; x += 8, u = _mm256_add_epi32(u, du8), v = _mm256_add_epi32(v, dv8)) {
+    // Columns whose walls stop at or above row y, i.e. !(stop > y):
+    __m256i wall = _mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i*)(stop+x)), yv);
+    if (_mm256_testc_si256(wall, ones)) {
+      // All wall, which is common near the horizon:
+      if (color) {
+        __m256i c = _mm256_loadu_si256((const __m256i*)(color+x));
+        _mm256_storeu_si256((__m256i*)(up+x), c);
+        _mm256_storeu_si256((__m256i*)(dn+x), c);
+      }
+      continue;
+    }
+    __m256i index = _mm256_or_si256(
+      _mm256_sll_epi32(_mm256_and_si256(_mm256_srl_epi32(u, shift), mask), bits),
+      _mm256_and_si256(_mm256_srl_epi32(v, shift), mask)
+    );
+    __m256i f = _mm256_i32gather_epi32((const int*)r.floor, index, 4);
+    __m256i c = _mm256_i32gather_epi32((const int*)r.ceiling, index, 4);
+    if (color) {
+      __m256i w = _mm256_loadu_si256((const __m256i*)(color+x));
+      _mm256_storeu_si256((__m256i*)(up+x), _mm256_blendv_epi8(c, w, wall));
+      _mm256_storeu_si256((__m256i*)(dn+x), _mm256_blendv_epi8(f, w, wall));
+    }
+    else {
+      __m256i open = _mm256_xor_si256(wall, ones);
+      _mm256_maskstore_epi32((int*)(up+x), open, c);
+      _mm256_maskstore_epi32((int*)(dn+x), open, f);
+    }
+  }
+  return x;
+}
+#endif // RAYBOX_SIMD
+
+// Ways that render() can get each frame onto the screen (see RayboxSystem::present()):
+enum {
+  PRESENT_COPY,     // Original: Draw into our own m_fb, then copy it into the texture with SDL_UpdateTexture().
+  PRESENT_LOCK,     // Draw straight into the (locked) texture's pixels.
+  PRESENT_PIPELINE, // Hand each frame to RayboxPresenter, and draw the next one while it's presented.
+  PRESENT_MODE_COUNT
+};
+
+const char *present_mode_name(int mode) {
+  switch (mode) {
+    case PRESENT_COPY:     return "copy";
+    case PRESENT_LOCK:     return "lock";
+    case PRESENT_PIPELINE: return "pipeline";
+  }
+  return "?";
+}
+
+// How long presenting frames takes, in SDL performance counter ticks:
+struct present_stats_t {
+  std::atomic<uint64_t> frames;
+  std::atomic<uint64_t> copy_ticks;     // Getting the pixels into the texture (e.g. SDL_UpdateTexture()).
+  std::atomic<uint64_t> latency_ticks;  // From the frame being finished to SDL_RenderPresent() returning.
+
+  present_stats_t() : frames(0), copy_ticks(0), latency_ticks(0) {}
+
+  void add(uint64_t copy, uint64_t latency) {
+    ++frames;
+    copy_ticks += copy;
+    latency_ticks += latency;
+  }
+};
+
+
+// When a frame's input was sampled, for measuring input latency (see input_latency_t):
+struct input_times_t {
+  uint64_t sampled;       // SDL_GetPerformanceCounter() when run() sampled the keyboard for this frame...
+  uint64_t prev_sampled;  // ...and for the frame before.
+  uint64_t pressed;       // The earliest key press (that moves the player) since then, or 0.
+};
+
+// Input latency, i.e. from input arriving to SDL_RenderPresent() returning with a frame that
+// used it. The keyboard is only read when run() samples it (and SDL only timestamps key events
+// as they're pumped, at the same point), so an input arriving at any moment waits for the next
+// sample, then for that frame to be traced, drawn and presented. Each presented frame therefore
+// adds an even spread of latencies, for inputs that arrived at any time since the previous
+// sample, weighted by that time, so that the percentiles are over time rather than frames. Key
+// presses are recorded too, one by one (from their SDL timestamps).
+#define LATENCY_BIN_MS 0.1
+#define LATENCY_BINS 2500   // i.e. up to 250 ms (anything longer goes in the last bin).
+
+struct input_latency_t {
+  std::mutex mutex;                 // (PRESENT_PIPELINE adds frames from the presenter's thread.)
+  std::vector<double> spread;       // Time (ms) that inputs would've had each latency...
+  std::vector<double> presses;      // ...and key presses that did.
+  int press_count;
+  uint64_t last_presented;          // When SDL_RenderPresent() last returned (for --late-input).
+  double work_ms;                   // Recent worst time from sampling input to SDL_RenderPresent() (ditto).
+
+  input_latency_t() : spread(LATENCY_BINS, 0.0), presses(LATENCY_BINS, 0.0) {
+    press_count = 0;
+    last_presented = 0;
+    work_ms = 0;
+  }
+
+  // Records a frame, given when it was ready to present (i.e. SDL_RenderPresent() was called), and
+  // when it was presented:
+  void add(const input_times_t &in, uint64_t ready, uint64_t presented, uint64_t frequency) {
+    double tick_ms = 1000.0 / double(frequency);
+    double lo = double(presented - in.sampled) * tick_ms, hi = double(presented - in.prev_sampled) * tick_ms;
+    double work = double(ready - in.sampled) * tick_ms;
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int b = bin(lo); b <= bin(hi) && hi > lo; ++b) {
+      double b0 = b*LATENCY_BIN_MS, b1 = (b == LATENCY_BINS-1) ? hi : b0 + LATENCY_BIN_MS;
+      spread[b] += std::max(0.0, std::min(hi, b1) - std::max(lo, b0));
+    }
+    if (in.pressed) {
+      presses[bin(double(presented - in.pressed) * tick_ms)] += 1.0;
+      ++press_count;
+    }
+    last_presented = presented;
+    // Jump up to slower frames straight away, but only come down slowly:
+    work_ms = std::max(work, work_ms + 0.02*(work - work_ms));
+  }
+
+  static int bin(double ms) {
+    return std::max(0, std::min(LATENCY_BINS-1, int(ms / LATENCY_BIN_MS)));
+  }
+
+  // The (upper edge of the) bin that the given percentile of bins' weight falls in, in ms:
+  static double percentile(const std::vector<double> &bins, double pct) {
+    double total = 0, sum = 0;
+    for (double w : bins) total += w;
+    if (total <= 0) return 0;
+    for (int b=0; b<LATENCY_BINS; ++b) {
+      sum += bins[b];
+      if (sum >= total * pct/100.0) return (b+1)*LATENCY_BIN_MS;
+    }
+    return LATENCY_BINS*LATENCY_BIN_MS;
+  }
+};
+
+
+// Picks the scale that run() renders at with --dynamic-res, to keep frames within a time budget:
+// Traced columns and drawn rows both go with the scale, so a frame's cost goes roughly with its
+// square. The frame times are smoothed, and the scale only changes (in steps of 1/16) once they've
+// been out of the band from 60% to 95% of the budget for a while, so that it doesn't flicker.
+#define SCALE_STEPS 16
+#define SCALE_SETTLE_FRAMES 8 // Frames to wait after a change before changing again.
+
+class RayboxScaleController {
+public:
+  double m_budget_ms;   // Target frame time.
+  double m_min_scale;
+  double m_scale;       // Current scale, of both the width and the height of the view.
+  double m_avg_ms;      // Smoothed frame time.
+  int m_frames;         // Frames since the scale last changed.
+  int m_misses;         // Frames that went over budget (since the caller last reset this).
+
+  RayboxScaleController() {
+    m_budget_ms = 1000.0/60.0;
+    m_min_scale = 0.25;
+    m_scale = 1.0;
+    m_avg_ms = 0;
+    m_frames = 0;
+    m_misses = 0;
+  }
+
+  // Adds a frame's time, and returns true if the scale should change (to m_scale):
+  bool update(double frame_ms) {
+    if (frame_ms > m_budget_ms) ++m_misses;
+    m_avg_ms = m_frames ? m_avg_ms + 0.2*(frame_ms - m_avg_ms) : frame_ms;
+    if (++m_frames < SCALE_SETTLE_FRAMES) return false;
+    if (m_avg_ms <= 0.95*m_budget_ms && m_avg_ms >= 0.6*m_budget_ms) return false;
+    // Aim for the middle of the band, i.e. some headroom below the budget:
+    double scale = m_scale * std::sqrt(0.8*m_budget_ms / std::max(m_avg_ms, 0.001));
+    scale = std::max(m_min_scale, std::min(1.0, std::floor(scale*SCALE_STEPS + 0.5) / SCALE_STEPS));
+    if (scale == m_scale) return false;
+    m_scale = scale;
+    m_frames = 0;
+    return true;
+  }
+};
+
+
+// Presents frames on a thread of its own (PRESENT_PIPELINE), so that the next frame
+// can be traced and drawn in the meantime. It owns all of the framebuffers: the one
+// being drawn into, plus the rest, which are queued for (or being) presented.
+//NOTE: SDL's renderer isn't thread-safe, so the presenter thread creates the renderer
+// and texture itself, and is the only thread to touch them.
+class RayboxPresenter {
+public:
+
+  struct queued_t {
+    uint8_t *fb;
+    uint64_t submitted; // SDL_GetPerformanceCounter() when the frame was finished.
+    input_times_t input;
+  };
+
+  SDL_Window *m_window;
+  SDL_Renderer *m_renderer;
+  SDL_Texture *m_texture;
+  int m_width, m_height;
+  present_stats_t *m_stats;
+  input_latency_t *m_latency;
+  bool m_vsync;
+  std::vector<uint8_t*> m_buffers;
+  std::list<queued_t> m_queue;  // Frames waiting to be presented, oldest first.
+  std::list<uint8_t*> m_free;   // Buffers that can be drawn into.
+  bool m_ready;
+  bool m_presenting;            // Is a frame being presented (i.e. taken off m_queue, but not presented yet)?
+  bool m_quit;
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  std::thread m_thread;
+
+  RayboxPresenter(SDL_Window *window, int width, int height, int count, present_stats_t *stats, input_latency_t *latency, bool vsync) {
+    m_window = window;
+    m_renderer = NULL;
+    m_texture = NULL;
+    m_width = width;
+    m_height = height;
+    m_stats = stats;
+    m_latency = latency;
+    m_vsync = vsync;
+    for (int i=0; i<count; ++i) {
+      m_buffers.push_back(new uint8_t[width*height*4]);
+      if (i > 0) m_free.push_back(m_buffers[i]);
+    }
+    m_ready = false;
+    m_presenting = false;
+    m_quit = false;
+    m_thread = std::thread([this] { present_loop(); });
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cv.wait(lock, [this] { return m_ready; });
+  }
+
+  // Presents whatever is still queued, then stops:
+  ~RayboxPresenter() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_quit = true;
+    }
+    m_cv.notify_all();
+    m_thread.join();
+    for (uint8_t *fb : m_buffers) delete[] fb;
+  }
+
+  // The buffer to draw the first frame into:
+  uint8_t *first() { return m_buffers[0]; }
+
+  // Queues a finished frame to be presented, and returns a buffer to draw the next one
+  // into. With N buffers, this waits if N-1 frames are already waiting to be presented
+  // (or being presented):
+  uint8_t *submit(uint8_t *fb, const input_times_t &input) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_queue.push_back({ fb, SDL_GetPerformanceCounter(), input });
+    m_cv.notify_all();
+    m_cv.wait(lock, [this] { return !m_free.empty(); });
+    uint8_t *next = m_free.front();
+    m_free.pop_front();
+    return next;
+  }
+
+  // Waits until no frames are waiting to be presented, and returns whether one is still being presented:
+  bool wait_for_queue() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cv.wait(lock, [this] { return m_queue.empty(); });
+    return m_presenting;
+  }
+
+  void present_loop() {
+    m_renderer = SDL_CreateRenderer(m_window, -1, SDL_RENDERER_ACCELERATED | (m_vsync ? SDL_RENDERER_PRESENTVSYNC : 0));
+    SDL_SetRenderDrawColor(m_renderer, 0, 0, 0, SDL_ALPHA_OPAQUE);
+    SDL_RenderClear(m_renderer);
+    m_texture =
+      SDL_CreateTexture(
+        m_renderer,
+        SDL_PIXELFORMAT_ARGB8888,
+        SDL_TEXTUREACCESS_STREAMING,
+        m_width, m_height
+      );
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_ready = true;
+    }
+    m_cv.notify_all();
+    for (;;) {
+      queued_t frame;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait(lock, [this] { return m_quit || !m_queue.empty(); });
+        if (m_queue.empty()) break; // Quitting.
+        frame = m_queue.front();
+        m_queue.pop_front();
+        m_presenting = true;
+      }
+      m_cv.notify_all(); // (For wait_for_queue().)
+      uint64_t t0 = SDL_GetPerformanceCounter();
+      SDL_UpdateTexture(m_texture, NULL, frame.fb, m_width*4);
+      uint64_t t1 = SDL_GetPerformanceCounter();
+      SDL_RenderCopy(m_renderer, m_texture, NULL, NULL);
+      uint64_t ready = SDL_GetPerformanceCounter();
+      SDL_RenderPresent(m_renderer);
+      uint64_t t2 = SDL_GetPerformanceCounter();
+      m_stats->add(t1-t0, t2-frame.submitted);
+      // (The frame would've been ready this long after it was finished, if it hadn't been queued.)
+      m_latency->add(frame.input, frame.submitted + (ready-t0), t2, SDL_GetPerformanceFrequency());
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_presenting = false;
+        m_free.push_back(frame.fb);
+      }
+      m_cv.notify_all();
+    }
+    if (m_texture) SDL_DestroyTexture(m_texture);
+    if (m_renderer) SDL_DestroyRenderer(m_renderer);
+  }
+
+};
+
+
+class RayboxSystem {
+public:
+
+  RayboxMap m_map;
+  SDL_Window *m_window;
+  SDL_Renderer *m_renderer;
+  SDL_Texture *m_texture;
+  uint8_t *m_fb;
+  bool m_video_init;
+  bool m_img_init;
+  bool m_fixed_range_warned; // Warned that the map is too big for fixed_num, once.
+  bool m_headless; // No window/renderer/texture; used by benchmark mode.
+  bool m_show_map_overlay;
+  std::vector<uint32_t> m_map_layer;  // The map overlay's grid and cells, drawn once (see build_map_layer())...
+  int m_map_layer_width, m_map_layer_height;
+  bool m_map_layer_valid;             // ...for the current map and view size?
+  int m_view_width, m_view_height; // Size of the view (and m_fb), in pixels (see set_view()).
+  int m_view_variant;              // Which view_shape_t the trace/render core uses for it (VIEW_*).
+  bool m_view_generic;             // Was the generic view asked for (--view-generic), even if there's a specialised one?
+  int m_frame;
+  num playerX, playerY;
+  num headingX, headingY;
+  num viewX, viewY;
+  num fov;
+  num viewMag;
+  uint64_t m_prevTime;
+  uint64_t m_thisTime;
+  uint64_t m_frequency;
+  std::vector<traced_column_t> m_traces;  // One per column of the view.
+  bool m_capture_traces;
+  int m_threads;        // Worker threads for tracing/rendering columns (1 means serial, 0 means all cores).
+  int m_chunk_columns;  // Columns per chunk of work handed out to the workers.
+  RayboxThreadPool *m_pool;
+  bool m_reference;     // If true, bypass all optimised paths (used to verify them).
+  int m_simd_lanes;     // Columns per packet traced with SIMD (SIMD_OFF means scalar, 0 means auto-detect).
+  int m_backend;        // Numeric type used by the tracer (BACKEND_*). SIMD is only used with BACKEND_FLOAT.
+  int m_map_layout;     // Layout to use for maps we load (MAP_LAYOUT_*).
+  int m_accel;          // Skip empty space using the map's distance field? (1=on, 0=off, -1=auto, i.e. only on big maps).
+  std::atomic<uint64_t> m_dda_iterations; // DDA loop iterations (steps or leaps) done by the scalar tracer...
+  std::atomic<uint64_t> m_dda_cells;      // ...and the number of cells its rays passed through.
+  int m_reuse;          // Reuse the last frame's traces (see trace_mode())? (1=on, 0=off, -1=auto, i.e. only skip turns on big maps).
+  bool m_traces_valid;  // Does m_traces hold the traces for m_traced_cam (with m_traced_backend)?
+  RayboxCamera m_traced_cam;
+  int m_traced_backend;
+  RayboxCamera m_prev_cam;                      // Camera and traces of the last frame, for the
+  std::vector<traced_column_t> m_prev_traces;   // rotation fast path (see reuse_columns()).
+  std::atomic<uint64_t> m_columns_traced;     // Columns that trace() worked out again...
+  std::atomic<uint64_t> m_columns_reused;     // ...and those it got from the last frame's traces instead.
+  int m_adaptive;       // If more than 1, trace every Nth column first, then only refine between them where needed (see trace_columns_adaptive()).
+  std::atomic<uint64_t> m_rays_cast;          // Rays that trace() actually traced.
+  bool m_fb_view_current; // Does m_fb hold the backdrop, walls and sprites for m_traces, with nothing drawn over them?
+  bool m_fb_presented;    // Is m_fb unchanged since it was last presented?
+  int m_render_mode;      // How render_walls() draws the backdrop and walls (RENDER_*).
+  std::vector<int> m_span_stop;       // Per column, the row where the wall's lower half stops
+  std::vector<uint32_t> m_span_color; // and its (shaded) colour, for render_rows().
+  std::atomic<uint64_t> m_pixels_written; // Pixels written to m_fb by the backdrop and wall renderers (overdraw included).
+  int m_present_mode;     // How render() gets m_fb onto the screen (PRESENT_*).
+  int m_fb_count;         // Framebuffers to use with PRESENT_PIPELINE (2 or 3).
+  RayboxPresenter *m_presenter;
+  uint8_t *m_fb_alloc;    // Our own framebuffer (if m_fb isn't texture memory or one of m_presenter's).
+  bool m_fb_stale;        // Has present() just swapped m_fb for a buffer holding an older frame (or garbage)?
+  present_stats_t m_present_stats;
+  bool m_dynamic_res;     // Scale the view to keep run()'s frames within m_scaler's budget?
+  RayboxScaleController m_scaler;
+  int m_window_width, m_window_height; // The view's full size (and the texture's), as of prep().
+  bool m_vsync;           // Present in step with the display's refresh?
+  bool m_late_input;      // Sample the input as late as possible for each frame (see wait_to_sample_input())?
+  double m_late_margin_ms; // How long before it's needed to have a frame ready, with m_late_input.
+  double m_refresh_ms;    // The display's refresh interval, as of prep().
+  uint64_t m_key_pressed; // When the earliest key press since the last frame was presented happened, or 0.
+  input_latency_t m_input_latency;
+  int m_max_frames;       // If more than 0, run() stops after this many frames...
+  bool m_auto_turn;       // ...and if true, the player keeps turning, e.g. to time presenting with no input.
+  RayboxInputLog *m_recorder;  // If set, handle_input() records each frame's input to it.
+  RayboxTraceStream *m_trace_stream; // If set, every frame's traces are streamed to it.
+  RayboxFrameDump *m_frame_dump;     // If set, every frame that's drawn is copied to it.
+  int m_ray_angles;       // If more than 0, headings are quantised to this many angles, and traced from m_ray_table.
+  int m_heading_index;    // Which of those angles we're facing...
+  num m_turn_accum;       // ...and how many angle steps rotate() has turned by that haven't been taken yet.
+  RayboxRayTable m_ray_table;
+  RayboxTextures m_textures;
+  bool m_textured;        // Draw walls with m_textures (see render_textured_columns()), rather than flat colours?
+  bool m_floors;          // Draw textured floors and ceilings (see render_floors()), rather than flat colours?
+  ray_row_t m_ray_row;    // If the camera being traced is facing m_heading_index, this is its rays, and
+  const ray_row_t *m_rays;// m_rays points to it (otherwise m_rays is NULL, and the tracers work them out).
+  std::vector<sprite_t> m_sprites;            // Billboard sprites (see render_sprites()).
+  std::vector<sprite_view_t> m_sprite_views;  // Each sprite, as seen from the current camera (see project_sprites()).
+  std::vector<uint32_t> m_sprite_order;       // The visible ones, far to near...
+  std::vector<uint32_t> m_sprite_keys, m_sprite_tmp_keys, m_sprite_tmp_order; // (...sorted by depth).
+  std::vector<uint32_t> m_sprite_bins;        // For each chunk of columns, the visible sprites that overlap it,
+  std::vector<uint32_t> m_sprite_bin_start;   // far to near, starting at m_sprite_bins[m_sprite_bin_start[chunk]].
+#if RAYBOX_STATS
+  RayboxStats m_stats;
+  bool m_show_stats_overlay;    // Draw the stats overlay (see render_stats_overlay()) this frame?
+  bool m_stats_overlay_always;  // ...even without the key held down?
+#endif
+
+  RayboxSystem() {
+    m_window = NULL;
+    m_renderer = NULL;
+    m_texture = NULL;
+    m_fb = NULL;
+    m_video_init = false;
+    m_img_init = false;
+    m_fixed_range_warned = false;
+    m_headless = false;
+    m_frame = 0;
+    m_show_map_overlay = false;
+    m_map_layer_width = m_map_layer_height = 0;
+    m_map_layer_valid = false;
+    m_capture_traces = false;
+    m_threads = 1;
+    m_chunk_columns = 16; // 16 columns of ARGB8888 is one 64-byte cache line per row.
+    m_pool = NULL;
+    m_reference = false;
+    m_simd_lanes = 0;
+    m_backend = RAYBOX_BACKEND;
+    m_map_layout = MAP_LAYOUT_TILED;
+    m_accel = -1;
+    m_dda_iterations = 0;
+    m_dda_cells = 0;
+    m_reuse = -1;
+    m_traces_valid = false;
+    m_traced_backend = m_backend;
+    m_columns_traced = 0;
+    m_columns_reused = 0;
+    m_adaptive = 0;
+    m_rays_cast = 0;
+    m_fb_view_current = false;
+    m_fb_presented = false;
+    m_render_mode = RENDER_ROWS;
+    m_textured = false;
+    m_floors = false;
+    m_pixels_written = 0;
+    m_present_mode = PRESENT_COPY;
+    m_fb_count = 2;
+    m_presenter = NULL;
+    m_fb_alloc = NULL;
+    m_fb_stale = false;
+    m_dynamic_res = false;
+    m_window_width = m_window_height = 0;
+    m_vsync = false;
+    m_late_input = false;
+    m_late_margin_ms = 1.5;
+    m_refresh_ms = 1000.0/60.0;
+    m_key_pressed = 0;
+    m_max_frames = 0;
+    m_auto_turn = false;
+    m_recorder = NULL;
+    m_trace_stream = NULL;
+    m_frame_dump = NULL;
+    m_ray_angles = 0;
+    m_heading_index = 0;
+    m_turn_accum = 0;
+    m_rays = NULL;
+#if RAYBOX_STATS
+    m_show_stats_overlay = false;
+    m_stats_overlay_always = false;
+#endif
+    playerX = m_map.m_width>>1;
+    playerY = m_map.m_height>>1;
+    headingX = 0;
+    headingY = -1;
+    set_view(VIEW_WIDTH, VIEW_HEIGHT);
+    set_fov(70.0);
+  }
+
+  // Sets the size of the view, before prep() (or, with --dynamic-res, between frames: see
+  // set_scale()). Unless generic is true, sizes in VIEW_* get the trace/render core that's
+  // specialised for them (see view_shape_t).
+  bool set_view(int width, int height, bool generic=false) {
+    if (width < 16 || height < 16 || width > VIEW_MAX_SIZE || height > VIEW_MAX_SIZE || height % 2) {
+      printf("ERROR: Bad view size: %dx%d (must be 16..%d, with an even height)\n", width, height, VIEW_MAX_SIZE);
+      return false;
+    }
+    m_view_width = width;
+    m_view_height = height;
+    m_view_generic = generic;
+    m_view_variant = VIEW_GENERIC;
+    if (!generic) {
+      for (int v = VIEW_GENERIC+1; v < VIEW_VARIANT_COUNT; ++v) {
+        int w = 0, h = 0;
+        sscanf(view_variant_name(v), "%dx%d", &w, &h);
+        if (w == width && h == height) m_view_variant = v;
+      }
+    }
+    m_traces.assign(width, traced_column_t());
+    m_prev_traces.assign(width, traced_column_t());
+    m_span_stop.assign(width, 0);
+    m_span_color.assign(width, 0);
+    invalidate_traces();
+    m_map_layer_valid = false;
+    return true;
+  }
+
+  // --dynamic-res: Renders the next frames at the given fraction of the window's width and height
+  // (see present() for how they're scaled up). m_fb was allocated at the full size, and m_traces
+  // etc. keep their capacity, so this doesn't allocate anything (unless the ray table is rebuilt).
+  void set_scale(double scale) {
+    int w = std::max(16, int(m_window_width*scale + 0.5));
+    int h = std::max(16, int(m_window_height*scale + 0.5) & ~1);
+    if (w != m_view_width || h != m_view_height) set_view(w, h, m_view_generic);
+  }
+
+  // Calls fn(view) with the view_shape_t for m_view_variant, i.e. the specialised version of
+  // whatever fn calls (or the generic one):
+  template<typename F>
+  void with_view(F fn) {
+    switch (m_view_variant) {
+      case VIEW_640x480:   return fn(view_shape_t<640, 480>());
+      case VIEW_1680x1200: return fn(view_shape_t<1680, 1200>());
+      case VIEW_1760x1320: return fn(view_shape_t<1760, 1320>());
+    }
+    fn(generic_view_t{ m_view_width, m_view_height });
+  }
+
+  size_t fb_size() { return size_t(m_view_width)*m_view_height*4; }
+
+  // Sets the (horizontal) field of view, in degrees, keeping the current heading:
+  void set_fov(num degrees) {
+    fov = degrees * PI / 180.0; // FOV in radians.
+    viewMag = tan(fov/2.0); // Magnitude of the view plane vector (half of the total viewplane).
+    // The view plane is perpendicular to the heading (pointing to its right):
+    viewX = -headingY*viewMag;
+    viewY = headingX*viewMag;
+    snap_heading();
+  }
+
+  // Turns the ray table mode on (with the given number of angles, a multiple of 4) or off (0):
+  bool set_ray_angles(int angles) {
+    if (angles < 0 || angles % 4 || angles > 65536) {
+      printf("ERROR: Bad number of ray table angles: %d (must be a multiple of 4, up to 65536)\n", angles);
+      return false;
+    }
+    m_ray_angles = angles;
+    m_turn_accum = 0;
+    snap_heading();
+    return true;
+  }
+
+  // (Re)builds the ray table if it isn't for the current view width and FOV:
+  void ensure_ray_table() {
+    if (!m_ray_table.matches(m_ray_angles, m_view_width, viewMag)) {
+      m_ray_table.build(m_ray_angles, m_view_width, viewMag);
+    }
+  }
+
+  // In ray table mode, faces the given angle, exactly as the table has it:
+  void set_heading_index(int angle) {
+    ensure_ray_table();
+    m_heading_index = ((angle % m_ray_angles) + m_ray_angles) % m_ray_angles;
+    m_ray_table.heading(m_heading_index, headingX, headingY);
+    viewX = -headingY * viewMag;
+    viewY =  headingX * viewMag;
+  }
+
+  // In ray table mode, snaps the heading (e.g. one set from a recording) to the nearest angle:
+  void snap_heading() {
+    if (m_ray_angles <= 0) return;
+    ensure_ray_table();
+    set_heading_index(m_ray_table.nearest_angle(headingX, headingY));
+  }
+
+  ~RayboxSystem() {
+    printf("Shutting down RayboxSystem...\n");
+    if (m_pool) delete m_pool;
+    if (m_presenter) delete m_presenter;
+    if (m_fb_alloc) delete[] m_fb_alloc;
+    if (m_img_init) IMG_Quit();
+    if (m_texture) SDL_DestroyTexture(m_texture); //SMELL: Are we meant to do this? Not sure.
+    if (m_renderer) SDL_DestroyRenderer(m_renderer);
+    if (m_window) SDL_DestroyWindow(m_window);
+    if (m_video_init) SDL_Quit(); //SMELL: Match each SDL_InitSubSystem() instead?
+    printf("Goodbye\n");
+  }
+
+  // Put the player at the map's (last) player start:
+  void reset_player() {
+    PlayerStart player = { m_map.m_width>>1, m_map.m_height>>1 };
+    if (!m_map.m_player_starts.empty()) player = m_map.m_player_starts.back();
+    playerX = player.x + 0.5;
+    playerY = player.y + 0.5;
+  }
+
+  // map_file is a PNG, or a binary map file if it ends in .rbxm (see RayboxMap::save_binary()).
+  // It can also be "gen:SIZE[:SEED]" or "gen:WIDTHxHEIGHT[:SEED]" to generate a map.
+  bool load_map(const char *map_file) {
+    if (!strncmp(map_file, "gen:", 4)) {
+      int w = 0, h = 0;
+      unsigned seed = 1;
+      int n = sscanf(map_file+4, "%dx%d:%u", &w, &h, &seed);
+      if (n == 1) {
+        h = w;
+        sscanf(map_file+4, "%d:%u", &w, &seed);
+      }
+      if (w < 16 || h < 16 || w > MAP_MAX_SIZE || h > MAP_MAX_SIZE) {
+        printf("ERROR: Bad generated map size: %s\n", map_file);
+        return false;
+      }
+      m_map.generate(w, h, seed, m_map_layout);
+      printf("Generated %dx%d map (seed %u, %s layout)\n", w, h, seed, map_layout_name(m_map_layout));
+      reset_player();
+      invalidate_traces();
+      m_map_layer_valid = false;
+      return true;
+    }
+    size_t len = strlen(map_file);
+    if (len >= 5 && !strcmp(map_file+len-5, ".rbxm")) {
+      if (!m_map.load_binary(map_file)) return false;
+      printf("Loaded %dx%d map from %s (%s layout)\n", m_map.m_width, m_map.m_height, map_file, map_layout_name(m_map.m_layout));
+      if (m_map.m_layout != m_map_layout) {
+        // (It's only used in place if it's already in the layout we want):
+        printf("Converting map to %s layout\n", map_layout_name(m_map_layout));
+        m_map.relayout(m_map_layout);
+      }
+      reset_player();
+      invalidate_traces();
+      m_map_layer_valid = false;
+      return true;
+    }
+    // PNG support is only loaded when it's first needed, so binary maps start up without it:
+    if (!m_img_init) {
+      IMG_Init(IMG_INIT_PNG);
+      m_img_init = true;
+    }
+    SDL_Surface *s;
+    s = IMG_Load(map_file);
+    while (true) { //SMELL: Try throw instead of this old while/break style.
+      if (!s) {
+        printf("ERROR: Failed to load map image file: %s\n", map_file);
+        break;
+      }
+      if (s->w < 1 || s->h < 1 || s->w > MAP_MAX_SIZE || s->h > MAP_MAX_SIZE) {
+        printf("ERROR: Map image file should be at most %dx%d pixels, but is: %dx%d\n", MAP_MAX_SIZE, MAP_MAX_SIZE, s->w, s->h);
+        break;
+      }
+      Uint32 f = s->format->format;
+      // Make sure the source image data is in a format we can process...
+      if (f != SDL_PIXELFORMAT_RGB24) {
+        printf("ERROR: Wrong pixel format. Was expecting %x but got %x\n", SDL_PIXELFORMAT_RGB24, f);
+        break;
+      }
+      // OK, at this point we can assume the image format can be converted by us into a map array.
+      SDL_LockSurface(s);
+      m_map.load_from_rgb24((const uint8_t*)s->pixels, s->w, s->h, s->pitch, m_map_layout);
+      SDL_UnlockSurface(s);
+      printf("Loaded %dx%d map from %s (%s layout)\n", m_map.m_width, m_map.m_height, map_file, map_layout_name(m_map_layout));
+      printf("%d player start(s)\n", (int)m_map.m_player_starts.size());
+      reset_player();
+      invalidate_traces();
+      m_map_layer_valid = false;
+      // m_map.debug_print_map();
+      SDL_FreeSurface(s);
+      s = NULL;
+      return true;
+    }
+    // describe_pixel_format(s->format->format);
+    if (s) SDL_FreeSurface(s);
+    return false;
+  }
+
+  // If headless is true, we skip all SDL video/window/renderer setup, and just prepare
+  // what's needed to trace and render into m_fb (e.g. for benchmarking).
+  bool prep(bool headless=false) {
+    printf("Preparing RayboxSystem%s...\n", headless ? " (headless)" : "");
+    m_headless = headless;
+    prep_threads();
+    prep_simd();
+    m_window_width = m_view_width;
+    m_window_height = m_view_height;
+    if (headless) {
+      m_fb = m_fb_alloc = new uint8_t[fb_size()];
+      return true;
+    }
+    //SMELL: This needs proper error handling!
+    printf("SDL_InitSubSystem(SDL_INIT_VIDEO): %d\n", SDL_InitSubSystem(SDL_INIT_VIDEO));
+    m_video_init = true;
+    //SMELL: Check each of the following for failure:
+    // Do full SDL video prep and window init:
+    m_window =
+      SDL_CreateWindow(
+        "Raybox",
+        SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+        m_view_width, m_view_height,
+        0
+      );
+    if (m_dynamic_res && m_present_mode != PRESENT_COPY) {
+      // (The other modes draw into buffers that are exactly the size of the texture.)
+      printf("WARNING: --dynamic-res needs --present copy, so using that\n");
+      m_present_mode = PRESENT_COPY;
+    }
+    if (m_dynamic_res) SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear"); // (For scaling up smaller frames.)
+    SDL_DisplayMode mode;
+    if (SDL_GetWindowDisplayMode(m_window, &mode) == 0 && mode.refresh_rate > 0) m_refresh_ms = 1000.0/mode.refresh_rate;
+    if (m_late_input && !m_vsync && m_present_mode != PRESENT_PIPELINE) {
+      // (Without either, presenting never waits, so there's no time to move the sample into.)
+      printf("WARNING: --late-input only makes a difference with --vsync or --present pipeline\n");
+    }
+    if (m_present_mode == PRESENT_PIPELINE) {
+      if (m_fb_count < 2) m_fb_count = 2;
+      if (m_fb_count > 3) m_fb_count = 3;
+      m_presenter = new RayboxPresenter(m_window, m_view_width, m_view_height, m_fb_count, &m_present_stats, &m_input_latency, m_vsync);
+      m_fb = m_presenter->first();
+    }
+    else {
+      m_renderer =
+        SDL_CreateRenderer(
+          m_window,
+          -1,
+          SDL_RENDERER_ACCELERATED | (m_vsync ? SDL_RENDERER_PRESENTVSYNC : 0)
+        );
+      SDL_SetRenderDrawColor(m_renderer, 0, 0, 0, SDL_ALPHA_OPAQUE);
+      SDL_RenderClear(m_renderer);
+      m_texture =
+        SDL_CreateTexture(
+          m_renderer,
+          SDL_PIXELFORMAT_ARGB8888,
+          SDL_TEXTUREACCESS_STREAMING,
+          m_view_width, m_view_height
+        );
+    }
+    if (m_present_mode == PRESENT_LOCK && !lock_fb()) {
+      printf("WARNING: Can't draw straight into the texture, so copying into it instead\n");
+      m_present_mode = PRESENT_COPY;
+    }
+    // Create framebuffer:
+    if (!m_fb) m_fb = m_fb_alloc = new uint8_t[fb_size()];
+    printf("View: %dx%d (%s trace/render core)\n", m_view_width, m_view_height, view_variant_name(m_view_variant));
+    printf("Presenting frames with: %s", present_mode_name(m_present_mode));
+    if (m_presenter) printf(" (%d framebuffers)", m_fb_count);
+    printf("\n");
+    printf("SDL window ready.\n");
+    return true;
+  }
+
+  // PRESENT_LOCK: Point m_fb at the texture's own pixels. Our renderers assume rows are
+  // exactly m_view_width pixels apart, so this is only possible if the texture's pitch agrees.
+  bool lock_fb() {
+    void *pixels;
+    int pitch;
+    if (SDL_LockTexture(m_texture, NULL, &pixels, &pitch) != 0) return false;
+    if (pitch != m_view_width*4) {
+      SDL_UnlockTexture(m_texture);
+      return false;
+    }
+    m_fb = (uint8_t*)pixels;
+    m_fb_stale = true; // Locked pixels are write-only, so we can't assume they still hold the last frame.
+    return true;
+  }
+
+  // Start the persistent worker threads (if any) that trace/render columns in parallel:
+  void prep_threads() {
+    if (m_threads <= 0) m_threads = std::thread::hardware_concurrency();
+    if (m_threads < 1) m_threads = 1;
+    if (m_threads > 1) {
+      m_pool = new RayboxThreadPool(m_threads);
+      printf("Using %d worker threads, %d columns per chunk\n", m_threads, m_chunk_columns);
+    }
+  }
+
+  bool parallel() { return m_pool && !m_reference; }
+
+  //NOTE: On small maps (where rays are short) the packet tracers are faster than leaping through
+  // empty space with the scalar tracer.
+  bool use_accel() {
+    if (m_reference) return false;
+    if (m_accel < 0) return long(m_map.m_width)*m_map.m_height > 256*256;
+    return m_accel;
+  }
+
+  // Work out which packet tracer to use, falling back to narrower ones if the CPU can't do what was asked for:
+  void prep_simd() {
+    int best = detect_simd_lanes();
+    if (m_simd_lanes == 0 || m_simd_lanes > best) {
+      if (m_simd_lanes > best) printf("WARNING: %d-lane SIMD is not supported by this CPU\n", m_simd_lanes);
+      m_simd_lanes = best;
+    }
+    printf("Tracing %d column(s) per packet\n", m_simd_lanes);
+    printf("Tracer backend: %s\n", backend_name(m_backend));
+  }
+
+  int chunk_count() { return (m_view_width + m_chunk_columns-1) / m_chunk_columns; }
+
+  // Runs fn(x0,x1) for each chunk of columns, across all worker threads:
+  void for_each_chunk(const std::function<void(int,int)> &fn) {
+    m_pool->run(chunk_count(), [&](int chunk) {
+      int x0 = chunk*m_chunk_columns;
+      int x1 = std::min(x0+m_chunk_columns, m_view_width);
+      fn(x0, x1);
+    });
+  }
+
+  RayboxCamera camera() {
+    return { playerX, playerY, headingX, headingY, viewX, viewY };
+  }
+
+  uint32_t sky_color()   { return 0xff666666; }
+  uint32_t floor_color() { return 0xffcccccc; }
+
+
+  bool render_backdrop() {
+    STATS_SCOPE(STAT_RENDER_BACKDROP);
+    m_fb_view_current = false;
+    m_fb_presented = false;
+    with_view([&](auto view) {
+      if (m_floors) {
+        render_floors(view);
+      }
+      else if (parallel()) {
+        for_each_chunk([&](int x0, int x1) { render_backdrop_columns(view, x0, x1); });
+      }
+      else {
+        render_backdrop_columns(view, 0, view.width());
+      }
+    });
+    return true;
+  }
+
+  template<class V>
+  void render_backdrop_columns(const V &view, int x0, int x1) {
+    const int W = view.width(), H = view.height();
+    for (int x=x0; x<x1; ++x) {
+      uint32_t *p = (uint32_t*)m_fb + x;
+      for (int y=0; y<H; ++y) {
+        uint32_t c = (y < H>>1) ? sky_color() : floor_color();
+        p[y*W] = c;
+      }
+    }
+    m_pixels_written += uint64_t(x1-x0)*H;
+  }
+
+  // Textured floors and ceilings (--floors), instead of flat colours: Only the pixels that the walls
+  // don't cover are drawn, so render_view() has to draw those after. Each pair of rows (floor and
+  // ceiling, the same distance from the horizon) is set up once (see RayboxTextures::row()), then
+  // it's just stepping and gathers. (render_walls() doesn't do it this way, but draws flat walls
+  // along with the floors (see render_floor_rows()), and textured ones with render_textured_columns().)
+  template<class V>
+  void render_floors(const V &view) {
+    const RayboxCamera cam = camera();
+    if (m_reference) {
+      render_floor_rows_reference(view, cam);
+      return;
+    }
+    prepare_spans(view, 0, view.width());
+    if (parallel()) {
+      for_each_row_band([&](int k0, int k1) { render_floor_rows(view, cam, k0, k1, false); });
+    }
+    else {
+      render_floor_rows(view, cam, 0, view.height()/2, false);
+    }
+  }
+
+  // Draws the pairs of floor and ceiling rows that are k0..k1-1 rows out from the horizon (cf.
+  // render_rows(), which needs prepare_spans() too). With walls, the columns whose walls cover a
+  // row get the wall's colour, otherwise they're skipped:
+  template<class V>
+  void render_floor_rows(const V &view, const RayboxCamera &cam, int k0, int k1, bool walls) {
+    const int W = view.width(), H = view.height();
+    const int *stop = m_span_stop.data();
+    const uint32_t *color = walls ? m_span_color.data() : NULL;
+    for (int k=k0; k<k1; ++k) {
+      const RayboxTextures::row_t r = m_textures.row(cam, k, W, H);
+      const int y = H/2+k;
+      uint32_t *up = (uint32_t*)m_fb + (H-1-y)*W;
+      uint32_t *dn = (uint32_t*)m_fb + y*W;
+      int x = 0;
+#ifdef RAYBOX_SIMD
+      if (m_simd_lanes >= SIMD_AVX2) x = render_floor_row_avx2(r, up, dn, stop, color, y, W);
+#endif
+      uint32_t u = r.u + uint32_t(x)*r.du, v = r.v + uint32_t(x)*r.dv;
+      for (; x<W; ++x, u += r.du, v += r.dv) {
+        if (stop[x] > y) {
+          if (color) up[x] = dn[x] = color[x];
+          continue;
+        }
+        const size_t i = r.index(u, v);
+        up[x] = r.ceiling[i];
+        dn[x] = r.floor[i];
+      }
+    }
+    if (walls) {
+      m_pixels_written += uint64_t(k1-k0)*2*W;
+      return;
+    }
+    // (Column x's wall covers the first stop-H/2 pairs of rows.)
+    uint64_t pixels = 0;
+    for (int x=0; x<W; ++x) pixels += std::max(0, k1 - std::max(k0, stop[x]-H/2));
+    m_pixels_written += 2*pixels;
+  }
+
+  // The reference path's render_floors(): Each pixel's texel is worked out from scratch, rather
+  // than stepped to, and each column's wall stop is worked out again for each row:
+  template<class V>
+  void render_floor_rows_reference(const V &view, const RayboxCamera &cam) {
+    const int W = view.width(), H = view.height();
+    for (int y=H/2; y<H; ++y) {
+      const RayboxTextures::row_t r = m_textures.row(cam, y-H/2, W, H);
+      for (int x=0; x<W; ++x) {
+        if (wall_stop(view, m_traces[x]) > y) continue;
+        const size_t i = r.index(r.u + uint32_t(x)*r.du, r.v + uint32_t(x)*r.dv);
+        T(m_fb, x, H-1-y) = r.ceiling[i];
+        T(m_fb, x, y) = r.floor[i];
+        m_pixels_written += 2;
+      }
+    }
+  }
+
+  // The wall for a traced column covers rows [height-stop, stop):
+  template<class V>
+  static int wall_stop(const V &view, const traced_column_t &col) {
+    return wall_stop_for_dist(view.height(), col.dist);
+  }
+
+  // Darken, depending on the side we hit:
+  static uint32_t wall_color(const traced_column_t &col) {
+    return col.color & (col.side ? 0xffffffff : 0xffc0c0c0);
+  }
+
+  // Draws the backdrop and walls for m_traces, without the overdraw of render_backdrop()
+  // followed by render_view() (except in the reference path, which always does that):
+  bool render_walls() {
+    int mode = m_reference ? RENDER_OVERDRAW : m_render_mode;
+    m_fb_stale = false;
+    if (mode == RENDER_OVERDRAW) return render_backdrop() && render_view();
+    STATS_SCOPE(STAT_RENDER_VIEW);
+    m_fb_view_current = false;
+    m_fb_presented = false;
+    with_view([&](auto view) {
+      if (m_floors) {
+        // Flat walls are drawn along with the textured floors, in one pass over the rows. Textured
+        // ones go down the columns after, into the gaps that the floors left for them:
+        const RayboxCamera cam = camera();
+        if (parallel()) {
+          for_each_chunk([&](int x0, int x1) { prepare_spans(view, x0, x1); });
+          for_each_row_band([&](int k0, int k1) { render_floor_rows(view, cam, k0, k1, !m_textured); });
+          if (m_textured) for_each_chunk([&](int x0, int x1) { render_textured_columns(view, x0, x1, false); });
+        }
+        else {
+          prepare_spans(view, 0, view.width());
+          render_floor_rows(view, cam, 0, view.height()/2, !m_textured);
+          if (m_textured) render_textured_columns(view, 0, view.width(), false);
+        }
+      }
+      else if (m_textured) {
+        if (parallel()) {
+          for_each_chunk([&](int x0, int x1) { render_textured_columns(view, x0, x1); });
+        }
+        else {
+          render_textured_columns(view, 0, view.width());
+        }
+      }
+      else if (mode == RENDER_ROWS) {
+        if (parallel()) {
+          for_each_chunk([&](int x0, int x1) { prepare_spans(view, x0, x1); });
+          for_each_row_band([&](int k0, int k1) { render_rows(view, k0, k1, 0, view.width()); });
+        }
+        else {
+          prepare_spans(view, 0, view.width());
+          render_rows(view, 0, view.height()/2, 0, view.width());
+        }
+      }
+      else if (parallel()) {
+        for_each_chunk([&](int x0, int x1) { render_span_columns(view, x0, x1); });
+      }
+      else {
+        render_span_columns(view, 0, view.width());
+      }
+    });
+    return true;
+  }
+
+  // Textured walls (see RayboxTextures), whatever the render mode (except RENDER_OVERDRAW, i.e. the
+  // reference path, which does it in render_view_columns()): Each column's sky, wall and floor are
+  // written once, stepping down the wall's texture column in 16.16 fixed-point. If backdrop is
+  // false, only the wall's rows [y0,y1) are written (i.e. around textured floors; see render_floors()).
+  //NOTE: Unlike render_span_columns(), this goes straight down each column: Doing blocks of 16 columns
+  // row by row (for one store per cache line) wins at 640x480, but at 1680x1200 the per-pixel tests
+  // it needs cost more than the stores it saves, and the times get much noisier.
+  template<class V>
+  void render_textured_columns(const V &view, int x0, int x1, bool backdrop=true) {
+    const int W = view.width(), H = view.height();
+    const uint32_t sky = sky_color(), floor = floor_color();
+    uint64_t pixels = 0;
+    for (int x=x0; x<x1; ++x) {
+      const RayboxTextures::column_t c = m_textures.column(m_traces[x], H);
+      uint32_t *p = (uint32_t*)m_fb + x;
+      uint32_t *wall = p + c.y0*W, *ground = p + c.y1*W, *end = p + H*W;
+      if (backdrop) {
+        for (; p < wall; p += W) *p = sky;
+      }
+      else {
+        p = wall;
+        pixels += c.y1-c.y0;
+      }
+      uint32_t pos = c.pos;
+      for (; p < ground; p += W, pos += c.step) *p = c.texels[pos>>16] & c.shade;
+      if (backdrop) {
+        for (; p < end; p += W) *p = floor;
+      }
+    }
+    m_pixels_written += backdrop ? uint64_t(x1-x0)*H : pixels;
+  }
+
+  // RENDER_SPANS: Each column's sky, wall and floor spans are written once. Going down the columns
+  // one at a time means a store per cache line, so the whole chunk is done row by row instead.
+  template<class V>
+  void render_span_columns(const V &view, int x0, int x1) {
+    prepare_spans(view, x0, x1);
+    render_rows(view, 0, view.height()/2, x0, x1);
+  }
+
+  // Gets each column's wall ready for render_rows():
+  template<class V>
+  void prepare_spans(const V &view, int x0, int x1) {
+    for (int x=x0; x<x1; ++x) {
+      m_span_stop[x] = wall_stop(view, m_traces[x]);
+      m_span_color[x] = wall_color(m_traces[x]);
+    }
+  }
+
+  // RENDER_ROWS: Draws columns x0..x1-1 of the pairs of rows that are k0..k1-1 rows out from the
+  // horizon, i.e. one row above it and its mirror image below. A wall covers both, or neither.
+  template<class V>
+  void render_rows(const V &view, int k0, int k1, int x0, int x1) {
+    const int W = view.width(), H = view.height();
+    const uint32_t sky = sky_color(), floor = floor_color();
+    const int *stop = m_span_stop.data();
+    const uint32_t *color = m_span_color.data();
+    for (int k=k0; k<k1; ++k) {
+      int y = H/2+k;
+      uint32_t *up = (uint32_t*)m_fb + (H-1-y)*W;
+      uint32_t *dn = (uint32_t*)m_fb + y*W;
+      if (V::FIXED && x0 == 0 && x1 == W) {
+        render_row_pair<V::FIXED ? V::WIDTH : 1>(up, dn, stop, color, y, sky, floor);
+        continue;
+      }
+      for (int x=x0; x<x1; ++x) {
+        bool wall = stop[x] > y;
+        up[x] = wall ? color[x] : sky;
+        dn[x] = wall ? color[x] : floor;
+      }
+    }
+    m_pixels_written += uint64_t(k1-k0)*2*(x1-x0);
+  }
+
+  // A whole pair of render_rows() rows, W pixels wide. Knowing W at compile time (and that none of
+  // the pointers overlap) lets the compiler vectorise this, with no checks or leftover columns.
+  template<int W>
+  static inline void render_row_pair(
+    uint32_t *__restrict up, uint32_t *__restrict dn, const int *__restrict stop, const uint32_t *__restrict color,
+    int y, uint32_t sky, uint32_t floor
+  ) {
+    for (int x=0; x<W; ++x) {
+      uint32_t wall = -uint32_t(stop[x] > y); // (A mask, rather than a branch.)
+      up[x] = (color[x] & wall) | (sky & ~wall);
+      dn[x] = (color[x] & wall) | (floor & ~wall);
+    }
+  }
+
+  // Runs fn(k0,k1) for bands of render_rows() row pairs, across all worker threads:
+  void for_each_row_band(const std::function<void(int,int)> &fn) {
+    const int band = 8;
+    m_pool->run((m_view_height/2 + band-1) / band, [&](int b) {
+      fn(b*band, std::min((b+1)*band, m_view_height/2));
+    });
+  }
+
+  bool render_random(int l=0, int t=0, int r=0, int b=0) {
+    for (int x=l; x<m_view_width-r; ++x) {
+      for (int y=t; y<m_view_height-b; ++y) {
+        R(m_fb, x, y) = rand()%256;
+        G(m_fb, x, y) = rand()%256;
+        B(m_fb, x, y) = rand()%256;
+        A(m_fb, x, y) = 255;
+      }
+    }
+    return true;
+  }
+
+  // Scatters count sprites over the map's open cells, the same ones every time (e.g. for --bench-sprites):
+  void scatter_sprites(int count) {
+    static const uint32_t colors[] = { 0xffe04040, 0xff40c040, 0xff4060e0, 0xffe0e040, 0xffc040c0, 0xff40c0c0 };
+    uint32_t rng = 1;
+    auto next = [&]() { rng = rng*1664525u + 1013904223u; return rng>>8; };
+    auto unit = [&]() { return num(next() & 0xffff) / num(0x10000); }; // [0,1)
+    m_sprites.clear();
+    for (long tries = 0; tries < long(count)*100 && int(m_sprites.size()) < count; ++tries) {
+      num x = num(next() % m_map.m_width) + 0.2 + 0.6*unit();
+      num y = num(next() % m_map.m_height) + 0.2 + 0.6*unit();
+      if (m_map.cell(int(x), int(y))) continue;
+      m_sprites.push_back({ x, y, num(0.25 + 0.5*unit()), colors[next() % 6] });
+    }
+    if (int(m_sprites.size()) < count) printf("WARNING: Only found room for %d of %d sprites\n", int(m_sprites.size()), count);
+    m_fb_view_current = false;
+  }
+
+  // Works out where each sprite is on the screen. Only those in front of the near plane that
+  // overlap the view go into m_sprite_order, sorted far to near (in the reference path, all of those
+  // in front of the near plane do). Walls are dealt with when drawing, column by column. Each chunk
+  // of columns (as handed out by for_each_chunk()) then gets a list of the visible sprites that
+  // overlap it, so that the chunks can be drawn in parallel, each in the same order.
+  template<class V>
+  void prepare_sprites(const V &view, const RayboxCamera &cam) {
+    const int W = view.width(), H = view.height();
+    const size_t n = m_sprites.size();
+    m_sprite_views.resize(n);
+    // Camera space is the inverse of [view heading], i.e. depth along the heading and the
+    // sideways offset (which is depth*cameraX) along the view plane:
+    const float invDet = 1.0f / float(cam.viewX*cam.headingY - cam.headingX*cam.viewY);
+    const float invViewMag = 1.0f / std::sqrt(float(cam.viewX*cam.viewX + cam.viewY*cam.viewY));
+    const float halfW = float(W/2);
+    auto project = [&](size_t i0, size_t i1) {
+      for (size_t i = i0; i < i1; ++i) {
+        const sprite_t &s = m_sprites[i];
+        sprite_view_t &v = m_sprite_views[i];
+        float dx = float(s.x - cam.playerX), dy = float(s.y - cam.playerY);
+        float offset = invDet*(float(cam.headingY)*dx - float(cam.headingX)*dy);
+        v.depth = invDet*(float(cam.viewX)*dy - float(cam.viewY)*dx);
+        if (!(v.depth >= float(SPRITE_NEAR_DIST))) {
+          // Behind the near plane (or NaN):
+          v.x0 = v.x1 = 0;
+          continue;
+        }
+        v.width = float(s.size)*invViewMag/v.depth*halfW;
+        v.left = (offset/v.depth + 1.0f)*halfW - 0.5f*v.width;
+        // Columns whose centres (x+0.5) are in [left, left+width):
+        v.x0 = int(std::min(std::max(std::ceil(v.left - 0.5f), 0.0f), float(W)));
+        v.x1 = int(std::min(std::max(std::ceil(v.left + v.width - 0.5f), 0.0f), float(W)));
+        // Stand it on the floor, i.e. where the bottom of a wall at the same depth would be:
+        v.height = int(float(s.size)*float(H)/v.depth);
+        v.top = H/2 + int(HEIGHT_FROM_DIST(v.depth, H)) - v.height;
+      }
+    };
+    const size_t chunk = 1024;
+    if (parallel() && n > chunk) {
+      m_pool->run(int((n + chunk-1)/chunk), [&](int c) { project(c*chunk, std::min(n, (c+1)*chunk)); });
+    }
+    else {
+      project(0, n);
+    }
+    // Cull, then sort by depth. Depths are positive floats, so their bits sort in the same order
+    // they do, and inverting them sorts far to near:
+    m_sprite_order.clear();
+    m_sprite_keys.clear();
+    for (size_t i = 0; i < n; ++i) {
+      const sprite_view_t &v = m_sprite_views[i];
+      if (!(v.depth >= float(SPRITE_NEAR_DIST))) continue;
+      if (!m_reference && (v.x0 >= v.x1 || v.top >= H || v.top+v.height <= 0)) continue;
+      uint32_t bits;
+      memcpy(&bits, &v.depth, sizeof(bits));
+      m_sprite_order.push_back(uint32_t(i));
+      m_sprite_keys.push_back(~bits);
+    }
+    if (m_reference) {
+      std::stable_sort(m_sprite_order.begin(), m_sprite_order.end(), [&](uint32_t a, uint32_t b) {
+        return m_sprite_views[a].depth > m_sprite_views[b].depth;
+      });
+      return;
+    }
+    radix_sort_u32(m_sprite_keys, m_sprite_order, m_sprite_tmp_keys, m_sprite_tmp_order);
+    // Bin them by chunk (a counting sort again, which keeps each bin in order):
+    const int chunks = chunk_count();
+    m_sprite_bin_start.assign(chunks+1, 0);
+    for (uint32_t i : m_sprite_order) {
+      const sprite_view_t &v = m_sprite_views[i];
+      for (int c = v.x0/m_chunk_columns; c <= (v.x1-1)/m_chunk_columns; ++c) ++m_sprite_bin_start[c+1];
+    }
+    for (int c = 0; c < chunks; ++c) m_sprite_bin_start[c+1] += m_sprite_bin_start[c];
+    m_sprite_bins.resize(m_sprite_bin_start[chunks]);
+    std::vector<uint32_t> &next = m_sprite_tmp_keys; // (Each bin's next free slot.)
+    next.assign(m_sprite_bin_start.begin(), m_sprite_bin_start.end()-1);
+    for (uint32_t i : m_sprite_order) {
+      const sprite_view_t &v = m_sprite_views[i];
+      for (int c = v.x0/m_chunk_columns; c <= (v.x1-1)/m_chunk_columns; ++c) m_sprite_bins[next[c]++] = i;
+    }
+  }
+
+  // Draws column x of a sprite, unless a wall is at least as near (i.e. m_traces is a 1D depth
+  // buffer). The sprite is a disc, so each column is one span:
+  template<class V>
+  void draw_sprite_column(const V &view, const sprite_view_t &v, uint32_t color, int x) {
+    if (!(v.depth < float(m_traces[x].dist))) return;
+    const int W = view.width(), H = view.height();
+    float u = (float(x) + 0.5f - v.left)/v.width - 0.5f; // [-0.5,0.5)
+    float half = std::sqrt(std::max(0.0f, 0.25f - u*u))*float(v.height);
+    int y0 = std::max(0, v.top + int(0.5f*float(v.height) - half));
+    int y1 = std::min(H, v.top + int(0.5f*float(v.height) + half));
+    uint32_t *p = (uint32_t*)m_fb + x;
+    for (int y = y0; y < y1; ++y) p[y*W] = color;
+  }
+
+  // Draws the sprites binned (by prepare_sprites()) to the chunks of columns x0..x1-1 covers,
+  // clipped to those columns:
+  template<class V>
+  void render_sprite_columns(const V &view, int x0, int x1) {
+    for (int c = x0/m_chunk_columns; c*m_chunk_columns < x1; ++c) {
+      const int cx0 = std::max(x0, c*m_chunk_columns);
+      const int cx1 = std::min(x1, (c+1)*m_chunk_columns);
+      for (uint32_t k = m_sprite_bin_start[c]; k < m_sprite_bin_start[c+1]; ++k) {
+        const uint32_t i = m_sprite_bins[k];
+        const sprite_view_t &v = m_sprite_views[i];
+        const int sx1 = std::min(cx1, v.x1);
+        for (int x = std::max(cx0, v.x0); x < sx1; ++x) draw_sprite_column(view, v, m_sprites[i].color, x);
+      }
+    }
+  }
+
+  // Draws the sprites over the backdrop and walls, far to near. m_traces must be for the current camera.
+  bool render_sprites() {
+    if (m_sprites.empty()) return true;
+    STATS_SCOPE(STAT_RENDER_SPRITES);
+    m_fb_presented = false;
+    with_view([&](auto view) {
+      prepare_sprites(view, camera());
+      if (m_reference) {
+        // Every sprite, one at a time:
+        for (uint32_t i : m_sprite_order) {
+          const sprite_view_t &v = m_sprite_views[i];
+          for (int x = v.x0; x < v.x1; ++x) draw_sprite_column(view, v, m_sprites[i].color, x);
+        }
+      }
+      else if (parallel()) {
+        for_each_chunk([&](int x0, int x1) { render_sprite_columns(view, x0, x1); });
+      }
+      else {
+        render_sprite_columns(view, 0, view.width());
+      }
+    });
+    return true;
+  }
+
+  // Pixels per map cell in the map overlay:
+  int map_overlay_scale() { return std::max(1, m_view_height/m_map.m_height); }
+
+  // Width (or height) in pixels of the map overlay's grid, for the given number of cells: With a
+  // scale over 2, there's a grid line after the last cell too. (Otherwise, that pixel would be in
+  // a cell past the edge of the map.)
+  static int map_overlay_extent(int cells, int scale) { return cells*scale + (scale>2 ? 1 : 0); }
+
+  // Colour of pixel x,y of the map overlay's grid and cells:
+  uint32_t map_overlay_pixel(int x, int y, int scale) {
+    if (scale>2 && (x%scale==0 || y%scale==0)) {
+      // Black grid lines:
+      return 0xff000000;
+    }
+    uint32_t m = m_map.cell(x/scale, y/scale);
+    if (m) {
+      // Filled square:
+      return m;
+    }
+    return ((x&y)&1) ? 0xff333333 : 0xff111111;
+  }
+
+  // The grid and cells don't change, so they're drawn into m_map_layer once (per map and view
+  // size), and render_map() just copies that into m_fb each frame.
+  void build_map_layer() {
+    const int scale = map_overlay_scale();
+    const int mw = std::min(m_map.m_width, m_view_width);
+    const int mh = std::min(m_map.m_height, m_view_height);
+    m_map_layer_width = std::min(m_view_width, map_overlay_extent(mw, scale));
+    m_map_layer_height = std::min(m_view_height, map_overlay_extent(mh, scale));
+    m_map_layer.resize(size_t(m_map_layer_width)*m_map_layer_height);
+    for (int y=0; y<m_map_layer_height; ++y) {
+      uint32_t *row = &m_map_layer[size_t(y)*m_map_layer_width];
+      for (int x=0; x<m_map_layer_width; ++x) row[x] = map_overlay_pixel(x, y, scale);
+    }
+    m_map_layer_valid = true;
+  }
+
+  // Draws a line from x0,y0 to x1,y1 (in pixels), clipped to the given width and height:
+  void draw_overlay_line(num x0, num y0, num x1, num y1, int width, int height, uint32_t color) {
+    // Clip the line (Liang-Barsky), so that we only step along the part that's visible:
+    num t0 = 0, t1 = 1;
+    const num dx = x1-x0, dy = y1-y0;
+    const num p[4] = { -dx, dx, -dy, dy };
+    const num q[4] = { x0, num(width)-num(0.001)-x0, y0, num(height)-num(0.001)-y0 };
+    for (int i=0; i<4; ++i) {
+      if (p[i] == 0) {
+        if (q[i] < 0) return;
+        continue;
+      }
+      num t = q[i]/p[i];
+      if (p[i] < 0) t0 = std::max(t0, t);
+      else t1 = std::min(t1, t);
+    }
+    if (t0 > t1) return;
+    num ax = x0+dx*t0, ay = y0+dy*t0;
+    int n = int(std::max(std::abs(dx), std::abs(dy))*(t1-t0)) + 1;
+    num sx = dx*(t1-t0)/num(n), sy = dy*(t1-t0)/num(n);
+    for (int i=0; i<=n; ++i) {
+      int x = int(ax+sx*num(i)), y = int(ay+sy*num(i));
+      if (x >= 0 && y >= 0 && x < width && y < height) T(m_fb, x, y) = color;
+    }
+  }
+
+  bool render_map() {
+    STATS_SCOPE(STAT_RENDER_MAP);
+    const int MAP_OVERLAY_SCALE = map_overlay_scale();
+    m_fb_view_current = false;
+    m_fb_presented = false;
+    if (m_reference) {
+      // Work out every pixel from the map, as it used to be done:
+      const int mw = std::min(m_map.m_width, m_view_width);
+      const int mh = std::min(m_map.m_height, m_view_height);
+      for (int x=0; x<m_view_width; ++x) {
+        for (int y=0; y<m_view_height; ++y) {
+          if (x<map_overlay_extent(mw, MAP_OVERLAY_SCALE) && y<map_overlay_extent(mh, MAP_OVERLAY_SCALE)) {
+            T(m_fb, x, y) = map_overlay_pixel(x, y, MAP_OVERLAY_SCALE);
+          }
+        }
+      }
+    }
+    else {
+      if (!m_map_layer_valid) build_map_layer();
+      for (int y=0; y<m_map_layer_height; ++y) {
+        memcpy(&T(m_fb, 0, y), &m_map_layer[size_t(y)*m_map_layer_width], m_map_layer_width*4);
+      }
+    }
+    // Render player position:
+    num ppx = playerX*MAP_OVERLAY_SCALE;
+    num ppy = playerY*MAP_OVERLAY_SCALE;
+    // Render the fan of rays that were traced (every 16th column, and the last), out to where they hit:
+    if (m_traces_valid) {
+      const int fw = std::min(m_view_width, map_overlay_extent(m_map.m_width, MAP_OVERLAY_SCALE));
+      const int fh = std::min(m_view_height, map_overlay_extent(m_map.m_height, MAP_OVERLAY_SCALE));
+      auto draw_ray = [&](const traced_column_t &col) {
+        draw_overlay_line(ppx, ppy, col.hx*MAP_OVERLAY_SCALE, col.hy*MAP_OVERLAY_SCALE, fw, fh, 0xff806000);
+      };
+      for (int x=0; x<m_view_width; x += 16) draw_ray(m_traces[x]);
+      draw_ray(m_traces[m_view_width-1]);
+    }
+    // (Big maps don't fit in the overlay, so the player might be off-screen):
+    if (ppx < 1 || ppy < 1 || ppx >= m_view_width-MAP_OVERLAY_SCALE || ppy >= m_view_height-MAP_OVERLAY_SCALE) return true;
+    T(m_fb, int(ppx), int(ppy)) = 0xff00ffff;
+    // Render view vector:
+    for (int n=0; n<MAP_OVERLAY_SCALE; ++n) {
+      num vvx = ppx+headingX*n;
+      num vvy = ppy+headingY*n;
+      T(m_fb, int(vvx), int(vvy)) = 0xff00ffff;
+    }
+    return true;
+  }
+
+  bool trace() {
+    STATS_SCOPE(STAT_TRACE);
+    RayboxCamera cam = camera();
+    int mode = begin_trace(cam);
+    if (mode == TRACE_NONE) return true;
+    with_view([&](auto view) {
+      if (parallel()) {
+        for_each_chunk([&](int x0, int x1) { trace_columns_mode(view, cam, mode, x0, x1); });
+      }
+      else {
+        trace_columns_mode(view, cam, mode, 0, view.width());
+      }
+    });
+    return true;
+  }
+
+  // Trace and draw (backdrop and walls) each chunk of columns in one go, so that
+  // each column's traced_column_t is still hot in cache when we draw it:
+  bool trace_and_render_view() {
+    STATS_SCOPE(STAT_TRACE);
+    RayboxCamera cam = camera();
+    int mode = begin_trace(cam);
+    if (mode == TRACE_NONE && !view_needs_drawing()) return true;
+    with_view([&](auto view) {
+      // Sprites don't depend on the traces until they're drawn, so they can be sorted and binned first:
+      const bool sprites = !m_sprites.empty();
+      if (sprites) prepare_sprites(view, cam);
+      // Floors need every column's wall (like rows), so they're drawn once all chunks are done (along
+      // with the walls, unless those are textured):
+      const bool floors = m_floors;
+      const bool textured = m_textured && m_render_mode != RENDER_OVERDRAW && !floors;
+      const bool rows = m_render_mode == RENDER_ROWS && !textured && !floors;
+      for_each_chunk([&](int x0, int x1) {
+        if (mode != TRACE_NONE) trace_columns_mode(view, cam, mode, x0, x1);
+        if (floors) {
+          if (m_textured) render_textured_columns(view, x0, x1, false);
+          prepare_spans(view, x0, x1);
+        }
+        else if (textured) {
+          render_textured_columns(view, x0, x1);
+        }
+        else switch (m_render_mode) {
+          case RENDER_OVERDRAW:
+            render_backdrop_columns(view, x0, x1);
+            render_view_columns(view, x0, x1);
+            break;
+          case RENDER_SPANS:
+            render_span_columns(view, x0, x1);
+            break;
+          case RENDER_ROWS:
+            prepare_spans(view, x0, x1);  // Rows need every column, so they're drawn once all chunks are done.
+            break;
+        }
+        if (sprites && !rows && !floors) render_sprite_columns(view, x0, x1);
+      });
+      if (rows || floors) {
+        if (rows) {
+          for_each_row_band([&](int k0, int k1) { render_rows(view, k0, k1, 0, view.width()); });
+        }
+        else {
+          for_each_row_band([&](int k0, int k1) { render_floor_rows(view, cam, k0, k1, !m_textured); });
+        }
+        if (sprites) for_each_chunk([&](int x0, int x1) { render_sprite_columns(view, x0, x1); });
+      }
+    });
+    m_fb_view_current = true;
+    m_fb_presented = false;
+    m_fb_stale = false;
+    return true;
+  }
+
+  // How much of m_traces trace() has to work out again:
+  enum {
+    TRACE_ALL,      // Everything.
+    TRACE_ROTATED,  // The player has only turned since the last frame (see reuse_columns()).
+    TRACE_NONE      // Nothing: The camera hasn't changed.
+  };
+
+  // Forget the last frame's traces, e.g. because the map has changed:
+  void invalidate_traces() {
+    m_traces_valid = false;
+    m_fb_view_current = false;
+  }
+
+  int trace_mode(const RayboxCamera &cam) {
+    const RayboxCamera &t = m_traced_cam;
+    if (m_reuse == 0 || m_reference || !m_traces_valid || m_traced_backend != m_backend) return TRACE_ALL;
+    if (cam.playerX != t.playerX || cam.playerY != t.playerY) return TRACE_ALL;
+    if (cam.headingX == t.headingX && cam.headingY == t.headingY && cam.viewX == t.viewX && cam.viewY == t.viewY) {
+      return TRACE_NONE;
+    }
+    // Fixed-point rounding is too coarse for reuse_columns() to be exact:
+    return (use_rotation_reuse() && m_backend != BACKEND_FIXED) ? TRACE_ROTATED : TRACE_ALL;
+  }
+
+  //NOTE: On small maps (where rays are short) it's quicker to trace every column again than to
+  // work out which ones reuse_columns() can skip.
+  bool use_rotation_reuse() {
+    if (m_reuse < 0) return long(m_map.m_width)*m_map.m_height > 256*256;
+    return m_reuse;
+  }
+
+  // Works out the trace mode for this camera, and records that m_traces will then be for it:
+  int begin_trace(const RayboxCamera &cam) {
+    int mode = trace_mode(cam);
+    if (mode == TRACE_ROTATED) {
+      m_prev_cam = m_traced_cam;
+      m_prev_traces = m_traces;
+    }
+    if (mode == TRACE_NONE) m_columns_reused += m_view_width;
+    else m_fb_view_current = false;
+    m_traced_cam = cam;
+    m_traced_backend = m_backend;
+    m_traces_valid = true;
+    if (m_backend == BACKEND_FIXED && !m_fixed_range_warned && std::max(m_map.m_width, m_map.m_height) >= (1 << (RAYBOX_FIXED_INT_BITS-1))) {
+      // (Positions and distances saturate at the top of fixed_num's range, so rays go wrong out there.)
+      printf(
+        "WARNING: %dx%d map is too big for the fixed backend, which only covers %d cells each way\n",
+        m_map.m_width, m_map.m_height, (1 << (RAYBOX_FIXED_INT_BITS-1)) - 1
+      );
+      m_fixed_range_warned = true;
+    }
+    m_rays = NULL;
+    if (m_ray_angles > 0 && !m_reference && m_backend == BACKEND_FLOAT) {
+      ensure_ray_table();
+      num hx, hy;
+      m_ray_table.heading(m_heading_index, hx, hy);
+      // (Anything else, e.g. the bench moving the camera directly, just gets traced as usual):
+      if (cam.headingX == hx && cam.headingY == hy && cam.viewX == -hy*viewMag && cam.viewY == hx*viewMag) {
+        m_ray_row = m_ray_table.rays(m_heading_index);
+        m_rays = &m_ray_row;
+      }
+    }
+    return mode;
+  }
+
+  template<class V>
+  void trace_columns_mode(const V &view, const RayboxCamera &cam, int mode, int x0, int x1) {
+    if (mode == TRACE_ROTATED) {
+      if (m_backend == BACKEND_DOUBLE) return reuse_columns<double>(view, cam, x0, x1);
+      return reuse_columns<num>(view, cam, x0, x1);
+    }
+    m_rays_cast += trace_columns_adaptive(view, cam, x0, x1);
+    m_columns_traced += x1-x0;
+  }
+
+  // Direction of the ray through a screen column, as the tracer works it out (but in double precision):
+  template<class V>
+  static void ray_dir(const V &view, const RayboxCamera &cam, int screenX, double &dx, double &dy) {
+    double cameraX = view.template camera_x<double>(screenX);
+    dx = double(cam.headingX) + double(cam.viewX)*cameraX;
+    dy = double(cam.headingY) + double(cam.viewY)*cameraX;
+  }
+
+  // Rotation fast path (see trace_mode()): The player hasn't moved since the last frame, so if
+  // a ray passes between two of the last frame's rays that hit the same wall face, then it hits
+  // that face too. Nothing can be in its way without one of those two rays having hit it first,
+  // because the triangle between the player and their two hit points is less than one cell wide
+  // and so can't hide a whole wall cell. Such columns are worked out directly from the face (see
+  // trace_face_columns()), and the rest (newly exposed ones, and ones near the edges of walls)
+  // are traced as usual.
+  //NOTE: The tracer only matches the geometry to within rounding error, so a ray has to be clear
+  // of both of its neighbours by REUSE_MARGIN of the gap between them. Neighbouring columns are
+  // at least 0.0014 radians apart, so that's well above the error of float or double tracing
+  // (but not of fixed-point, hence trace_mode()). --bench-verify checks that the results match
+  // the reference tracer.
+  template<typename N, class V>
+  void reuse_columns(const V &view, const RayboxCamera &cam, int x0, int x1) {
+    const double REUSE_MARGIN = 0.01;
+    const RayboxCamera &old = m_prev_cam;
+    const double h0x = old.headingX, h0y = old.headingY;
+    const double v0x = old.viewX, v0y = old.viewY;
+    uint64_t reused = 0, rays = 0;
+    int run = x0; // Start of the current run of columns that need tracing.
+    for (int x=x0; x<x1; ++x) {
+      double dx, dy;
+      ray_dir(view, cam, x, dx, dy);
+      // Which of the last frame's columns does this ray fall between? It points along the old
+      // camera's heading+view*c for some cameraX c, which we can then convert to a screen column:
+      double c = -(dx*h0y - dy*h0x) / (dx*v0y - dy*v0x);
+      if (!(dx*(h0x+v0x*c) + dy*(h0y+v0y*c) > 0)) continue; // (Behind the old camera, or NaN.)
+      double s = (c+1.0) * (view.width()/2.0);
+      if (!(s >= 0 && s < view.width()-1)) continue; // Newly exposed.
+      int j = int(s);
+      if (s-j < REUSE_MARGIN || s-j > 1.0-REUSE_MARGIN) continue;
+      const traced_column_t &a = m_prev_traces[j];
+      const traced_column_t &b = m_prev_traces[j+1];
+      if (a.mapX != b.mapX || a.mapY != b.mapY || a.side != b.side) continue;
+      if (run < x) rays += trace_columns_adaptive(view, cam, run, x);
+      trace_face_columns<N>(view, cam, x, x+1, a.mapX, a.mapY, a.side, a.color);
+      ++reused;
+      run = x+1;
+    }
+    if (run < x1) rays += trace_columns_adaptive(view, cam, run, x1);
+    m_rays_cast += rays;
+    m_columns_reused += reused;
+    m_columns_traced += (x1-x0) - reused;
+  }
+
+  // Edge-adaptive tracing: Trace every m_adaptive'th column of [x0,x1) (and the last one), then
+  // fill in between them (see refine_columns()). Returns the number of rays actually traced.
+  //NOTE: As with reuse_columns(), this relies on the tracer matching the geometry to well within
+  // the angle between neighbouring columns, which fixed-point doesn't, so it always traces them all.
+  template<class V>
+  int trace_columns_adaptive(const V &view, const RayboxCamera &cam, int x0, int x1) {
+    if (m_adaptive <= 1 || m_reference || m_backend == BACKEND_FIXED || x1-x0 <= 2) {
+      trace_columns(view, cam, x0, x1);
+      return x1-x0;
+    }
+    int rays = 0;
+    int prev = x0;
+    trace_columns(view, cam, x0, x0+1);
+    ++rays;
+    while (prev < x1-1) {
+      int next = std::min(prev+m_adaptive, x1-1);
+      trace_columns(view, cam, next, next+1);
+      ++rays;
+      rays += (m_backend == BACKEND_DOUBLE) ? refine_columns<double>(view, cam, prev, next) : refine_columns<num>(view, cam, prev, next);
+      prev = next;
+    }
+    return rays;
+  }
+
+  // Fills in the columns between a and b (which have both been traced already). If they hit the
+  // same wall face, then so does every column between them (for the same reason as in reuse_columns()),
+  // so they're worked out from that. Otherwise, trace the column halfway between them, and recurse.
+  // Returns the number of rays traced.
+  template<typename N, class V>
+  int refine_columns(const V &view, const RayboxCamera &cam, int a, int b) {
+    if (b-a <= 1) return 0;
+    const traced_column_t &ta = m_traces[a];
+    const traced_column_t &tb = m_traces[b];
+    if (ta.mapX == tb.mapX && ta.mapY == tb.mapY && ta.side == tb.side) {
+      trace_face_columns<N>(view, cam, a+1, b, ta.mapX, ta.mapY, ta.side, ta.color);
+      return 0;
+    }
+    int m = (a+b)/2;
+    trace_columns(view, cam, m, m+1);
+    return 1 + refine_columns<N>(view, cam, a, m) + refine_columns<N>(view, cam, m, b);
+  }
+
+  // Fills in the traces of columns [x0,x1) given the wall face that all of their rays hit (i.e. the
+  // cell, and which side), doing exactly the same arithmetic as trace_columns_scalar() does on
+  // reaching it. The ray's direction along the hit axis (and so the distance to its first gridline
+  // crossing) follows from which side of the player the face is on, so that's only worked out once.
+  template<typename N, class V>
+  void trace_face_columns(const V &view, const RayboxCamera &cam, int x0, int x1, int mapX, int mapY, int side, uint32_t color) {
+    const N playerX = N(cam.playerX), playerY = N(cam.playerY);
+    const N headingX = N(cam.headingX), headingY = N(cam.headingY);
+    const N viewX = N(cam.viewX), viewY = N(cam.viewY);
+    const int cellX = int(playerX), cellY = int(playerY);
+    const N first = (side == 0)
+      ? ((mapX > cellX) ? N(cellX+1)-playerX : playerX-N(cellX))
+      : ((mapY > cellY) ? N(cellY+1)-playerY : playerY-N(cellY));
+    const int crossed = (side == 0) ? abs(mapX-cellX) : abs(mapY-cellY);
+    for (int screenX = x0; screenX < x1; ++screenX) {
+      N cameraX = view.template camera_x<N>(screenX);
+      N rayDirX = headingX + viewX*cameraX;
+      N rayDirY = headingY + viewY*cameraX;
+      N stepDist = num_recip_abs((side == 0) ? rayDirX : rayDirY);
+      // (Accumulated one crossing at a time, and then backed off one, just as the tracer does.)
+      N visualWallDist = first*stepDist;
+      for (int i = 0; i < crossed; ++i) visualWallDist += stepDist;
+      visualWallDist -= stepDist;
+      m_traces[screenX].side  = side;
+      m_traces[screenX].color = color;
+      m_traces[screenX].dist  = num(visualWallDist);
+      m_traces[screenX].hx    = num(visualWallDist*rayDirX + playerX);
+      m_traces[screenX].hy    = num(visualWallDist*rayDirY + playerY);
+      m_traces[screenX].mapX  = mapX;
+      m_traces[screenX].mapY  = mapY;
+    }
+  }
+
+  template<class V>
+  void trace_columns(const V &view, const RayboxCamera &cam, int x0, int x1) {
+    switch (m_map.m_layout) {
+      case MAP_LAYOUT_ROWMAJOR32: return trace_columns_layout<MAP_LAYOUT_ROWMAJOR32>(view, cam, x0, x1);
+      case MAP_LAYOUT_ROWMAJOR8:  return trace_columns_layout<MAP_LAYOUT_ROWMAJOR8>(view, cam, x0, x1);
+      case MAP_LAYOUT_TILED:      return trace_columns_layout<MAP_LAYOUT_TILED>(view, cam, x0, x1);
+      case MAP_LAYOUT_MORTON:     return trace_columns_layout<MAP_LAYOUT_MORTON>(view, cam, x0, x1);
+    }
+  }
+
+  template<int LAYOUT, class V>
+  void trace_columns_layout(const V &view, const RayboxCamera &cam, int x0, int x1) {
+    if (use_accel()) return trace_columns_backend<LAYOUT, true>(view, cam, x0, x1);
+    trace_columns_backend<LAYOUT, false>(view, cam, x0, x1);
+  }
+
+  template<int LAYOUT, bool ACCEL, class V>
+  void trace_columns_backend(const V &view, const RayboxCamera &cam, int x0, int x1) {
+    if (m_backend == BACKEND_DOUBLE) return trace_columns_scalar<double, LAYOUT, ACCEL>(view, cam, x0, x1);
+    if (m_backend == BACKEND_FIXED)  return trace_columns_scalar<fixed_num, LAYOUT, ACCEL>(view, cam, x0, x1);
+    if (ACCEL) return trace_columns_scalar<num, LAYOUT, ACCEL>(view, cam, x0, x1);
+#ifdef RAYBOX_SIMD
+    // (Gather offsets are signed 32-bit, so really huge maps have to go the scalar route):
+    if (!m_reference && m_map.cells_bytes() < (1u<<31)) {
+      const float *camera_x = view.template camera_x_table<float>();
+      traced_column_t *out = m_traces.data();
+      if (m_simd_lanes == SIMD_AVX512) x0 += trace_packets_avx512<LAYOUT>(m_map, cam, view.width(), camera_x, m_rays, x0, x1, out);
+      if (m_simd_lanes >= SIMD_AVX2)   x0 += trace_packets_avx2<LAYOUT>(m_map, cam, view.width(), camera_x, m_rays, x0, x1, out);
+    }
+#endif
+    // Trace any remaining columns one at a time:
+    trace_columns_scalar<num, LAYOUT, false>(view, cam, x0, x1);
+  }
+
+  // Scalar tracer, for any numeric type N (see BACKEND_*). With N=num this is the original tracer:
+  // The DDA itself is raybox_dda(), which RayboxQuery and RayboxBatchRenderer share.
+  // If ACCEL is true, use the map's distance field to skip over runs of empty cells
+  // (see RayboxMap::build_distance_field()). With N=float, m_rays (if set) gives each
+  // column's ray direction and step distances (see RayboxRayTable).
+  template<typename N, int LAYOUT, bool ACCEL, class V>
+  void trace_columns_scalar(const V &view, const RayboxCamera &cam, int x0, int x1) {
+    uint64_t iterations = 0, cells = 0;
+    const ray_row_t *rays = std::is_same<N, float>::value ? m_rays : NULL;
+    // Trace a ray for each screen column:
+    const N playerX = N(cam.playerX), playerY = N(cam.playerY);
+    const N headingX = N(cam.headingX), headingY = N(cam.headingY);
+    const N viewX = N(cam.viewX), viewY = N(cam.viewY);
+    for (int screenX = x0; screenX < x1; ++screenX) {
+      N rayDirX, rayDirY, stepXdist, stepYdist;
+      if (rays) {
+        // Look up the ray's direction and step distances (see below) for this column:
+        rayDirX = N(rays->signX * rays->dirX[screenX]);
+        rayDirY = N(rays->signY * rays->dirY[screenX]);
+        stepXdist = N(rays->stepX[screenX]);
+        stepYdist = N(rays->stepY[screenX]);
+      }
+      else {
+        // Convert screenX to cameraX (i.e. proportional position along the viewplane):
+        N cameraX = view.template camera_x<N>(screenX); // cx = [-1,1)
+        // Work out the base vector for the ray that goes from the player, through this slit of the viewplane:
+        rayDirX = headingX + viewX*cameraX;
+        rayDirY = headingY + viewY*cameraX;
+        // What respective distances will we travel along the ray, with each step on X or Y gridlines?
+        //NOTE: denominator could be 0!
+        //NOTE: Because we end up treating these distances as though they are based on a normalised base ray,
+        // we can just use 1/axis instead of ||rayDir||/axis.
+        stepXdist = num_recip_abs(rayDirX);
+        stepYdist = num_recip_abs(rayDirY);
+      }
+      // Now perform DDA, to find the first (nearest) edge we hit that belongs to an occupied map cell:
+      //NOTE: We assume the map has no holes, and that our player is not inside a wall,
+      // and hence we can assume we definitely have some wallHit value.
+      raybox_dda_t<N> hit;
+      raybox_dda<N, LAYOUT, ACCEL, false>(
+        m_map, playerX, playerY, rayDirX, rayDirY, stepXdist, stepYdist, N(0), hit
+      );
+      iterations += hit.iterations;
+      cells += hit.cells;
+      const N visualWallDist = hit.dist;
+      m_traces[screenX].side  = hit.side;
+      m_traces[screenX].color = m_map.raw_color<LAYOUT>(hit.wallHit);
+      m_traces[screenX].dist  = num(visualWallDist);
+      m_traces[screenX].hx    = num(visualWallDist*rayDirX + playerX);
+      m_traces[screenX].hy    = num(visualWallDist*rayDirY + playerY);
+      m_traces[screenX].mapX  = hit.mapX;
+      m_traces[screenX].mapY  = hit.mapY;
+    } // for
+    // Re hx,hy: Because visualWallDist is based on a normalised base ray...
+    //...then it is a real distance which we can multiply by the ray's X and Y to get a map-level hit position.
+    m_dda_iterations += iterations;
+    m_dda_cells += cells;
+  } // trace_columns_scalar()
+
+
+  bool render_view() {
+    STATS_SCOPE(STAT_RENDER_VIEW);
+    with_view([&](auto view) {
+      if (parallel()) {
+        for_each_chunk([&](int x0, int x1) { render_view_columns(view, x0, x1); });
+      }
+      else {
+        render_view_columns(view, 0, view.width());
+      }
+    });
+    return true;
+  }
+
+  template<class V>
+  void render_view_columns(const V &view, int x0, int x1) {
+    const int H = view.height();
+    // Render each column:
+    uint64_t pixels = 0;
+    for (int x=x0; x<x1; ++x) {
+      traced_column_t &col = m_traces[x];
+      if (m_textured) {
+        // Work out each row's texel from scratch (cf. render_textured_columns(), which steps through them):
+        RayboxTextures::column_t c = m_textures.column(col, H);
+        for (int y=c.y0; y<c.y1; ++y) {
+          uint32_t pos = c.pos + uint32_t(y-c.y0) * c.step;
+          T(m_fb, x, y) = c.texels[pos>>16] & c.shade;
+        }
+        pixels += c.y1-c.y0;
+        continue;
+      }
+      uint32_t color = wall_color(col);
+      // .dist is the distance from the player to the wall hit.
+      // .color is the wall color.
+      // .hx,hy is the point of the hit, in map space.
+      // .side is 0 (NS) or 1 (EW) depending on which side of a wall we hit.
+      int stop = wall_stop(view, col);
+      if (stop > H/2) pixels += 2*(stop-H/2);
+      uint32_t *pxup, *pxdn;
+      int pitch = view.width();
+      pxup = (uint32_t*)(m_fb+(H/2-1)*(pitch*4)+(x*4));
+      pxdn = pxup+pitch;
+      for (int v=H/2; v<stop; ++v) {
+        *pxup = color; pxup-=pitch;
+        *pxdn = color; pxdn+=pitch;
+      }
+      // int y1 = (m_view_height>>1)-h;
+      // if (y1<0) y1 = 0;
+      // // int y2 = (m_view_height>>1)+h;
+      // // if (y2>m_view_height) y2=m_view_height;
+
+      // for (int t=-h; t<h; ++t) {
+      //   int y = t+m_view_height/2;
+      //   if (y<0 || y>=m_view_height) continue;
+      //   num tt = num(t+h)/num(h*2);
+      //   // Darken, depending on the side we hit:
+      //   // T(m_fb, x, y) = col.color & (col.side ? 0xffffffff : 0xffc0c0c0);
+      //   int tx = int(64.0*(col.side ? col.hx : col.hy));
       //   int ty = int(64.0*tt);
 
-      //   // int r = (fx&1)        ? 0x0000ff : 0x000000;
-      //   int g = (tx&4)^(ty&4) ? 0x00ff00 : 0x007000;
-      //   // int b = (fy&1)        ? 0xff0000 : 0x000000;
-      //   int r = 0;
-      //   int b = 0;
-      //   T(m_fb, x, y) = (r|g|b|0xff000000) & (col.side ? 0xffffffff : 0xffc0c0c0);
-      //   // T(m_fb, x, y) =  ? 0xff888888 : 0xffcc00cc;
-      // }
+      //   // int r = (fx&1)        ? 0x0000ff : 0x000000;
+      //   int g = (tx&4)^(ty&4) ? 0x00ff00 : 0x007000;
+      //   // int b = (fy&1)        ? 0xff0000 : 0x000000;
+      //   int r = 0;
+      //   int b = 0;
+      //   T(m_fb, x, y) = (r|g|b|0xff000000) & (col.side ? 0xffffffff : 0xffc0c0c0);
+      //   // T(m_fb, x, y) =  ? 0xff888888 : 0xffcc00cc;
+      // }
+    }
+    m_pixels_written += pixels;
+  }
+
+  void rotate(num a) {
+    if (m_ray_angles > 0) {
+      // Turn by whole angle steps, carrying the rest over to the next call:
+      m_turn_accum += a * num(m_ray_angles/(2.0*PI));
+      int steps = int(floor(m_turn_accum + num(0.5)));
+      m_turn_accum -= num(steps);
+      if (steps) set_heading_index(m_heading_index + steps);
+      return;
+    }
+    num nx, ny;
+    num ca = cos(a);
+    num sa = sin(a);
+    // Rotate direction vector:
+    nx =  headingX*ca + headingY*sa;
+    ny = -headingX*sa + headingY*ca;
+    headingX = nx;
+    headingY = ny;
+    // Generate viewplane vector:
+    viewX = -headingY * viewMag;
+    viewY =  headingX * viewMag;
+    // // Rotate viewplane vector:
+    // nx =  viewX*ca + viewY*sa;
+    // ny = -viewX*sa + viewY*ca;
+    // viewX = nx;
+    // viewY = ny;
+  }
+
+  // If draw_view is false, the backdrop and walls have already been drawn (e.g. by trace_and_render_view()).
+  // Parts of the frame that haven't changed since the last one (see trace_mode()) aren't drawn again,
+  // and if nothing has changed, the frame isn't presented either (and false is returned in *presented).
+  bool render(bool real_render=true, bool draw_view=true, bool *presented=NULL) {
+    if (presented) *presented = false;
+    if (real_render) {
+      if (draw_view && view_needs_drawing()) {
+        if (!render_walls()) return false;
+        if (!render_sprites()) return false;
+        // if (!render_random(50, 50, 50, 50)) return false;
+        m_fb_view_current = true;
+      }
+      if (m_show_map_overlay && !render_map()) return false;
+#if RAYBOX_STATS
+      if (m_show_stats_overlay && !render_stats_overlay()) return false;
+#endif
+      if (!m_fb_presented) {
+        if (m_frame_dump) m_frame_dump->push(m_fb, m_frame);
+        present();
+        m_fb_presented = true;
+        if (presented) *presented = true;
+      }
+    }
+    ++m_frame;
+    return true;
+  }
+
+  // Does m_fb need the backdrop and walls drawing (again)? Not if it has them already, or if it's
+  // a stale buffer (see present()) but there's nothing new to present anyway:
+  bool view_needs_drawing() {
+    if (!m_fb_view_current) return true;
+    return m_fb_stale && (!m_fb_presented || m_show_map_overlay);
+  }
+
+  // Gets m_fb onto the screen. In PRESENT_LOCK and PRESENT_PIPELINE modes, m_fb is then
+  // a different buffer, that doesn't hold this frame (hence m_fb_stale):
+  void present() {
+    if (m_headless) return; // e.g. replay().
+    uint64_t t0 = SDL_GetPerformanceCounter();
+    input_times_t input = { m_thisTime, m_prevTime, m_key_pressed };
+    m_key_pressed = 0;
+    if (m_present_mode == PRESENT_PIPELINE) {
+      m_fb = m_presenter->submit(m_fb, input); // m_presenter records the stats itself.
+      m_fb_stale = true;
+#if RAYBOX_STATS
+      m_stats.add_ticks(STAT_PRESENT, SDL_GetPerformanceCounter()-t0);
+#endif
+      return;
+    }
+    // With --dynamic-res, the view may be smaller than the texture, so it only fills the top left
+    // of it, which SDL then scales up to fill the window:
+    const SDL_Rect rect = { 0, 0, m_view_width, m_view_height };
+    if (m_present_mode == PRESENT_LOCK) {
+      SDL_UnlockTexture(m_texture);
+    }
+    else {
+      SDL_UpdateTexture(m_texture, &rect, m_fb, m_view_width*4);
+    }
+    uint64_t t1 = SDL_GetPerformanceCounter();
+    SDL_RenderCopy(m_renderer, m_texture, &rect, NULL);
+    uint64_t ready = SDL_GetPerformanceCounter();
+    SDL_RenderPresent(m_renderer);
+    uint64_t t2 = SDL_GetPerformanceCounter();
+    m_input_latency.add(input, ready, t2, m_frequency);
+    if (m_present_mode == PRESENT_LOCK && !lock_fb()) {
+      printf("WARNING: Failed to lock the texture again, so copying into it instead\n");
+      m_present_mode = PRESENT_COPY;
+      if (!m_fb_alloc) m_fb_alloc = new uint8_t[fb_size()];
+      m_fb = m_fb_alloc;
+      m_fb_stale = true;
+    }
+    uint64_t t3 = SDL_GetPerformanceCounter();
+    m_present_stats.add((t1-t0) + (t3-t2), t2-t0);
+#if RAYBOX_STATS
+    m_stats.add_ticks(STAT_UPLOAD, (t1-t0) + (t3-t2));
+    m_stats.add_ticks(STAT_PRESENT, t2-t1);
+#endif
+  }
+
+  bool handle_input() {
+    STATS_SCOPE(STAT_HANDLE_INPUT);
+    input_frame_t in = live_input();
+    if (m_recorder && !m_recorder->write(in)) {
+      printf("ERROR: Failed to write input recording\n");
+      return false;
+    }
+    apply_input(in);
+    return true;
+  }
+
+  // This frame's input, from the keyboard and the time since the last frame:
+  input_frame_t live_input() {
+    static const struct { int scancode; uint16_t bit; } keymap[] = {
+      { SDL_SCANCODE_LEFT, INPUT_LEFT }, { SDL_SCANCODE_RIGHT, INPUT_RIGHT }, { SDL_SCANCODE_LSHIFT, INPUT_SHIFT },
+      { SDL_SCANCODE_W, INPUT_W }, { SDL_SCANCODE_S, INPUT_S }, { SDL_SCANCODE_A, INPUT_A }, { SDL_SCANCODE_D, INPUT_D },
+      { SDL_SCANCODE_TAB, INPUT_MAP }, { SDL_SCANCODE_GRAVE, INPUT_STATS }
+    };
+    const uint8_t *keys = SDL_GetKeyboardState(NULL);
+    input_frame_t in = { 0, time_step() };
+    for (auto &k : keymap) {
+      if (keys[k.scancode]) in.keys |= k.bit;
+    }
+    if (m_auto_turn) in.keys |= INPUT_AUTO_TURN;
+    return in;
+  }
+
+  // Moves the player (etc.) according to one frame's input. Given the same input,
+  // this always does exactly the same thing (e.g. when replaying a recording):
+  void apply_input(const input_frame_t &in) {
+    m_show_map_overlay = in.keys & INPUT_MAP;
+#if RAYBOX_STATS
+    m_show_stats_overlay = m_stats_overlay_always || (in.keys & INPUT_STATS);
+#endif
+    num ts = in.step*3;
+    if (in.keys & INPUT_LEFT) rotate(ts/3);
+    if (in.keys & INPUT_RIGHT) rotate(-ts/3);
+    if (in.keys & INPUT_AUTO_TURN) rotate(0.01); // A fixed step per frame, so that each run draws the same frames.
+    if (in.keys & INPUT_SHIFT) ts*=2;
+    if (in.keys & INPUT_W) { playerX+=ts*headingX; playerY+=ts*headingY; }
+    if (in.keys & INPUT_S) { playerX-=ts*headingX; playerY-=ts*headingY; }
+    if (in.keys & INPUT_A) { playerX-=ts*viewX; playerY-=ts*viewY; }
+    if (in.keys & INPUT_D) { playerX+=ts*viewX; playerY+=ts*viewY; }
+  }
+
+  bool handle_events() {
+    STATS_SCOPE(STAT_HANDLE_EVENTS);
+    SDL_Event e;
+    while (SDL_PollEvent(&e) == 1) {
+      if (SDL_QUIT == e.type) return false;
+      if (SDL_WINDOWEVENT == e.type) {
+        // e.g. the window was uncovered, so present the frame again even if it hasn't changed:
+        m_fb_presented = false;
+      }
+      if (SDL_KEYDOWN == e.type && !e.key.repeat && moves_player(e.key.keysym.scancode)) {
+        // For input_latency_t: SDL's timestamp is in ms, so work back from now:
+        uint64_t age = uint64_t(SDL_GetTicks() - e.key.timestamp) * m_frequency / 1000;
+        uint64_t pressed = SDL_GetPerformanceCounter() - age;
+        if (!m_key_pressed || pressed < m_key_pressed) m_key_pressed = pressed;
+      }
+      if (SDL_KEYDOWN == e.type) {
+        switch (e.key.keysym.sym) {
+          case SDLK_ESCAPE:
+            return false;
+          case SDLK_c:
+            m_capture_traces = true;
+            break;
+          case SDLK_m:
+            dump_map();
+            break;
+        }
+      }
+    }
+    return true;
+  }
+
+  static bool moves_player(int scancode) {
+    return scancode == SDL_SCANCODE_LEFT || scancode == SDL_SCANCODE_RIGHT || scancode == SDL_SCANCODE_W
+      || scancode == SDL_SCANCODE_S || scancode == SDL_SCANCODE_A || scancode == SDL_SCANCODE_D;
+  }
+
+  void debug_print() {
+    m_map.debug_print_map();
+  }
+
+  num time_step() {
+    num t = num(m_thisTime-m_prevTime)/num(m_frequency);
+    return (t < 0.001) ? 0.001 : t;
+  }
+
+  // Dumps the lower-right 16x16 region of the map as a .hex file,
+  // for use as a test map "ROM" in the raybox verilog code.
+  //NOTE: This dumps each map cell as a byte, packed like this:
+  // 0b00RRGGBB - i.e. it only preserves the upper 2 bits of each
+  // map colour. Note also that this writes in column-row order
+  // (i.e. row 0, col 0..15 -- then row 1, col 0..15 -- etc).
+  void dump_map() {
+    FILE *fp = fopen("map_16x16.hex", "wb");
+    fprintf(fp, "@00000000\n");
+    int counter = 0;
+    for (int y=m_map.m_height-16; y<m_map.m_height; ++y) {
+      for (int x=m_map.m_width-16; x<m_map.m_width; ++x) {
+        uint32_t m = m_map.cell(x, y);
+        uint8_t r = (m&0xc00000)>>18;
+        uint8_t g = (m&0xc000)>>12;
+        uint8_t b = (m&0xc0)>>6;
+        fprintf(fp, "%02X%c", r|g|b, counter%16==15 ? '\n' : ' ');
+        ++counter;
+      }
+    }
+    fclose(fp);
+    printf("dump_map(): Wrote %s\n", "map_16x16.hex");
+  }
+
+  // Writes the current height & side values (that were last traced)
+  // to a .hex file that we can use for testing in the raybox verilog code.
+  // (To capture every frame, use --trace-stream instead.)
+  void capture_traces() {
+    static int capture_count = 0;
+    char capture_filename[32];
+    sprintf(capture_filename, "traces_capture_%04d.hex", capture_count++);
+    std::vector<uint8_t> height_side(m_view_width*2);
+    for (int x=0; x<m_view_width; ++x) {
+      height_side[x*2]   = capture_height(m_traces[x], m_view_height);
+      height_side[x*2+1] = m_traces[x].side;
+    }
+    if (write_capture_hex(capture_filename, height_side.data(), m_view_width)) {
+      printf("capture_traces(): Wrote %s\n", capture_filename);
+    }
+  }
+
+  void run() {
+    static uint64_t initial_time = SDL_GetPerformanceCounter();
+    bool quit = 0;
+    m_prevTime = SDL_GetPerformanceCounter();
+    m_frequency = SDL_GetPerformanceFrequency();
+    int frame_count = 0;
+    int idle_count = 0;
+    uint64_t fps_time = SDL_GetPerformanceCounter();
+    uint64_t fps_1sec = m_frequency;
+    uint64_t traced_before = m_columns_traced;
+    uint64_t reused_before = m_columns_reused;
+    uint64_t rays_before = m_rays_cast;
+    uint64_t presents_before = 0, copy_before = 0, latency_before = 0;
+
+    while (!quit) {
+      if (m_late_input) wait_to_sample_input();
+      m_thisTime = SDL_GetPerformanceCounter();
+#if RAYBOX_STATS
+      uint64_t stats_columns = m_columns_traced + m_columns_reused, stats_rays = m_rays_cast, stats_pixels = m_pixels_written;
+#endif
+      if (!handle_events()) break;
+      if (!handle_input()) break;
+      bool fused = parallel();
+      if (fused) {
+        if (!trace_and_render_view()) break;
+      }
+      else if (!trace()) break;
+      if (m_capture_traces) {
+        m_capture_traces = false;
+        capture_traces();
+      }
+      if (m_trace_stream) m_trace_stream->push(m_traces.data(), m_frame);
+      bool presented;
+      if (!render(true, !fused, &presented)) break;
+#if RAYBOX_STATS
+      record_frame_stats(presented, stats_columns, stats_rays, stats_pixels);
+#endif
+      if (m_dynamic_res && presented) {
+        // (Frames that weren't presented didn't draw anything, so they don't say much about the scale.)
+        double frame_ms = 1000.0 * double(SDL_GetPerformanceCounter()-m_thisTime) / double(m_frequency);
+        if (m_scaler.update(frame_ms)) set_scale(m_scaler.m_scale);
+      }
+      ++frame_count;
+      if (!presented) {
+        // Nothing changed, so rather than spinning, wait (briefly) for some input to arrive:
+        ++idle_count;
+        SDL_WaitEventTimeout(NULL, 10);
+      }
+      uint64_t now = SDL_GetPerformanceCounter();
+      if (now-fps_time>=fps_1sec) {
+        // At least 1 second has elapsed. How many frames have we done?
+        uint64_t elapsed_time = now-initial_time;
+        uint64_t traced = m_columns_traced - traced_before;
+        uint64_t reused = m_columns_reused - reused_before;
+        uint64_t rays = m_rays_cast - rays_before;
+        uint64_t presents = m_present_stats.frames - presents_before;
+        uint64_t copy = m_present_stats.copy_ticks - copy_before;
+        uint64_t latency = m_present_stats.latency_ticks - latency_before;
+        printf(
+          "[%6.2f sec] Current FPS: %.2f - Overall FPS: %.2f - Columns reused: %.1f%% - Rays cast: %.1f%% - Idle frames: %d"
+          " - Present copy: %.3f ms - Present latency: %.3f ms",
+          num(elapsed_time)/num(fps_1sec),
+          num(frame_count)/(num(now-fps_time)/num(fps_1sec)),
+          num(m_frame)/(num(elapsed_time)/num(fps_1sec)),
+          100.0 * double(reused) / double(std::max<uint64_t>(1, traced+reused)),
+          100.0 * double(rays) / double(std::max<uint64_t>(1, traced+reused)),
+          idle_count,
+          1000.0 * double(copy) / double(std::max<uint64_t>(1, presents)) / double(m_frequency),
+          1000.0 * double(latency) / double(std::max<uint64_t>(1, presents)) / double(m_frequency)
+        );
+        if (m_dynamic_res) {
+          printf(
+            " - Scale: %.4g (%dx%d) - Budget misses: %d (%.1f ms avg)",
+            m_scaler.m_scale, m_view_width, m_view_height, m_scaler.m_misses, m_scaler.m_avg_ms
+          );
+          m_scaler.m_misses = 0;
+        }
+        printf("\n");
+        fps_time = now;
+        frame_count = 0;
+        idle_count = 0;
+#if RAYBOX_STATS
+        m_stats.dump(double(elapsed_time)/double(fps_1sec));
+#endif
+        traced_before += traced;
+        reused_before += reused;
+        rays_before += rays;
+        presents_before += presents;
+        copy_before += copy;
+        latency_before += latency;
+      }
+
+      m_prevTime = m_thisTime;
+      if (m_max_frames > 0 && m_frame >= m_max_frames) break;
+    }
+#if RAYBOX_STATS
+    // Dump whatever's been recorded since the last time:
+    if (m_stats.m_recorded > m_stats.m_dumped) m_stats.dump(double(SDL_GetPerformanceCounter()-initial_time)/double(fps_1sec));
+#endif
+    print_present_stats();
+  }
+
+  // --late-input: Before sampling the input for the next frame, waits for as long as presenting it
+  // would otherwise wait, so that it shows input that's that much more recent. (The keyboard is
+  // read, and the player moved, straight after, just before trace() reads the camera.) With
+  // PRESENT_PIPELINE, that means not drawing ahead while a frame is still queued. With vsync, it
+  // aims to have the frame ready m_late_margin_ms before the next refresh, given the recent worst
+  // time from sampling to presenting, and taking SDL_RenderPresent() returning as the time of the
+  // last refresh. If that's already too late, it doesn't wait (rather than aiming for the refresh
+  // after, which would halve the frame rate whenever the worst case doesn't quite fit).
+  void wait_to_sample_input() {
+    // (If the presenter is busy, it's waiting for the next refresh, so aim for the one after.)
+    bool presenting = (m_present_mode == PRESENT_PIPELINE) && m_presenter->wait_for_queue();
+    if (!m_vsync) return;
+    uint64_t last;
+    double work_ms;
+    {
+      std::lock_guard<std::mutex> lock(m_input_latency.mutex);
+      last = m_input_latency.last_presented;
+      work_ms = m_input_latency.work_ms;
+    }
+    if (!last) return;
+    uint64_t now = SDL_GetPerformanceCounter();
+    double ticks_per_ms = double(m_frequency) / 1000.0;
+    double refresh = m_refresh_ms * ticks_per_ms, lead = (work_ms + m_late_margin_ms) * ticks_per_ms;
+    double since = double(now - last);
+    double wait = (std::ceil(since / refresh) + (presenting ? 1 : 0)) * refresh - lead - since;
+    if (wait > 0) std::this_thread::sleep_for(std::chrono::microseconds(int64_t(wait / ticks_per_ms * 1000.0)));
+  }
+
+  // FNV-1a hash of m_traces, e.g. to check that replaying a recording gives the same traces:
+  uint64_t traces_checksum() {
+    const uint8_t *p = (const uint8_t*)m_traces.data();
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i=0; i<m_traces.size()*sizeof(traced_column_t); ++i) h = (h ^ p[i]) * 1099511628211ull;
+    return h;
+  }
+
+  // Plays back a recording (see RayboxInputLog) as fast as possible, headless: Each frame is traced
+  // and drawn as in run(), but not presented. If checksum_file is given, each frame's
+  // traces_checksum() is written to it, so that different builds (or options) can be compared.
+  bool replay(RayboxInputLog &log, const char *checksum_file) {
+    FILE *fp = NULL;
+    if (checksum_file) {
+      fp = fopen(checksum_file, "wb");
+      if (!fp) {
+        printf("ERROR: Failed to open checksum output file: %s\n", checksum_file);
+        return false;
+      }
+    }
+    if (log.m_view_width != m_view_width || log.m_view_height != m_view_height) {
+      printf(
+        "WARNING: Recorded at %dx%d, but replaying at %dx%d, so the traces won't match the original's\n",
+        log.m_view_width, log.m_view_height, m_view_width, m_view_height
+      );
+    }
+    if (log.m_backend != m_backend) {
+      printf(
+        "WARNING: Recorded with the %s backend, but replaying with %s, so the traces won't match the original's\n",
+        backend_name(log.m_backend), backend_name(m_backend)
+      );
+    }
+    RayboxCamera cam = log.camera();
+    playerX = cam.playerX;
+    playerY = cam.playerY;
+    headingX = cam.headingX;
+    headingY = cam.headingY;
+    viewX = cam.viewX;
+    viewY = cam.viewY;
+    snap_heading();
+    uint64_t frequency = SDL_GetPerformanceFrequency();
+    std::vector<uint64_t> frame_ticks;
+    uint64_t checksum = 14695981039346656037ull;
+    input_frame_t in;
+    uint64_t start = SDL_GetPerformanceCounter();
+    while (log.read(in)) {
+      uint64_t t0 = SDL_GetPerformanceCounter();
+      apply_input(in);
+      bool fused = parallel();
+      if (fused) {
+        if (!trace_and_render_view()) break;
+      }
+      else if (!trace()) break;
+      if (m_trace_stream) m_trace_stream->push(m_traces.data(), m_frame);
+      if (!render(true, !fused)) break;
+      frame_ticks.push_back(SDL_GetPerformanceCounter()-t0);
+      uint64_t frame_checksum = traces_checksum();
+      checksum = (checksum ^ frame_checksum) * 1099511628211ull;
+      if (fp) fprintf(fp, "%d %016llx\n", log.m_frames-1, (unsigned long long)frame_checksum);
+    }
+    double seconds = double(SDL_GetPerformanceCounter()-start) / double(frequency);
+    if (fp) fclose(fp);
+    size_t n = frame_ticks.size();
+    std::sort(frame_ticks.begin(), frame_ticks.end());
+    auto ms = [&](double pct) {
+      return n ? 1000.0 * double(frame_ticks[size_t(pct/100.0 * (n-1) + 0.5)]) / double(frequency) : 0.0;
+    };
+    printf(
+      "Replayed %d frame(s) in %.3f sec (%.1f fps); per frame: median %.3f ms, p99 %.3f ms, max %.3f ms\n",
+      int(n), seconds, double(n)/std::max(seconds, 1e-9), ms(50), ms(99), ms(100)
+    );
+    printf("Traces checksum: %016llx\n", (unsigned long long)checksum);
+    if (checksum_file) printf("Wrote per-frame checksums to %s\n", checksum_file);
+    return true;
+  }
+
+#if RAYBOX_STATS
+  // Records this frame (from m_thisTime) in m_stats, given what the counters were at the start of it.
+  // Idle frames (i.e. not presented) are dropped:
+  void record_frame_stats(bool presented, uint64_t columns_before, uint64_t rays_before, uint64_t pixels_before) {
+    if (!presented) {
+      m_stats.begin_frame();
+      return;
+    }
+    uint64_t columns = m_columns_traced + m_columns_reused - columns_before;
+    if (columns) m_stats.record_traces(m_traces.data(), m_view_width, int(playerX), int(playerY));
+    m_stats.m_frame[STAT_COLUMNS] = double(columns);
+    m_stats.m_frame[STAT_RAYS] = double(m_rays_cast - rays_before);
+    m_stats.m_frame[STAT_PIXELS] = double(m_pixels_written - pixels_before);
+    m_stats.add_ticks(STAT_FRAME, SDL_GetPerformanceCounter() - m_thisTime);
+    m_stats.end_frame();
+  }
+
+  // Digits (and '.') for render_stats_overlay(), 3x5 pixels each, top row in the top 3 bits:
+  static int stats_glyph(char c) {
+    static const int digits[10] = {
+      075557, 026227, 071747, 071717, 055711, 074717, 074757, 071111, 075757, 075717
+    };
+    if (c >= '0' && c <= '9') return digits[c-'0'];
+    if (c == '.') return 000002;
+    return 0;
+  }
+
+  void stats_rect(int x, int y, int w, int h, uint32_t color) {
+    int x1 = std::min(x+w, m_view_width), y1 = std::min(y+h, m_view_height);
+    for (int yy=std::max(y, 0); yy<y1; ++yy) {
+      for (int xx=std::max(x, 0); xx<x1; ++xx) T(m_fb, xx, yy) = color;
+    }
+  }
+
+  void stats_text(int x, int y, const char *text, uint32_t color) {
+    for (; *text; ++text, x+=4) {
+      int g = stats_glyph(*text);
+      for (int row=0; row<5; ++row) {
+        for (int col=0; col<3; ++col) {
+          if (g & (1 << ((4-row)*3 + (2-col)))) stats_rect(x+col, y+row, 1, 1, color);
+        }
+      }
+    }
+  }
+
+  // Held down with the ` key (or always on, with --stats-overlay), this shows (top-right):
+  // - For each stage (in the order of STAT_*, ending with the whole frame), a bar up to its median
+  //   time over the last RayboxStats::HISTORY frames, extended in a darker colour up to the 99th
+  //   percentile, a white tick at the worst, and the 99th percentile in ms. The red line is the budget.
+  // - Each of those frames' times (red if it went over budget), oldest on the left.
+  // - The histogram of DDA steps per ray, in powers of 2, and the worst any ray took (at 99th
+  //   percentile, over the frames).
+  bool render_stats_overlay() {
+    static const uint32_t colors[STAT_TIMERS] = {
+      0xff8080ff, 0xff80c0ff, 0xffff8040, 0xff60c060, 0xff40ff40, 0xff40c0c0, 0xffc0c040, 0xffff40ff, 0xffc080ff, 0xffffffff
+    };
+    const int bar = 160;              // Pixels for the whole budget.
+    const int w = RayboxStats::HISTORY*2; // Room for going over (up to 5/4 of the budget), the label, and the frame times.
+    const int x0 = m_view_width - w - 8;
+    int y = 8;
+    m_fb_view_current = false;
+    m_fb_presented = false;
+    if (!m_stats.frames_kept()) return true;
+    const double budget = m_stats.m_budget_ms;
+    char text[32];
+    stats_rect(x0-4, y-4, w+8, STAT_TIMERS*10 + 48 + 48 + 16, 0xff000000);
+    for (int s=0; s<STAT_TIMERS; ++s, y+=10) {
+      double p50 = m_stats.percentile(s, 50), p99 = m_stats.percentile(s, 99), most = m_stats.percentile(s, 100);
+      int w50 = std::min(int(p50/budget*bar), bar*5/4);
+      int w99 = std::min(int(p99/budget*bar), bar*5/4);
+      int wmax = std::min(int(most/budget*bar), bar*5/4);
+      stats_rect(x0, y, w99, 8, (colors[s] >> 1) & 0xff7f7f7f);
+      stats_rect(x0, y, w50, 8, colors[s]);
+      stats_rect(x0+wmax, y, 1, 8, 0xffffffff);
+      snprintf(text, sizeof(text), "%.2f", p99);
+      stats_text(x0 + bar*5/4 + 4, y+2, text, colors[s]);
+    }
+    stats_rect(x0+bar, 8, 1, STAT_TIMERS*10, 0xffff0000);
+    // Frame times, scaled so the budget is 32 pixels high:
+    y += 44;
+    int n = m_stats.frames_kept();
+    for (int age=0; age<n; ++age) {
+      double ms = m_stats.recent(age, STAT_FRAME);
+      int h = std::min(int(ms/budget*32), 44);
+      stats_rect(x0 + (n-1-age)*2, y-h, 2, h, (ms > budget) ? 0xffff4040 : 0xff40c040);
+    }
+    stats_rect(x0, y-32, RayboxStats::HISTORY*2, 1, 0xffff0000);
+    // DDA steps per ray:
+    uint64_t dda[RayboxStats::DDA_BUCKETS] = {}, peak = 1;
+    for (int i=0; i<n; ++i) {
+      for (int b=0; b<RayboxStats::DDA_BUCKETS; ++b) dda[b] += m_stats.m_history_dda[i][b];
+    }
+    for (int b=0; b<RayboxStats::DDA_BUCKETS; ++b) peak = std::max(peak, dda[b]);
+    y += 48;
+    for (int b=0; b<RayboxStats::DDA_BUCKETS; ++b) {
+      int h = int(40*dda[b]/peak);
+      stats_rect(x0 + b*16, y-h, 14, h, 0xffffc040);
+    }
+    snprintf(text, sizeof(text), "%.0f", m_stats.percentile(STAT_DDA_MAX, 99));
+    stats_text(x0 + RayboxStats::DDA_BUCKETS*16 + 4, y-6, text, 0xffffc040);
+    return true;
+  }
+#endif // RAYBOX_STATS
+
+  void print_present_stats() {
+    uint64_t frames = m_present_stats.frames;
+    if (!frames) return;
+    printf(
+      "Presented %llu frame(s) with %s: %.3f ms copying into the texture, %.3f ms latency (finished to presented) per frame\n",
+      (unsigned long long)frames, present_mode_name(m_present_mode),
+      1000.0 * double(m_present_stats.copy_ticks) / double(frames) / double(m_frequency),
+      1000.0 * double(m_present_stats.latency_ticks) / double(frames) / double(m_frequency)
+    );
+    std::lock_guard<std::mutex> lock(m_input_latency.mutex);
+    const std::vector<double> &spread = m_input_latency.spread, &presses = m_input_latency.presses;
+    printf(
+      "Input latency (input to presented)%s: p50 %.1f ms, p90 %.1f ms, p99 %.1f ms",
+      m_late_input ? " with --late-input" : "",
+      input_latency_t::percentile(spread, 50), input_latency_t::percentile(spread, 90), input_latency_t::percentile(spread, 99)
+    );
+    if (m_input_latency.press_count) {
+      printf(
+        "; %d key press(es): p50 %.1f ms, p99 %.1f ms",
+        m_input_latency.press_count, input_latency_t::percentile(presses, 50), input_latency_t::percentile(presses, 99)
+      );
+    }
+    printf("\n");
+  }
+
+};
+
+
+// Headless benchmark: Drives the camera along a few deterministic scripted paths
+// over the loaded map, timing each stage of the frame separately (i.e. without
+// any of the vsync/present/input noise that the FPS counter in run() includes).
+class RayboxBench {
+public:
+
+  // Per-frame timings of each stage, in nanoseconds:
+  struct stage_samples_t {
+    const char *name;
+    const char *unit;   // "ns/ray", "ns/frame", "ns/obs" or "ns/load".
+    int divisor;        // Samples are divided by this to get the unit above.
+    std::vector<uint64_t> ns;
+  };
+
+  struct path_result_t {
+    const char *name;
+    std::vector<stage_samples_t> stages;
+    uint64_t columns_traced, columns_reused; // By the "trace" stage (see RayboxSystem::trace_mode())...
+    uint64_t rays_cast;                      // ...and the rays it actually traced.
+  };
+
+  RayboxSystem &m_sys;
+  int m_frames;   // Measured frames per path.
+  int m_warmup;   // Unmeasured frames run at the start of each path.
+  uint64_t m_frequency;
+  uint32_t m_rng;
+  std::vector<path_result_t> m_results;
+  bool m_backends;        // Also time trace() with each numeric backend?
+  bool m_layouts;         // Also time trace() with each map layout?
+  RayboxMap m_layout_maps[MAP_LAYOUT_COUNT];
+  bool m_accel;           // Also time trace() with and without empty-space skipping (scalar only)?
+  uint64_t m_accel_iterations[2]; // Total DDA iterations for trace[plain] and trace[accel]...
+  uint64_t m_accel_cells;         // ...and the cells their rays passed through (the same for both).
+  uint64_t m_accel_rays;
+  bool m_verify;          // Check every frame against the reference (serial, unoptimised) path?
+  int m_verify_failures;  // Frames where the optimised output didn't match the reference.
+  std::vector<traced_column_t> m_ref_traces;
+  std::vector<uint8_t> m_ref_fb;
+  bool m_render;          // Also time render_walls() in each RENDER_* mode?
+  uint64_t m_render_pixels[RENDER_MODE_COUNT]; // Pixels written by each mode (RENDER_OVERDRAW being
+  uint64_t m_render_ns[RENDER_MODE_COUNT];     // render_backdrop() + render_view()), the time taken,
+  uint64_t m_render_frames[RENDER_MODE_COUNT]; // and the frames drawn.
+  bool m_views;           // Also time trace() and render_walls() with the specialised and generic view_shape_t?
+  bool m_ray_table;       // Also time trace() with the ray table (see RayboxRayTable) and without it?
+  bool m_textures;        // Also time render_walls() with flat and textured walls (see RayboxTextures)?
+  bool m_floors;          // Also time render_walls() with flat and textured floors (see render_floors())?
+
+  RayboxBench(RayboxSystem &sys, int frames) : m_sys(sys) {
+    m_frames = frames;
+    m_warmup = 16;
+    m_backends = false;
+    m_layouts = false;
+    m_accel = false;
+    m_accel_iterations[0] = m_accel_iterations[1] = 0;
+    m_accel_cells = 0;
+    m_accel_rays = 0;
+    m_verify = false;
+    m_verify_failures = 0;
+    m_render = false;
+    m_views = false;
+    m_ray_table = false;
+    m_textures = false;
+    m_floors = false;
+    for (int m = 0; m < RENDER_MODE_COUNT; ++m) m_render_pixels[m] = m_render_ns[m] = m_render_frames[m] = 0;
+    m_frequency = SDL_GetPerformanceFrequency();
+    m_rng = 1;
+  }
+
+  // Deterministic LCG, so every run walks the same path:
+  uint32_t rand_next() {
+    m_rng = m_rng*1664525u + 1013904223u;
+    return m_rng>>8;
+  }
+
+  num rand_unit() { return num(rand_next() & 0xffff) / num(0x10000); } // [0,1)
+
+  bool is_open(num x, num y) {
+    if (x < 0 || y < 0 || !m_sys.m_map.in_bounds(int(x), int(y))) return false;
+    return 0 == m_sys.m_map.cell(int(x), int(y));
+  }
+
+  // Put the camera back at the map's (last) player start, facing north:
+  void reset_camera() {
+    m_sys.reset_player();
+    m_sys.headingX = 0;
+    m_sys.headingY = -1;
+    m_sys.viewX = m_sys.viewMag;
+    m_sys.viewY = 0;
+    m_sys.m_turn_accum = 0;
+    m_sys.snap_heading();
+    m_rng = 1;
+  }
+
+  // Spin in place, doing one full revolution over the course of the run:
+  void step_spin(int) {
+    m_sys.rotate(2.0*PI/num(m_frames+m_warmup));
+  }
+
+  // Run forward until we're about to hit a wall, then turn 90deg towards
+  // whichever side is open (or turn around if it's a dead end):
+  void step_corridor(int) {
+    const num speed = 0.05;
+    const num margin = 0.3;
+    num hx = m_sys.headingX;
+    num hy = m_sys.headingY;
+    if (is_open(m_sys.playerX+hx*(speed+margin), m_sys.playerY+hy*(speed+margin))) {
+      m_sys.playerX += hx*speed;
+      m_sys.playerY += hy*speed;
+      return;
+    }
+    // Blocked: Which way can we go? Note that rotate(+a) turns left.
+    if (is_open(m_sys.playerX+hy, m_sys.playerY-hx)) {
+      m_sys.rotate(PI/2.0);
+    }
+    else if (is_open(m_sys.playerX-hy, m_sys.playerY+hx)) {
+      m_sys.rotate(-PI/2.0);
+    }
+    else {
+      m_sys.rotate(PI);
+    }
+  }
+
+  // Wander with small random turns, bouncing off walls, and periodically
+  // teleport to a random open cell so that the whole map gets covered:
+  void step_random_walk(int frame) {
+    const num speed = 0.05;
+    if (frame % 250 == 249) {
+      for (int tries=0; tries<1000; ++tries) {
+        num x = int(rand_unit()*m_sys.m_map.m_width) + 0.5;
+        num y = int(rand_unit()*m_sys.m_map.m_height) + 0.5;
+        if (is_open(x, y)) {
+          m_sys.playerX = x;
+          m_sys.playerY = y;
+          break;
+        }
+      }
+    }
+    m_sys.rotate((rand_unit()-0.5)*0.1);
+    num nx = m_sys.playerX + m_sys.headingX*speed;
+    num ny = m_sys.playerY + m_sys.headingY*speed;
+    if (is_open(nx, ny)) {
+      m_sys.playerX = nx;
+      m_sys.playerY = ny;
+    }
+    else {
+      m_sys.rotate(PI/2.0 + rand_unit()*PI);
+    }
+  }
+
+  uint64_t elapsed_ns(uint64_t t0, uint64_t t1) {
+    return uint64_t(double(t1-t0) * 1.0e9 / double(m_frequency));
+  }
+
+  void run_path(const char *name, void (RayboxBench::*step)(int)) {
+    path_result_t result;
+    result.name = name;
+    result.columns_traced = result.columns_reused = result.rays_cast = 0;
+    result.stages.push_back({ "trace",           "ns/ray",   m_sys.m_view_width, {} });
+    result.stages.push_back({ "render_backdrop", "ns/frame", 1,          {} });
+    result.stages.push_back({ "render_view",     "ns/frame", 1,          {} });
+    result.stages.push_back({ "render_map",      "ns/frame", 1,          {} });
+    result.stages.push_back({ "render_walls",    "ns/frame", 1,          {} });
+    if (m_sys.parallel()) {
+      result.stages.push_back({ "trace_and_render_view", "ns/frame", 1, {} });
+    }
+    size_t backend_stages = result.stages.size();
+    if (m_backends) {
+      result.stages.push_back({ "trace[float]",  "ns/ray", m_sys.m_view_width, {} });
+      result.stages.push_back({ "trace[double]", "ns/ray", m_sys.m_view_width, {} });
+      result.stages.push_back({ "trace[fixed]",  "ns/ray", m_sys.m_view_width, {} });
+    }
+    size_t layout_stages = result.stages.size();
+    if (m_layouts) {
+      result.stages.push_back({ "trace[rowmajor32]", "ns/ray", m_sys.m_view_width, {} });
+      result.stages.push_back({ "trace[rowmajor8]",  "ns/ray", m_sys.m_view_width, {} });
+      result.stages.push_back({ "trace[tiled]",      "ns/ray", m_sys.m_view_width, {} });
+      result.stages.push_back({ "trace[morton]",     "ns/ray", m_sys.m_view_width, {} });
+    }
+    size_t accel_stages = result.stages.size();
+    if (m_accel) {
+      result.stages.push_back({ "trace[plain]", "ns/ray", m_sys.m_view_width, {} });
+      result.stages.push_back({ "trace[accel]", "ns/ray", m_sys.m_view_width, {} });
+    }
+    size_t render_stages = result.stages.size();
+    if (m_render) {
+      result.stages.push_back({ "render_walls[overdraw]", "ns/frame", 1, {} });
+      result.stages.push_back({ "render_walls[spans]",    "ns/frame", 1, {} });
+      result.stages.push_back({ "render_walls[rows]",     "ns/frame", 1, {} });
+    }
+    size_t view_stages = result.stages.size();
+    if (m_views) {
+      result.stages.push_back({ "trace[specialised]",        "ns/ray",   m_sys.m_view_width, {} });
+      result.stages.push_back({ "trace[generic]",            "ns/ray",   m_sys.m_view_width, {} });
+      result.stages.push_back({ "render_walls[specialised]", "ns/frame", 1,                  {} });
+      result.stages.push_back({ "render_walls[generic]",     "ns/frame", 1,                  {} });
+    }
+    size_t ray_table_stages = result.stages.size();
+    if (m_ray_table) {
+      result.stages.push_back({ "trace[computed]", "ns/ray", m_sys.m_view_width, {} });
+      result.stages.push_back({ "trace[table]",    "ns/ray", m_sys.m_view_width, {} });
+    }
+    size_t texture_stages = result.stages.size();
+    if (m_textures) {
+      result.stages.push_back({ "render_walls[flat]",     "ns/frame", 1, {} });
+      result.stages.push_back({ "render_walls[textured]", "ns/frame", 1, {} });
+    }
+    size_t floor_stages = result.stages.size();
+    if (m_floors) {
+      result.stages.push_back({ "render_walls[no_floors]", "ns/frame", 1, {} });
+      result.stages.push_back({ "render_walls[floors]",    "ns/frame", 1, {} });
+      result.stages.push_back({ "render_backdrop[floors]", "ns/frame", 1, {} });
+    }
+    for (stage_samples_t &stage : result.stages) stage.ns.reserve(m_frames);
+    reset_camera();
+    for (int frame = -m_warmup; frame < m_frames; ++frame) {
+      (this->*step)(frame+m_warmup);
+      uint64_t traced = m_sys.m_columns_traced, reused = m_sys.m_columns_reused, rays = m_sys.m_rays_cast;
+      uint64_t t0 = SDL_GetPerformanceCounter();
+      m_sys.trace();
+      uint64_t t1 = SDL_GetPerformanceCounter();
+      if (frame >= 0) {
+        result.columns_traced += m_sys.m_columns_traced - traced;
+        result.columns_reused += m_sys.m_columns_reused - reused;
+        result.rays_cast += m_sys.m_rays_cast - rays;
+      }
+      uint64_t pixels = m_sys.m_pixels_written;
+      m_sys.render_backdrop();
+      uint64_t t2 = SDL_GetPerformanceCounter();
+      m_sys.render_view();
+      uint64_t t3 = SDL_GetPerformanceCounter();
+      if (frame >= 0) count_render(RENDER_OVERDRAW, pixels, t1, t3);
+      m_sys.render_map();
+      uint64_t t4 = SDL_GetPerformanceCounter();
+      if (m_verify) verify_map(name, frame);
+      pixels = m_sys.m_pixels_written;
+      uint64_t t8 = SDL_GetPerformanceCounter(); // (After verify_map(), which render_walls mustn't be billed for.)
+      m_sys.render_walls();
+      uint64_t t7 = SDL_GetPerformanceCounter();
+      if (frame >= 0 && m_sys.m_render_mode != RENDER_OVERDRAW) count_render(m_sys.m_render_mode, pixels, t8, t7);
+      if (m_render) {
+        int render_mode = m_sys.m_render_mode;
+        for (int m = 0; m < RENDER_MODE_COUNT; ++m) {
+          m_sys.m_render_mode = m;
+          pixels = m_sys.m_pixels_written;
+          uint64_t r0 = SDL_GetPerformanceCounter();
+          m_sys.render_walls();
+          uint64_t r1 = SDL_GetPerformanceCounter();
+          if (frame < 0) continue;
+          result.stages[render_stages+m].ns.push_back(elapsed_ns(r0, r1));
+          count_render(m, pixels, r0, r1);
+        }
+        m_sys.m_render_mode = render_mode;
+      }
+      if (m_verify) verify_frame(name, frame);
+      // The stages below trace the same camera again, which mustn't be skipped as unchanged:
+      int reuse = m_sys.m_reuse;
+      m_sys.m_reuse = 0;
+      uint64_t t5 = 0, t6 = 0;
+      if (m_sys.parallel()) {
+        t5 = SDL_GetPerformanceCounter();
+        m_sys.trace_and_render_view();
+        t6 = SDL_GetPerformanceCounter();
+        if (m_verify && memcmp(m_ref_fb.data(), m_sys.m_fb, m_sys.fb_size())) {
+          if (m_verify_failures < 10) printf("VERIFY FAILED: %s frame %d: trace_and_render_view framebuffer\n", name, frame);
+          ++m_verify_failures;
+        }
+      }
+      if (m_backends) {
+        int backend = m_sys.m_backend;
+        for (int b = BACKEND_FLOAT; b <= BACKEND_FIXED; ++b) {
+          m_sys.m_backend = b;
+          uint64_t b0 = SDL_GetPerformanceCounter();
+          m_sys.trace();
+          uint64_t b1 = SDL_GetPerformanceCounter();
+          if (frame >= 0) result.stages[backend_stages+b].ns.push_back(elapsed_ns(b0, b1));
+        }
+        m_sys.m_backend = backend;
+      }
+      if (m_layouts) {
+        for (int l = 0; l < MAP_LAYOUT_COUNT; ++l) {
+          std::swap(m_sys.m_map, m_layout_maps[l]);
+          uint64_t l0 = SDL_GetPerformanceCounter();
+          m_sys.trace();
+          uint64_t l1 = SDL_GetPerformanceCounter();
+          std::swap(m_sys.m_map, m_layout_maps[l]);
+          if (frame >= 0) result.stages[layout_stages+l].ns.push_back(elapsed_ns(l0, l1));
+        }
+      }
+      if (m_accel) {
+        int accel = m_sys.m_accel;
+        int simd_lanes = m_sys.m_simd_lanes;
+        m_sys.m_simd_lanes = SIMD_OFF; // Only the scalar tracer counts DDA iterations.
+        for (int a = 0; a < 2; ++a) {
+          m_sys.m_accel = a;
+          m_sys.m_dda_iterations = 0;
+          m_sys.m_dda_cells = 0;
+          uint64_t a0 = SDL_GetPerformanceCounter();
+          m_sys.trace();
+          uint64_t a1 = SDL_GetPerformanceCounter();
+          if (frame < 0) continue;
+          result.stages[accel_stages+a].ns.push_back(elapsed_ns(a0, a1));
+          if (m_verify && !a) m_ref_traces = m_sys.m_traces;
+          if (m_verify && a) verify_accel(name, frame);
+          m_accel_iterations[a] += m_sys.m_dda_iterations;
+          if (a) m_accel_cells += m_sys.m_dda_cells;
+        }
+        if (frame >= 0) m_accel_rays += m_sys.m_view_width;
+        m_sys.m_accel = accel;
+        m_sys.m_simd_lanes = simd_lanes;
+      }
+      if (m_views) {
+        int variant = m_sys.m_view_variant;
+        for (int i = 0; i < 2; ++i) {
+          int g = i ^ (frame & 1); // (Alternate which goes first, as that one tends to come out faster.)
+          m_sys.m_view_variant = g ? VIEW_GENERIC : variant;
+          uint64_t v0 = SDL_GetPerformanceCounter();
+          m_sys.trace();
+          uint64_t v1 = SDL_GetPerformanceCounter();
+          m_sys.render_walls();
+          uint64_t v2 = SDL_GetPerformanceCounter();
+          if (m_verify && g) {
+            // Both should have traced and drawn exactly the same as the main stages did:
+            if (memcmp(m_ref_traces.data(), m_sys.m_traces.data(), m_sys.m_view_width*sizeof(traced_column_t)) ||
+                memcmp(m_ref_fb.data(), m_sys.m_fb, m_sys.fb_size())) {
+              if (m_verify_failures < 10) printf("VERIFY FAILED: %s frame %d: generic view\n", name, frame);
+              ++m_verify_failures;
+            }
+          }
+          if (frame < 0) continue;
+          result.stages[view_stages+g].ns.push_back(elapsed_ns(v0, v1));
+          result.stages[view_stages+2+g].ns.push_back(elapsed_ns(v1, v2));
+        }
+        m_sys.m_view_variant = variant;
+      }
+      if (m_ray_table) {
+        int angles = m_sys.m_ray_angles;
+        for (int i = 0; i < 2; ++i) {
+          int t = i ^ (frame & 1);
+          m_sys.m_ray_angles = t ? angles : 0;
+          uint64_t r0 = SDL_GetPerformanceCounter();
+          m_sys.trace();
+          uint64_t r1 = SDL_GetPerformanceCounter();
+          if (m_verify && memcmp(m_ref_traces.data(), m_sys.m_traces.data(), m_sys.m_view_width*sizeof(traced_column_t))) {
+            if (m_verify_failures < 10) printf("VERIFY FAILED: %s frame %d: trace[%s]\n", name, frame, t ? "table" : "computed");
+            ++m_verify_failures;
+          }
+          if (frame >= 0) result.stages[ray_table_stages+t].ns.push_back(elapsed_ns(r0, r1));
+        }
+        m_sys.m_ray_angles = angles;
+      }
+      if (m_textures) {
+        bool textured = m_sys.m_textured;
+        for (int i = 0; i < 2; ++i) {
+          int t = i ^ (frame & 1);
+          m_sys.m_textured = t;
+          uint64_t x0 = SDL_GetPerformanceCounter();
+          m_sys.render_walls();
+          uint64_t x1 = SDL_GetPerformanceCounter();
+          if (m_verify && t) {
+            // Textured walls are drawn the same way whatever the render mode, so compare with the reference path's:
+            m_ref_fb.assign(m_sys.m_fb, m_sys.m_fb+m_sys.fb_size());
+            m_sys.m_reference = true;
+            m_sys.render_walls();
+            m_sys.m_reference = false;
+            if (memcmp(m_ref_fb.data(), m_sys.m_fb, m_sys.fb_size())) {
+              if (m_verify_failures < 10) printf("VERIFY FAILED: %s frame %d: textured walls\n", name, frame);
+              ++m_verify_failures;
+            }
+          }
+          if (frame >= 0) result.stages[texture_stages+t].ns.push_back(elapsed_ns(x0, x1));
+        }
+        m_sys.m_textured = textured;
+      }
+      if (m_floors) {
+        bool floors = m_sys.m_floors;
+        for (int i = 0; i < 2; ++i) {
+          int f = i ^ (frame & 1);
+          m_sys.m_floors = f;
+          uint64_t f0 = SDL_GetPerformanceCounter();
+          m_sys.render_walls();
+          uint64_t f1 = SDL_GetPerformanceCounter();
+          if (frame >= 0) result.stages[floor_stages+f].ns.push_back(elapsed_ns(f0, f1));
+        }
+        // The floors on their own, i.e. drawn around the walls rather than along with them:
+        m_sys.m_floors = true;
+        uint64_t f2 = SDL_GetPerformanceCounter();
+        m_sys.render_backdrop();
+        uint64_t f3 = SDL_GetPerformanceCounter();
+        m_sys.render_view();
+        if (frame >= 0) result.stages[floor_stages+2].ns.push_back(elapsed_ns(f2, f3));
+        if (m_verify) {
+          m_ref_fb.assign(m_sys.m_fb, m_sys.m_fb+m_sys.fb_size());
+          m_sys.render_walls();
+          bool ok = !memcmp(m_ref_fb.data(), m_sys.m_fb, m_sys.fb_size());
+          m_sys.m_reference = true;
+          m_sys.render_walls();
+          m_sys.m_reference = false;
+          if (!ok || memcmp(m_ref_fb.data(), m_sys.m_fb, m_sys.fb_size())) {
+            if (m_verify_failures < 10) printf("VERIFY FAILED: %s frame %d: floors\n", name, frame);
+            ++m_verify_failures;
+          }
+        }
+        m_sys.m_floors = floors;
+      }
+      m_sys.m_reuse = reuse;
+      if (frame < 0) continue; // Warming up.
+      result.stages[0].ns.push_back(elapsed_ns(t0, t1));
+      result.stages[1].ns.push_back(elapsed_ns(t1, t2));
+      result.stages[2].ns.push_back(elapsed_ns(t2, t3));
+      result.stages[3].ns.push_back(elapsed_ns(t3, t4));
+      result.stages[4].ns.push_back(elapsed_ns(t8, t7));
+      if (m_sys.parallel()) result.stages[5].ns.push_back(elapsed_ns(t5, t6));
+    }
+    m_results.push_back(result);
+  }
+
+  // Compare leaping with stepping (in m_ref_traces): Leaping only skips map reads, so the traces
+  // must be bit-identical, whatever the backend:
+  void verify_accel(const char *path, int frame) {
+    if (memcmp(m_ref_traces.data(), m_sys.m_traces.data(), m_sys.m_view_width*sizeof(traced_column_t))) {
+      if (m_verify_failures < 10) printf("VERIFY FAILED: %s frame %d: trace[accel]\n", path, frame);
+      ++m_verify_failures;
+    }
+  }
+
+  // Adds one frame drawn by the given RENDER_* mode, from the given m_pixels_written and timestamps:
+  void count_render(int mode, uint64_t pixels_before, uint64_t t0, uint64_t t1) {
+    m_render_pixels[mode] += m_sys.m_pixels_written - pixels_before;
+    m_render_ns[mode] += elapsed_ns(t0, t1);
+    ++m_render_frames[mode];
+  }
+
+  // Framebuffer bytes written per frame by the given RENDER_* mode...
+  double render_bytes_per_frame(int mode) {
+    return 4.0 * double(m_render_pixels[mode]) / double(std::max<uint64_t>(1, m_render_frames[mode]));
+  }
+
+  // ...and how fast, in GB/s:
+  double render_gb_per_sec(int mode) {
+    return 4.0 * double(m_render_pixels[mode]) / double(std::max<uint64_t>(1, m_render_ns[mode]));
+  }
+
+  // Redo the current frame (without the map overlay) via the reference path, and make
+  // sure the traces and framebuffer come out bit-identical to the optimised path (which,
+  // with reuse on, keeps whatever this frame's trace() got from the last frame):
+  void verify_frame(const char *path, int frame) {
+    m_sys.trace();
+    m_sys.render_walls();
+    m_ref_traces = m_sys.m_traces;
+    m_ref_fb.assign(m_sys.m_fb, m_sys.m_fb+m_sys.fb_size());
+    m_sys.m_reference = true;
+    m_sys.trace();
+    m_sys.render_backdrop();
+    m_sys.render_view();
+    m_sys.m_reference = false;
+    bool traces_ok = !memcmp(m_ref_traces.data(), m_sys.m_traces.data(), m_sys.m_view_width*sizeof(traced_column_t));
+    bool fb_ok = !memcmp(m_ref_fb.data(), m_sys.m_fb, m_sys.fb_size());
+    if (!traces_ok || !fb_ok) {
+      if (m_verify_failures < 10) {
+        printf("VERIFY FAILED: %s frame %d:%s%s\n", path, frame, traces_ok ? "" : " traces", fb_ok ? "" : " framebuffer");
+      }
+      ++m_verify_failures;
+    }
+  }
+
+  // Draw the map overlay again via the reference path (i.e. from the map itself, rather than
+  // the cached layer), over what render_map() just drew, and make sure nothing changes:
+  void verify_map(const char *path, int frame) {
+    m_ref_fb.assign(m_sys.m_fb, m_sys.m_fb+m_sys.fb_size());
+    m_sys.m_reference = true;
+    m_sys.render_map();
+    m_sys.m_reference = false;
+    if (memcmp(m_ref_fb.data(), m_sys.m_fb, m_sys.fb_size())) {
+      if (m_verify_failures < 10) printf("VERIFY FAILED: %s frame %d: map overlay\n", path, frame);
+      ++m_verify_failures;
+    }
+  }
+
+  // Runs each path, tracing every frame with both the float and fixed-point backends,
+  // and reports every column where the captured height or side (i.e. what the verilog
+  // code would see, per capture_traces()) differs between them. If csv_file is given,
+  // each mismatch is written to it.
+  int run_trace_diff(const char *csv_file) {
+    struct { const char *name; void (RayboxBench::*step)(int); } paths[] = {
+      { "spin",        &RayboxBench::step_spin },
+      { "corridor",    &RayboxBench::step_corridor },
+      { "random_walk", &RayboxBench::step_random_walk },
+    };
+    FILE *fp = NULL;
+    if (csv_file) {
+      fp = fopen(csv_file, "wb");
+      if (!fp) {
+        printf("ERROR: Failed to open trace diff output file: %s\n", csv_file);
+        return -1;
+      }
+      fprintf(fp, "path,frame,column,float_height,fixed_height,float_side,fixed_side\n");
+    }
+    printf("Comparing float vs. fixed (Q%d.%d) traces over %d frames per path...\n",
+      RAYBOX_FIXED_INT_BITS, RAYBOX_FIXED_FRAC_BITS, m_frames);
+    int backend = m_sys.m_backend;
+    int total_mismatches = 0;
+    for (auto &path : paths) {
+      int height_mismatches = 0, side_mismatches = 0, max_height_delta = 0;
+      reset_camera();
+      for (int frame = 0; frame < m_frames; ++frame) {
+        (this->*path.step)(frame);
+        m_sys.m_backend = BACKEND_FLOAT;
+        m_sys.trace();
+        m_ref_traces = m_sys.m_traces;
+        m_sys.m_backend = BACKEND_FIXED;
+        m_sys.trace();
+        for (int x=0; x<m_sys.m_view_width; ++x) {
+          int fh = capture_height(m_ref_traces[x], m_sys.m_view_height);
+          int xh = capture_height(m_sys.m_traces[x], m_sys.m_view_height);
+          int fs = m_ref_traces[x].side;
+          int xs = m_sys.m_traces[x].side;
+          if (fh == xh && fs == xs) continue;
+          if (fh != xh) ++height_mismatches;
+          if (fs != xs) ++side_mismatches;
+          max_height_delta = std::max(max_height_delta, abs(fh-xh));
+          if (fp) fprintf(fp, "%s,%d,%d,%d,%d,%d,%d\n", path.name, frame, x, fh, xh, fs, xs);
+        }
+      }
+      printf(
+        "%-12s %d columns: %d height mismatch(es) (max delta %d), %d side mismatch(es)\n",
+        path.name, m_frames*m_sys.m_view_width, height_mismatches, max_height_delta, side_mismatches
+      );
+      total_mismatches += height_mismatches + side_mismatches;
+    }
+    m_sys.m_backend = backend;
+    if (fp) {
+      fclose(fp);
+      printf("Wrote trace mismatches to %s\n", csv_file);
     }
-    return true;
+    return total_mismatches;
   }
 
-  void rotate(num a) {
-    num nx, ny;
-    num ca = cos(a);
-    num sa = sin(a);
-    // Rotate direction vector:
-    nx =  headingX*ca + headingY*sa;
-    ny = -headingX*sa + headingY*ca;
-    headingX = nx;
-    headingY = ny;
-    // Generate viewplane vector:
-    viewX = -headingY * viewMag;
-    viewY =  headingX * viewMag;
-    // // Rotate viewplane vector:
-    // nx =  viewX*ca + viewY*sa;
-    // ny = -viewX*sa + viewY*ca;
-    // viewX = nx;
-    // viewY = ny;
+  // Returns the given percentile (0..100) of the samples, in the stage's unit.
+  //NOTE: This sorts the samples in place.
+  static double percentile(stage_samples_t &stage, double pct) {
+    std::vector<uint64_t> &v = stage.ns;
+    if (v.empty()) return 0;
+    std::sort(v.begin(), v.end());
+    size_t i = size_t(pct/100.0 * (v.size()-1) + 0.5);
+    return double(v[i]) / double(stage.divisor);
   }
 
-  bool render(bool real_render=true) {
-    if (real_render) {
-      if (!render_backdrop()) return false;
-      // if (!render_random(50, 50, 50, 50)) return false;
-      if (!render_view()) return false;
-      if (m_show_map_overlay && !render_map()) return false;
-      SDL_UpdateTexture(m_texture, NULL, m_fb, VIEW_WIDTH*4);
-      SDL_RenderCopy(m_renderer, m_texture, NULL, NULL);
-      SDL_RenderPresent(m_renderer);
+  // Times loading map_file, and then tracing and drawing the first frame (which is when a
+  // memory-mapped map's pages actually get read), both cold (with the file dropped from the
+  // OS's cache first) and warm. Each is done `runs` times.
+  bool run_map_load(const char *map_file, int runs) {
+    printf("Timing %d cold and %d warm load(s) of %s...\n", runs, runs, map_file);
+    path_result_t result;
+    result.name = "map_load";
+    result.columns_traced = result.columns_reused = result.rays_cast = 0;
+    result.stages.push_back({ "load[cold]",        "ns/load", 1, {} });
+    result.stages.push_back({ "first_frame[cold]", "ns/load", 1, {} });
+    result.stages.push_back({ "load[warm]",        "ns/load", 1, {} });
+    result.stages.push_back({ "first_frame[warm]", "ns/load", 1, {} });
+    for (int run = 0; run < runs*2; ++run) {
+      int warm = run >= runs;
+      m_sys.m_map = RayboxMap(); // (Drop the last one, including any mapping of the file.)
+      if (!warm) {
+        RayboxMappedFile::evict(map_file);
+      }
+      else if (run == runs) {
+        // Read it all once, so that every page is cached:
+        FILE *fp = fopen(map_file, "rb");
+        static char buffer[1<<20];
+        while (fp && fread(buffer, 1, sizeof(buffer), fp) > 0) {}
+        if (fp) fclose(fp);
+      }
+      uint64_t t0 = SDL_GetPerformanceCounter();
+      if (!m_sys.load_map(map_file)) return false;
+      uint64_t t1 = SDL_GetPerformanceCounter();
+      m_sys.trace();
+      m_sys.render_walls();
+      uint64_t t2 = SDL_GetPerformanceCounter();
+      result.stages[warm*2+0].ns.push_back(elapsed_ns(t0, t1));
+      result.stages[warm*2+1].ns.push_back(elapsed_ns(t1, t2));
     }
-    ++m_frame;
+    m_results.push_back(result);
     return true;
   }
 
-  bool handle_input() {
-    const uint8_t *keys = SDL_GetKeyboardState(NULL);
-    m_show_map_overlay = keys[SDL_SCANCODE_TAB];
-    num ts = time_step()*3;
-    if (keys[SDL_SCANCODE_LEFT]) rotate(ts/3);
-    if (keys[SDL_SCANCODE_RIGHT]) rotate(-ts/3);
-    if (keys[SDL_SCANCODE_LSHIFT]) ts*=2;
-    if (keys[SDL_SCANCODE_W]) { playerX+=ts*headingX; playerY+=ts*headingY; }
-    if (keys[SDL_SCANCODE_S]) { playerX-=ts*headingX; playerY-=ts*headingY; }
-    if (keys[SDL_SCANCODE_A]) { playerX-=ts*viewX; playerY-=ts*viewY; }
-    if (keys[SDL_SCANCODE_D]) { playerX+=ts*viewX; playerY+=ts*viewY; }
-    return true;
+  // Times drawing 100, 1K and 10K sprites (see RayboxSystem::scatter_sprites()) on the random walk
+  // path, along with the whole frame, i.e. trace(), render_walls() and render_sprites():
+  void run_sprites() {
+    const int counts[] = { 100, 1000, 10000 };
+    const char *names[][2] = {
+      { "frame[100]", "render_sprites[100]" }, { "frame[1K]", "render_sprites[1K]" }, { "frame[10K]", "render_sprites[10K]" }
+    };
+    printf(
+      "Benchmarking %d frames per sprite count at %dx%d (%s trace/render core)...\n",
+      m_frames, m_sys.m_view_width, m_sys.m_view_height, view_variant_name(m_sys.m_view_variant)
+    );
+    path_result_t result;
+    result.name = "sprites";
+    result.columns_traced = result.columns_reused = result.rays_cast = 0;
+    for (int s = 0; s < 3; ++s) {
+      m_sys.scatter_sprites(counts[s]);
+      result.stages.push_back({ names[s][0], "ns/frame", 1, {} });
+      result.stages.push_back({ names[s][1], "ns/frame", 1, {} });
+      stage_samples_t &frame_stage = result.stages[s*2], &sprite_stage = result.stages[s*2+1];
+      uint64_t visible = 0;
+      reset_camera();
+      for (int frame = -m_warmup; frame < m_frames; ++frame) {
+        step_random_walk(frame+m_warmup);
+        uint64_t t0 = SDL_GetPerformanceCounter();
+        m_sys.trace();
+        m_sys.render_walls();
+        uint64_t t1 = SDL_GetPerformanceCounter();
+        m_sys.render_sprites();
+        uint64_t t2 = SDL_GetPerformanceCounter();
+        if (frame >= 0) {
+          frame_stage.ns.push_back(elapsed_ns(t0, t2));
+          sprite_stage.ns.push_back(elapsed_ns(t1, t2));
+          visible += m_sys.m_sprite_order.size();
+        }
+        if (m_verify) verify_sprites(names[s][1], frame);
+      }
+      printf("%6d sprites: %.1f visible per frame\n", int(m_sys.m_sprites.size()), double(visible)/std::max(1, m_frames));
+    }
+    m_sys.m_sprites.clear();
+    m_results.push_back(result);
+    if (m_verify) {
+      printf("Verify: %d frame(s) differed from the reference path\n", m_verify_failures);
+    }
   }
 
-  bool handle_events() {
-    SDL_Event e;
-    while (SDL_PollEvent(&e) == 1) {
-      if (SDL_QUIT == e.type) return false;
-      if (SDL_KEYDOWN == e.type) {
-        switch (e.key.keysym.sym) {
-          case SDLK_ESCAPE:
-            return false;
-          case SDLK_c:
-            m_capture_traces = true;
-            break;
-          case SDLK_m:
-            dump_map();
-            break;
+  // Draw the current frame again via the reference path (serial, with every sprite in front of
+  // the camera, sorted by std::stable_sort), and with trace_and_render_view() if that's used,
+  // and make sure they both come out the same as render_walls() + render_sprites() did:
+  void verify_sprites(const char *stage, int frame) {
+    m_ref_fb.assign(m_sys.m_fb, m_sys.m_fb+m_sys.fb_size());
+    m_sys.m_reference = true;
+    m_sys.render_walls();
+    m_sys.render_sprites();
+    m_sys.m_reference = false;
+    bool ok = !memcmp(m_ref_fb.data(), m_sys.m_fb, m_sys.fb_size());
+    if (ok && m_sys.parallel()) {
+      int reuse = m_sys.m_reuse;
+      m_sys.m_reuse = 0;
+      m_sys.trace_and_render_view();
+      m_sys.m_reuse = reuse;
+      ok = !memcmp(m_ref_fb.data(), m_sys.m_fb, m_sys.fb_size());
+    }
+    if (!ok) {
+      if (m_verify_failures < 10) printf("VERIFY FAILED: %s frame %d\n", stage, frame);
+      ++m_verify_failures;
+    }
+  }
+
+  // Random rays from open cells, in random (unit) directions. Half of them stop after 16 cells,
+  // like line-of-sight checks, and the rest go until they hit something:
+  void make_query_rays(std::vector<raybox_ray_t> &rays, size_t count) {
+    const RayboxMap &map = m_sys.m_map;
+    rays.resize(count);
+    for (size_t i = 0; i < count; ++i) {
+      num x = 0, y = 0;
+      for (int tries=0; tries<1000; ++tries) {
+        x = rand_unit()*map.m_width;
+        y = rand_unit()*map.m_height;
+        if (is_open(x, y)) break;
+      }
+      float a = float(rand_unit()*2.0*PI);
+      rays[i] = { float(x), float(y), std::cos(a), std::sin(a), (i & 1) ? 16.0f : INFINITY };
+    }
+  }
+
+  // Times RayboxQuery on batches of 1K, 100K and 10M random rays (see make_query_rays()), binned
+  // and unbinned, repeating the smaller batches so that each size traces at least 1M rays:
+  void run_queries() {
+    const size_t sizes[] = { 1000, 100000, 10000000 };
+    const char *names[][2] = { { "1K[binned]", "1K[unbinned]" }, { "100K[binned]", "100K[unbinned]" }, { "10M[binned]", "10M[unbinned]" } };
+    const size_t min_rays = 1000000;
+    RayboxQuery query(m_sys.m_threads);
+    query.m_accel = m_sys.use_accel();
+    printf(
+      "Timing ray queries on %d thread(s), %s empty-space skipping...\n",
+      query.m_threads, query.m_accel ? "with" : "without"
+    );
+    path_result_t result;
+    result.name = "queries";
+    result.columns_traced = result.columns_reused = result.rays_cast = 0;
+    std::vector<raybox_ray_t> rays;
+    std::vector<raybox_hit_t> hits;
+    m_rng = 1;
+    for (int s = 0; s < 3; ++s) {
+      size_t count = sizes[s];
+      make_query_rays(rays, count);
+      hits.resize(count);
+      int reps = int(std::max<size_t>(3, min_rays/count));
+      for (int sort = 1; sort >= 0; --sort) {
+        query.m_sort = sort;
+        query.m_sort_min = query.m_sort_map_bytes = 0; // (Bin everything, to see what it costs.)
+        stage_samples_t stage = { names[s][1-sort], "ns/ray", int(count), {} };
+        query.trace(m_sys.m_map, rays.data(), hits.data(), count); // Warm-up.
+        for (int r = 0; r < reps; ++r) {
+          uint64_t t0 = SDL_GetPerformanceCounter();
+          query.trace(m_sys.m_map, rays.data(), hits.data(), count);
+          stage.ns.push_back(elapsed_ns(t0, SDL_GetPerformanceCounter()));
         }
+        result.stages.push_back(stage);
+        printf("  %-16s %8.2f Mrays/s\n", stage.name, 1.0e3 / percentile(result.stages.back(), 50));
       }
     }
-    return true;
+    m_results.push_back(result);
+    if (m_verify) verify_queries(query);
   }
 
-  void debug_print() {
-    m_map.debug_print_map();
+  // Spin in place, and check that querying each column's ray (i.e. heading + view*cameraX, from
+  // the player) gets exactly what the reference path traced for that column:
+  void verify_queries(RayboxQuery &query) {
+    reset_camera();
+    const int width = m_sys.m_view_width;
+    const generic_view_t view = { width, m_sys.m_view_height };
+    std::vector<raybox_ray_t> rays(width);
+    std::vector<raybox_hit_t> hits(width);
+    int failures = 0;
+    query.m_sort_min = query.m_sort_map_bytes = 0;
+    for (int frame = 0; frame < m_frames; ++frame) {
+      m_sys.rotate(2.0*PI/num(m_frames));
+      m_sys.m_reference = true;
+      m_sys.trace();
+      m_sys.m_reference = false;
+      RayboxCamera cam = m_sys.camera();
+      for (int x = 0; x < width; ++x) {
+        float cameraX = view.camera_x<float>(x);
+        rays[x] = { cam.playerX, cam.playerY, cam.headingX + cam.viewX*cameraX, cam.headingY + cam.viewY*cameraX, INFINITY };
+      }
+      query.m_sort = frame & 1;
+      query.trace(m_sys.m_map, rays.data(), hits.data(), width);
+      for (int x = 0; x < width; ++x) {
+        const traced_column_t &t = m_sys.m_traces[x];
+        const raybox_hit_t &h = hits[x];
+        bool ok =
+          h.result == RAYBOX_RAY_WALL && h.side == t.side && h.color == t.color &&
+          h.mapX == t.mapX && h.mapY == t.mapY &&
+          !memcmp(&h.dist, &t.dist, sizeof(float)) && !memcmp(&h.hitX, &t.hx, sizeof(float)) && !memcmp(&h.hitY, &t.hy, sizeof(float));
+        if (!ok) {
+          if (failures < 10) printf("VERIFY FAILED: queries frame %d column %d\n", frame, x);
+          ++failures;
+        }
+      }
+    }
+    printf("Verify: %d column ray quer(ies) differed from the reference path\n", failures);
+    m_verify_failures += failures;
   }
 
-  num time_step() {
-    num t = num(m_thisTime-m_prevTime)/num(m_frequency);
-    return (t < 0.001) ? 0.001 : t;
+  // Random cameras in open cells, facing random ways, with the same FOV as the view:
+  void make_batch_cameras(std::vector<raybox_camera_t> &cams, size_t count) {
+    const RayboxMap &map = m_sys.m_map;
+    cams.resize(count);
+    for (size_t i = 0; i < count; ++i) {
+      num x = 0, y = 0;
+      for (int tries=0; tries<1000; ++tries) {
+        x = rand_unit()*map.m_width;
+        y = rand_unit()*map.m_height;
+        if (is_open(x, y)) break;
+      }
+      float a = float(rand_unit()*2.0*PI);
+      float hx = std::cos(a), hy = std::sin(a);
+      cams[i] = { float(x), float(y), hx, hy, float(-hy*m_sys.viewMag), float(hx*m_sys.viewMag) };
+    }
   }
 
-  // Dumps the lower-right 16x16 region of the map as a .hex file,
-  // for use as a test map "ROM" in the raybox verilog code.
-  //NOTE: This dumps each map cell as a byte, packed like this:
-  // 0b00RRGGBB - i.e. it only preserves the upper 2 bits of each
-  // map colour. Note also that this writes in column-row order
-  // (i.e. row 0, col 0..15 -- then row 1, col 0..15 -- etc).
-  void dump_map() {
-    FILE *fp = fopen("map_16x16.hex", "wb");
-    fprintf(fp, "@00000000\n");
-    int counter = 0;
-    for (int y=MAP_HEIGHT-16; y<MAP_HEIGHT; ++y) {
-      for (int x=MAP_WIDTH-16; x<MAP_WIDTH; ++x) {
-        uint32_t m = *m_map.cell(x, y);
-        uint8_t r = (m&0xc00000)>>18;
-        uint8_t g = (m&0xc000)>>12;
-        uint8_t b = (m&0xc0)>>6;
-        fprintf(fp, "%02X%c", r|g|b, counter%16==15 ? '\n' : ' ');
-        ++counter;
+  // Times RayboxBatchRenderer rendering 1, 64 and 1024 cameras' views at once (see
+  // make_batch_cameras()), at 64x48 and 160x120, repeating the smaller batches so that each size
+  // renders at least 64K views:
+  void run_batch() {
+    const int sizes[][2] = { { 64, 48 }, { 160, 120 } };
+    const size_t counts[] = { 1, 64, 1024 };
+    const char *names[][3] = { { "64x48[1]", "64x48[64]", "64x48[1024]" }, { "160x120[1]", "160x120[64]", "160x120[1024]" } };
+    const size_t min_views = 65536;
+    RayboxBatchRenderer batch(m_sys.m_threads);
+    batch.m_accel = m_sys.use_accel();
+    printf(
+      "Timing batch rendering on %d thread(s), %s empty-space skipping...\n",
+      batch.m_threads, batch.m_accel ? "with" : "without"
+    );
+    path_result_t result;
+    result.name = "batch";
+    result.columns_traced = result.columns_reused = result.rays_cast = 0;
+    std::vector<raybox_camera_t> cams;
+    std::vector<uint32_t> out;
+    m_rng = 1;
+    make_batch_cameras(cams, counts[2]);
+    for (int v = 0; v < 2; ++v) {
+      const int w = sizes[v][0], h = sizes[v][1];
+      out.resize(counts[2]*w*h); // (Allocated up front, as it would be for a training loop.)
+      for (int c = 0; c < 3; ++c) {
+        const size_t count = counts[c];
+        int reps = int(std::max<size_t>(3, min_views/count));
+        stage_samples_t stage = { names[v][c], "ns/obs", int(count), {} };
+        batch.render(m_sys.m_map, cams.data(), count, w, h, out.data()); // Warm-up.
+        for (int r = 0; r < reps; ++r) {
+          uint64_t t0 = SDL_GetPerformanceCounter();
+          batch.render(m_sys.m_map, cams.data(), count, w, h, out.data());
+          stage.ns.push_back(elapsed_ns(t0, SDL_GetPerformanceCounter()));
+        }
+        result.stages.push_back(stage);
+        printf("  %-16s %10.0f obs/s\n", stage.name, 1.0e9 / percentile(result.stages.back(), 50));
       }
     }
-    fclose(fp);
-    printf("dump_map(): Wrote %s\n", "map_16x16.hex");
+    m_results.push_back(result);
+    if (m_verify) {
+      // At each of the sizes timed above (that fit in the framebuffer), and then at the view's own:
+      const int W = m_sys.m_view_width, H = m_sys.m_view_height;
+      const bool generic = (m_sys.m_view_variant == VIEW_GENERIC);
+      for (int v = 0; v < 2; ++v) {
+        if (sizes[v][0]*sizes[v][1] > W*H) continue;
+        m_sys.set_view(sizes[v][0], sizes[v][1]);
+        verify_batch(batch);
+      }
+      m_sys.set_view(W, H, generic);
+      verify_batch(batch);
+    }
   }
 
-  // Writes the current height & side values (that were last traced)
-  // to a .hex file that we can use for testing in the raybox verilog code.
-  void capture_traces() {
-    static int capture_count = 0;
-    char capture_filename[32];
-    sprintf(capture_filename, "traces_capture_%04d.hex", capture_count++);
-    FILE *fp = fopen(capture_filename, "wb");
-    fprintf(fp, "@00000000\n");
-    for (int x=0; x<VIEW_WIDTH; ++x) {
-      traced_column_t &col = m_traces[x];
-      int h = HEIGHT_FROM_DIST(col.dist);
-      uint8_t height = h<=240 ? h : 240;
-      uint8_t side = col.side;
-      fprintf(fp, "%02X %02X", height, side);
-      fprintf(fp, (x%8==7) ? "\n" : " "); // Every 16 (i.e. 8x2) byte, start a new line.
+  // Spin in place, rendering each frame's camera with the batch renderer (in batches of 64) at
+  // the current view size, and check that each one comes out exactly as the reference path drew it:
+  void verify_batch(RayboxBatchRenderer &batch) {
+    reset_camera();
+    const int W = m_sys.m_view_width, H = m_sys.m_view_height;
+    const size_t pixels = size_t(W)*H;
+    const int per_batch = 64;
+    std::vector<raybox_camera_t> cams(per_batch);
+    std::vector<uint32_t> out(per_batch*pixels);
+    int failures = 0;
+    for (int frame0 = 0; frame0 < m_frames; frame0 += per_batch) {
+      const int n = std::min(per_batch, m_frames-frame0);
+      for (int i = 0; i < n; ++i) {
+        m_sys.rotate(2.0*PI/num(m_frames));
+        RayboxCamera cam = m_sys.camera();
+        cams[i] = { cam.playerX, cam.playerY, cam.headingX, cam.headingY, cam.viewX, cam.viewY };
+      }
+      if (!batch.render(m_sys.m_map, cams.data(), n, W, H, out.data())) {
+        ++failures;
+        break;
+      }
+      // (This leaves the camera as it was after the batch's last rotate(), ready for the next batch.)
+      for (int i = 0; i < n; ++i) {
+        m_sys.playerX = cams[i].x;
+        m_sys.playerY = cams[i].y;
+        m_sys.headingX = cams[i].headingX;
+        m_sys.headingY = cams[i].headingY;
+        m_sys.viewX = cams[i].viewX;
+        m_sys.viewY = cams[i].viewY;
+        m_sys.m_reference = true;
+        m_sys.trace();
+        m_sys.render_walls();
+        m_sys.m_reference = false;
+        if (memcmp(m_sys.m_fb, &out[i*pixels], pixels*4)) {
+          if (failures < 10) printf("VERIFY FAILED: batch frame %d\n", frame0+i);
+          ++failures;
+        }
+      }
     }
-    fclose(fp);
-    printf("capture_traces(): Wrote %s\n", capture_filename);
+    printf("Verify: %d batch-rendered %dx%d view(s) differed from the reference path\n", failures, W, H);
+    m_verify_failures += failures;
   }
 
   void run() {
-    static uint64_t initial_time = SDL_GetPerformanceCounter();
-    bool quit = 0;
-    m_prevTime = SDL_GetPerformanceCounter();
-    m_frequency = SDL_GetPerformanceFrequency();
-    int frame_count = 0;
-    uint64_t fps_time = SDL_GetPerformanceCounter();
-    uint64_t fps_1sec = m_frequency;
+    if (m_layouts) {
+      for (int l = 0; l < MAP_LAYOUT_COUNT; ++l) m_layout_maps[l].copy_from(m_sys.m_map, l);
+    }
+    printf(
+      "Benchmarking %d frames per path at %dx%d (%s trace/render core)...\n",
+      m_frames, m_sys.m_view_width, m_sys.m_view_height, view_variant_name(m_sys.m_view_variant)
+    );
+    if (m_views && m_sys.m_view_variant == VIEW_GENERIC) {
+      printf("WARNING: There's no specialised trace/render core for this view size, so not comparing it with the generic one\n");
+      m_views = false;
+    }
+    run_path("spin",        &RayboxBench::step_spin);
+    run_path("corridor",    &RayboxBench::step_corridor);
+    run_path("random_walk", &RayboxBench::step_random_walk);
+    if (m_verify) {
+      printf("Verify: %d frame(s) differed from the reference path\n", m_verify_failures);
+    }
+    for (int m = 0; m < RENDER_MODE_COUNT; ++m) {
+      if (!m_render_frames[m]) continue;
+      printf(
+        "Framebuffer writes [%s]: %.2f MB/frame (%.2f per pixel), %.1f GB/s\n",
+        render_mode_name(m), render_bytes_per_frame(m)/1.0e6, render_bytes_per_frame(m)/m_sys.fb_size(),
+        render_gb_per_sec(m)
+      );
+    }
+    if (m_accel && m_accel_rays) {
+      printf(
+        "DDA: %.1f cells/ray; %.1f iterations/ray plain, %.1f with empty-space skipping (%.1f%% saved)\n",
+        double(m_accel_cells)/m_accel_rays,
+        double(m_accel_iterations[0])/m_accel_rays, double(m_accel_iterations[1])/m_accel_rays,
+        100.0 * (1.0 - double(m_accel_iterations[1])/double(std::max<uint64_t>(1, m_accel_iterations[0])))
+      );
+    }
+  }
 
-    while (!quit) {
-      m_thisTime = SDL_GetPerformanceCounter();
-      if (!handle_events()) break;
-      if (!handle_input()) break;
-      if (!trace()) break;
-      if (m_capture_traces) {
-        m_capture_traces = false;
-        capture_traces();
-      }
-      if (!render(true)) break;
-      ++frame_count;
-      uint64_t now = SDL_GetPerformanceCounter();
-      if (now-fps_time>=fps_1sec) {
-        // At least 1 second has elapsed. How many frames have we done?
-        uint64_t elapsed_time = now-initial_time;
+  void print_report() {
+    printf("%-12s %-22s %-9s %12s %12s %12s\n", "path", "stage", "unit", "min", "median", "p99");
+    for (path_result_t &path : m_results) {
+      for (stage_samples_t &stage : path.stages) {
         printf(
-          "[%6.2f sec] Current FPS: %.2f - Overall FPS: %.2f\n",
-          num(elapsed_time)/num(fps_1sec),
-          num(frame_count)/(num(now-fps_time)/num(fps_1sec)),
-          num(m_frame)/(num(elapsed_time)/num(fps_1sec))
+          "%-12s %-22s %-9s %12.1f %12.1f %12.1f\n",
+          path.name, stage.name, stage.unit,
+          percentile(stage, 0), percentile(stage, 50), percentile(stage, 99)
         );
-        fps_time = now;
-        frame_count = 0;
       }
-      
-      m_prevTime = m_thisTime;
     }
+    for (path_result_t &path : m_results) {
+      if (!path.columns_traced && !path.columns_reused) continue; // (e.g. run_map_load()).
+      printf(
+        "%-12s %.1f%% of columns reused from the last frame, rays cast for %.1f%% of columns\n",
+        path.name, reused_pct(path), rays_cast_pct(path)
+      );
+    }
+  }
+
+  static double reused_pct(const path_result_t &path) {
+    return 100.0 * double(path.columns_reused) / double(std::max<uint64_t>(1, path.columns_traced+path.columns_reused));
+  }
+
+  static double rays_cast_pct(const path_result_t &path) {
+    return 100.0 * double(path.rays_cast) / double(std::max<uint64_t>(1, path.columns_traced+path.columns_reused));
+  }
+
+  bool write_json(const char *filename) {
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+      printf("ERROR: Failed to open benchmark output file: %s\n", filename);
+      return false;
+    }
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"view_width\": %d,\n  \"view_height\": %d,\n", m_sys.m_view_width, m_sys.m_view_height);
+    fprintf(fp, "  \"view_variant\": \"%s\",\n", view_variant_name(m_sys.m_view_variant));
+    fprintf(fp, "  \"frames_per_path\": %d,\n", m_frames);
+    fprintf(fp, "  \"threads\": %d,\n", m_sys.m_threads);
+    fprintf(fp, "  \"simd_lanes\": %d,\n", m_sys.m_simd_lanes);
+    fprintf(fp, "  \"backend\": \"%s\",\n", backend_name(m_sys.m_backend));
+    fprintf(fp, "  \"map_width\": %d,\n  \"map_height\": %d,\n", m_sys.m_map.m_width, m_sys.m_map.m_height);
+    fprintf(fp, "  \"map_layout\": \"%s\",\n", map_layout_name(m_sys.m_map.m_layout));
+    fprintf(fp, "  \"accel\": %s,\n", m_sys.use_accel() ? "true" : "false");
+    fprintf(fp, "  \"reuse_turns\": %s,\n", m_sys.use_rotation_reuse() ? "true" : "false");
+    fprintf(fp, "  \"adaptive\": %d,\n", m_sys.m_adaptive);
+    fprintf(fp, "  \"ray_angles\": %d,\n", m_sys.m_ray_angles);
+    fprintf(fp, "  \"render_mode\": \"%s\",\n", render_mode_name(m_sys.m_render_mode));
+    fprintf(fp, "  \"fb_writes\": {");
+    for (int m = 0, n = 0; m < RENDER_MODE_COUNT; ++m) {
+      if (!m_render_frames[m]) continue;
+      fprintf(
+        fp, "%s \"%s\": { \"bytes_per_frame\": %.0f, \"gb_per_sec\": %.2f }",
+        n++ ? "," : "", render_mode_name(m), render_bytes_per_frame(m), render_gb_per_sec(m)
+      );
+    }
+    fprintf(fp, " },\n");
+    if (m_accel && m_accel_rays) {
+      fprintf(
+        fp, "  \"dda\": { \"cells_per_ray\": %.2f, \"plain_iterations_per_ray\": %.2f, \"accel_iterations_per_ray\": %.2f },\n",
+        double(m_accel_cells)/m_accel_rays,
+        double(m_accel_iterations[0])/m_accel_rays, double(m_accel_iterations[1])/m_accel_rays
+      );
+    }
+    fprintf(fp, "  \"paths\": [\n");
+    for (size_t p=0; p<m_results.size(); ++p) {
+      path_result_t &path = m_results[p];
+      fprintf(
+        fp, "    { \"name\": \"%s\", \"reused_pct\": %.1f, \"rays_cast_pct\": %.1f, \"stages\": {\n",
+        path.name, reused_pct(path), rays_cast_pct(path)
+      );
+      for (size_t s=0; s<path.stages.size(); ++s) {
+        stage_samples_t &stage = path.stages[s];
+        fprintf(
+          fp,
+          "      \"%s\": { \"unit\": \"%s\", \"min\": %.1f, \"median\": %.1f, \"p99\": %.1f }%s\n",
+          stage.name, stage.unit,
+          percentile(stage, 0), percentile(stage, 50), percentile(stage, 99),
+          (s+1 < path.stages.size()) ? "," : ""
+        );
+      }
+      fprintf(fp, "    } }%s\n", (p+1 < m_results.size()) ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+    fclose(fp);
+    printf("Wrote benchmark results to %s\n", filename);
+    return true;
   }
 
 };
@@ -619,11 +5294,519 @@ public:
 
 int main(int argc, char **argv) {
 
+  bool bench = false;
+  bool bench_verify = false;
+  bool bench_backends = false;
+  bool bench_layouts = false;
+  bool bench_accel = false;
+  bool bench_render = false;
+  int render_mode = -1;
+  int present_mode = PRESENT_COPY;
+  int fb_count = 2;
+  double dynamic_res = 0;
+  bool vsync = false;
+  double late_input = -1;
+  int max_frames = 0;
+  bool auto_turn = false;
+  const char *stats_dump = NULL;
+  bool stats_overlay = false;
+  const char *record_file = NULL;
+  const char *replay_file = NULL;
+  const char *replay_checksums = NULL;
+  bool map_given = false;
+  bool backend_given = false;
+  int view_width = 0, view_height = 0;
+  bool view_generic = false;
+  double fov = 0;
+  bool bench_views = false;
+  bool bench_ray_table = false;
+  int bench_map_load = 0;
+  bool bench_queries = false;
+  bool bench_sprites = false;
+  bool bench_textures = false;
+  bool bench_batch = false;
+  bool bench_floors = false;
+  bool textures = false;
+  bool floors = false;
+  int sprites = 0;
+  const char *map_convert = NULL;
+  bool map_convert_dist = true;
+  int ray_angles = 0;
+  const char *trace_stream_file = NULL;
+  int trace_stream_flags = 0;
+  const char *trace_to_hex = NULL;
+  const char *trace_hex_prefix = "traces_stream";
+  const char *frame_dump_file = NULL;
+  int frame_dump_flags = 0;
+  const char *frame_dump_to_ppm = NULL;
+  const char *frame_ppm_prefix = "frame_dump";
+  double stats_budget = 0;
+  int accel = -1;
+  int reuse = -1;
+  int adaptive = 0;
+  int map_layout = MAP_LAYOUT_TILED;
+  bool trace_diff = false;
+  const char *trace_diff_csv = NULL;
+  int backend = RAYBOX_BACKEND;
+  int bench_frames = 2000;
+  int threads = 1;
+  int chunk_columns = 0;
+  int simd_lanes = 0;
+  const char *bench_json = NULL;
+  const char *map_file = DEFAULT_MAP_FILE;
+
+  for (int i=1; i<argc; ++i) {
+    if (!strcmp(argv[i], "--bench")) {
+      bench = true;
+    }
+    else if (!strcmp(argv[i], "--bench-frames") && i+1<argc) {
+      bench_frames = atoi(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--bench-verify")) {
+      bench_verify = true;
+    }
+    else if (!strcmp(argv[i], "--bench-backends")) {
+      bench_backends = true;
+    }
+    else if (!strcmp(argv[i], "--bench-layouts")) {
+      bench_layouts = true;
+    }
+    else if (!strcmp(argv[i], "--bench-accel")) {
+      bench_accel = true;
+    }
+    else if (!strcmp(argv[i], "--bench-render")) {
+      bench_render = true;
+    }
+    else if (!strcmp(argv[i], "--bench-views")) {
+      bench_views = true;
+    }
+    else if (!strcmp(argv[i], "--bench-ray-table")) {
+      bench_ray_table = true;
+    }
+    else if (!strcmp(argv[i], "--bench-map-load")) {
+      bench_map_load = 10;
+      if (i+1<argc && argv[i+1][0] != '-') bench_map_load = std::max(1, atoi(argv[++i]));
+    }
+    else if (!strcmp(argv[i], "--bench-queries")) {
+      bench_queries = true;
+    }
+    else if (!strcmp(argv[i], "--bench-sprites")) {
+      bench_sprites = true;
+    }
+    else if (!strcmp(argv[i], "--bench-textures")) {
+      bench_textures = true;
+    }
+    else if (!strcmp(argv[i], "--bench-batch")) {
+      bench_batch = true;
+    }
+    else if (!strcmp(argv[i], "--bench-floors")) {
+      bench_floors = true;
+    }
+    else if (!strcmp(argv[i], "--textures")) {
+      textures = true;
+    }
+    else if (!strcmp(argv[i], "--floors")) {
+      floors = true;
+    }
+    else if (!strcmp(argv[i], "--sprites") && i+1<argc) {
+      sprites = atoi(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--map-convert") && i+1<argc) {
+      map_convert = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--map-convert-no-dist")) {
+      map_convert_dist = false;
+    }
+    else if (!strcmp(argv[i], "--ray-table") && i+1<argc) {
+      ray_angles = atoi(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--accel") && i+1<argc) {
+      ++i;
+      if      (!strcmp(argv[i], "on"))   accel = 1;
+      else if (!strcmp(argv[i], "off"))  accel = 0;
+      else if (!strcmp(argv[i], "auto")) accel = -1;
+      else {
+        printf("ERROR: Unknown accel setting: %s\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+    }
+    else if (!strcmp(argv[i], "--reuse") && i+1<argc) {
+      ++i;
+      if      (!strcmp(argv[i], "on"))   reuse = 1;
+      else if (!strcmp(argv[i], "off"))  reuse = 0;
+      else if (!strcmp(argv[i], "auto")) reuse = -1;
+      else {
+        printf("ERROR: Unknown reuse setting: %s\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+    }
+    else if (!strcmp(argv[i], "--adaptive") && i+1<argc) {
+      adaptive = atoi(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--render") && i+1<argc) {
+      ++i;
+      for (render_mode = 0; render_mode < RENDER_MODE_COUNT; ++render_mode) {
+        if (!strcmp(argv[i], render_mode_name(render_mode))) break;
+      }
+      if (render_mode == RENDER_MODE_COUNT) {
+        printf("ERROR: Unknown render mode: %s\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+    }
+    else if (!strcmp(argv[i], "--present") && i+1<argc) {
+      ++i;
+      for (present_mode = 0; present_mode < PRESENT_MODE_COUNT; ++present_mode) {
+        if (!strcmp(argv[i], present_mode_name(present_mode))) break;
+      }
+      if (present_mode == PRESENT_MODE_COUNT) {
+        printf("ERROR: Unknown present mode: %s\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+    }
+    else if (!strcmp(argv[i], "--buffers") && i+1<argc) {
+      fb_count = atoi(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--frames") && i+1<argc) {
+      max_frames = atoi(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--auto-turn")) {
+      auto_turn = true;
+    }
+    else if (!strcmp(argv[i], "--dynamic-res")) {
+      dynamic_res = 1000.0/60.0;
+      if (i+1<argc && argv[i+1][0] != '-') dynamic_res = atof(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--vsync")) {
+      vsync = true;
+    }
+    else if (!strcmp(argv[i], "--late-input")) {
+      late_input = 1.5;
+      if (i+1<argc && argv[i+1][0] != '-') late_input = atof(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--stats-dump") && i+1<argc) {
+      stats_dump = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--record") && i+1<argc) {
+      record_file = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--replay") && i+1<argc) {
+      replay_file = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--replay-checksums") && i+1<argc) {
+      replay_checksums = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--view") && i+1<argc) {
+      if (sscanf(argv[++i], "%dx%d", &view_width, &view_height) != 2) {
+        printf("ERROR: Bad view size (should be WIDTHxHEIGHT): %s\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+    }
+    else if (!strcmp(argv[i], "--view-generic")) {
+      view_generic = true;
+    }
+    else if (!strcmp(argv[i], "--fov") && i+1<argc) {
+      fov = atof(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--trace-stream") && i+1<argc) {
+      trace_stream_file = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--trace-stream-full")) {
+      trace_stream_flags |= TRACE_STREAM_FULL;
+    }
+    else if (!strcmp(argv[i], "--trace-stream-delta")) {
+      trace_stream_flags |= TRACE_STREAM_DELTA;
+    }
+    else if (!strcmp(argv[i], "--trace-to-hex") && i+1<argc) {
+      trace_to_hex = argv[++i];
+      if (i+1<argc && argv[i+1][0] != '-') trace_hex_prefix = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--frame-dump") && i+1<argc) {
+      frame_dump_file = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--frame-dump-delta")) {
+      frame_dump_flags |= FRAME_DUMP_DELTA;
+    }
+    else if (!strcmp(argv[i], "--frame-dump-to-ppm") && i+1<argc) {
+      frame_dump_to_ppm = argv[++i];
+      if (i+1<argc && argv[i+1][0] != '-') frame_ppm_prefix = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--stats-overlay")) {
+      stats_overlay = true;
+    }
+    else if (!strcmp(argv[i], "--stats-budget") && i+1<argc) {
+      stats_budget = atof(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--map-layout") && i+1<argc) {
+      ++i;
+      for (map_layout = 0; map_layout < MAP_LAYOUT_COUNT; ++map_layout) {
+        if (!strcmp(argv[i], map_layout_name(map_layout))) break;
+      }
+      if (map_layout == MAP_LAYOUT_COUNT) {
+        printf("ERROR: Unknown map layout: %s\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+    }
+    else if (!strcmp(argv[i], "--trace-diff")) {
+      trace_diff = true;
+      if (i+1<argc && argv[i+1][0] != '-') trace_diff_csv = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--backend") && i+1<argc) {
+      ++i;
+      if      (!strcmp(argv[i], "float"))  backend = BACKEND_FLOAT;
+      else if (!strcmp(argv[i], "double")) backend = BACKEND_DOUBLE;
+      else if (!strcmp(argv[i], "fixed"))  backend = BACKEND_FIXED;
+      else {
+        printf("ERROR: Unknown backend: %s\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      backend_given = true;
+    }
+    else if (!strcmp(argv[i], "--threads") && i+1<argc) {
+      threads = atoi(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--simd") && i+1<argc) {
+      ++i;
+      if      (!strcmp(argv[i], "off"))    simd_lanes = SIMD_OFF;
+      else if (!strcmp(argv[i], "avx2"))   simd_lanes = SIMD_AVX2;
+      else if (!strcmp(argv[i], "avx512")) simd_lanes = SIMD_AVX512;
+      else if (!strcmp(argv[i], "auto"))   simd_lanes = 0;
+      else {
+        printf("ERROR: Unknown SIMD mode: %s\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+    }
+    else if (!strcmp(argv[i], "--chunk") && i+1<argc) {
+      chunk_columns = atoi(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--json") && i+1<argc) {
+      bench_json = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--map") && i+1<argc) {
+      map_file = argv[++i];
+      map_given = true;
+    }
+    else {
+      printf(
+        "Usage: %s [--map FILE|gen:SIZE[:SEED]] [--map-layout rowmajor32|rowmajor8|tiled|morton]\n"
+        "          [--map-convert FILE.rbxm [--map-convert-no-dist]]\n"
+        "          [--view WIDTHxHEIGHT] [--view-generic] [--fov DEGREES] [--ray-table ANGLES]\n"
+        "          [--threads N] [--chunk COLUMNS] [--simd off|avx2|avx512|auto]\n"
+        "          [--backend float|double|fixed] [--accel on|off|auto] [--reuse on|off|auto]\n"
+        "          [--adaptive N] [--render overdraw|spans|rows] [--textures] [--floors]\n"
+        "          [--sprites N] [--present copy|lock|pipeline] [--buffers 2|3]\n"
+        "          [--frames N] [--auto-turn] [--dynamic-res [MS]] [--vsync] [--late-input [MARGIN_MS]]\n"
+        "          [--stats-dump FILE.csv|FILE.json] [--stats-overlay] [--stats-budget MS]\n"
+        "          [--record FILE] [--replay FILE [--replay-checksums FILE]]\n"
+        "          [--trace-stream FILE [--trace-stream-full] [--trace-stream-delta]]\n"
+        "          [--trace-to-hex FILE [PREFIX]]\n"
+        "          [--frame-dump FILE|FILE.y4m|FILE.ppm [--frame-dump-delta]] [--frame-dump-to-ppm FILE [PREFIX]]\n"
+        "          [--bench [--bench-frames N] [--bench-verify] [--bench-backends] [--bench-layouts]\n"
+        "                   [--bench-accel] [--bench-render] [--bench-views] [--bench-ray-table]\n"
+        "                   [--bench-map-load [RUNS]] [--bench-queries] [--bench-sprites]\n"
+        "                   [--bench-textures] [--bench-batch] [--bench-floors]\n"
+        "                   [--json FILE]]\n"
+        "          [--trace-diff [CSV_FILE] [--bench-frames N]]\n",
+        argv[0]
+      );
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (trace_to_hex) {
+    return (RayboxTraceStream::convert_to_hex(trace_to_hex, trace_hex_prefix) >= 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  if (frame_dump_to_ppm) {
+    return (RayboxFrameDump::convert_to_ppm(frame_dump_to_ppm, frame_ppm_prefix) >= 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
   RayboxSystem raybox;
+  raybox.m_threads = threads;
+  raybox.m_simd_lanes = simd_lanes;
+  raybox.m_backend = backend;
+  raybox.m_map_layout = map_layout;
+  raybox.m_accel = accel;
+  raybox.m_reuse = reuse;
+  raybox.m_adaptive = adaptive;
+  if (render_mode >= 0) raybox.m_render_mode = render_mode;
+  raybox.m_textured = textures;
+  raybox.m_floors = floors;
+  raybox.m_present_mode = present_mode;
+  raybox.m_fb_count = fb_count;
+  raybox.m_max_frames = max_frames;
+  if (dynamic_res > 0) {
+    if (trace_stream_file || frame_dump_file) {
+      printf("ERROR: --dynamic-res can't be used with --trace-stream or --frame-dump (whose frames must all be the same size)\n");
+      return EXIT_FAILURE;
+    }
+    raybox.m_dynamic_res = true;
+    raybox.m_scaler.m_budget_ms = dynamic_res;
+  }
+  raybox.m_auto_turn = auto_turn;
+  raybox.m_vsync = vsync;
+  if (late_input >= 0) {
+    raybox.m_late_input = true;
+    raybox.m_late_margin_ms = late_input;
+  }
+#if RAYBOX_STATS
+  raybox.m_stats_overlay_always = stats_overlay;
+  if (stats_budget > 0) raybox.m_stats.m_budget_ms = stats_budget;
+  if (stats_dump && !raybox.m_stats.open_dump(stats_dump)) return EXIT_FAILURE;
+#else
+  if (stats_dump || stats_overlay || stats_budget > 0) printf("WARNING: Built without RAYBOX_STATS, so there are no stats\n");
+#endif
+  if (chunk_columns > 0) raybox.m_chunk_columns = chunk_columns;
+  if (view_width || view_generic) {
+    if (!view_width) {
+      view_width = raybox.m_view_width;
+      view_height = raybox.m_view_height;
+    }
+    if (!raybox.set_view(view_width, view_height, view_generic)) return EXIT_FAILURE;
+  }
+  if (fov > 0) raybox.set_fov(fov);
+  if (bench && bench_ray_table && !ray_angles) ray_angles = 1024;
+  if (ray_angles && !raybox.set_ray_angles(ray_angles)) return EXIT_FAILURE;
+
+  RayboxInputLog log;
+  if (replay_file) {
+    if (!log.open(replay_file)) return EXIT_FAILURE;
+    // Replay at the size (and with the backend) it was recorded with, unless told otherwise:
+    if (!view_width && !raybox.set_view(log.m_view_width, log.m_view_height, view_generic)) return EXIT_FAILURE;
+    if (!backend_given && log.m_backend <= BACKEND_FIXED) raybox.m_backend = log.m_backend;
+  }
+
+  if (map_convert) {
+    if (!raybox.load_map(map_file)) return EXIT_FAILURE;
+    if (!raybox.m_map.save_binary(map_convert, map_convert_dist)) return EXIT_FAILURE;
+    printf(
+      "Wrote %dx%d map (%s layout, %s distance field) to %s\n", raybox.m_map.m_width, raybox.m_map.m_height,
+      map_layout_name(raybox.m_map.m_layout), map_convert_dist ? "with" : "without", map_convert
+    );
+    return EXIT_SUCCESS;
+  }
+
+  if (trace_diff) {
+    raybox.prep(true);
+    if (!raybox.load_map(map_file)) return EXIT_FAILURE;
+    RayboxBench b(raybox, bench_frames);
+    return (b.run_trace_diff(trace_diff_csv) == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  if (bench && bench_map_load) {
+    raybox.prep(true);
+    RayboxBench b(raybox, bench_frames);
+    if (!b.run_map_load(map_file, bench_map_load)) return EXIT_FAILURE;
+    b.print_report();
+    if (bench_json && !b.write_json(bench_json)) return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+  }
+
+  if (bench && bench_queries) {
+    raybox.prep(true);
+    if (!raybox.load_map(map_file)) return EXIT_FAILURE;
+    RayboxBench b(raybox, bench_frames);
+    b.m_verify = bench_verify;
+    b.run_queries();
+    b.print_report();
+    if (bench_json && !b.write_json(bench_json)) return EXIT_FAILURE;
+    return b.m_verify_failures ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+  if (bench && bench_batch) {
+    raybox.prep(true);
+    if (!raybox.load_map(map_file)) return EXIT_FAILURE;
+    RayboxBench b(raybox, bench_frames);
+    b.m_verify = bench_verify;
+    b.run_batch();
+    b.print_report();
+    if (bench_json && !b.write_json(bench_json)) return EXIT_FAILURE;
+    return b.m_verify_failures ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+  if (bench && bench_sprites) {
+    raybox.prep(true);
+    if (!raybox.load_map(map_file)) return EXIT_FAILURE;
+    RayboxBench b(raybox, bench_frames);
+    b.m_verify = bench_verify;
+    b.run_sprites();
+    b.print_report();
+    if (bench_json && !b.write_json(bench_json)) return EXIT_FAILURE;
+    return b.m_verify_failures ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+  if (bench) {
+    raybox.prep(true);
+    if (!raybox.load_map(map_file)) return EXIT_FAILURE;
+    RayboxBench b(raybox, bench_frames);
+    b.m_verify = bench_verify;
+    b.m_backends = bench_backends;
+    b.m_layouts = bench_layouts;
+    b.m_accel = bench_accel;
+    b.m_render = bench_render;
+    b.m_views = bench_views;
+    b.m_ray_table = bench_ray_table;
+    b.m_textures = bench_textures;
+    b.m_floors = bench_floors;
+    b.run();
+    b.print_report();
+    if (bench_json && !b.write_json(bench_json)) return EXIT_FAILURE;
+    return b.m_verify_failures ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+  RayboxTraceStream trace_stream;
+  if (trace_stream_file) {
+    if (!trace_stream.create(trace_stream_file, raybox.m_view_width, raybox.m_view_height, trace_stream_flags)) return EXIT_FAILURE;
+    raybox.m_trace_stream = &trace_stream;
+  }
+  auto close_trace_stream = [&] {
+    if (!trace_stream_file) return true;
+    trace_stream.close();
+    printf("Streamed %d frame(s) of traces to %s: %.1f MB, writer stalled %d frame(s)\n",
+      int(trace_stream.m_head), trace_stream_file, double(trace_stream.m_bytes_written)/1e6, trace_stream.m_stalls);
+    if (trace_stream.m_failed) printf("ERROR: Failed writing trace stream: %s\n", trace_stream_file);
+    return !trace_stream.m_failed;
+  };
+
+  RayboxFrameDump frame_dump;
+  if (frame_dump_file) {
+    if (!frame_dump.create(frame_dump_file, raybox.m_view_width, raybox.m_view_height, frame_dump_flags)) return EXIT_FAILURE;
+    frame_dump.m_wait = (replay_file != NULL); // (Replay isn't real time, so it may as well keep every frame.)
+    raybox.m_frame_dump = &frame_dump;
+  }
+  auto close_frame_dump = [&] {
+    if (!frame_dump_file) return true;
+    frame_dump.close();
+    int frames = int(frame_dump.m_head);
+    double seconds = double(frame_dump.m_end - frame_dump.m_start) / double(SDL_GetPerformanceFrequency());
+    printf("Dumped %d frame(s) to %s: %.1f MB (%.1f MB/s), %.3f ms per frame copying, %d dropped, %d stalled\n",
+      frames, frame_dump_file, double(frame_dump.m_bytes_written)/1e6, double(frame_dump.m_bytes_written)/1e6/std::max(seconds, 1e-9),
+      1000.0 * double(frame_dump.m_push_ticks) / double(std::max(frames, 1)) / double(SDL_GetPerformanceFrequency()),
+      frame_dump.m_dropped, frame_dump.m_stalls);
+    if (frame_dump.m_failed) printf("ERROR: Failed writing frame dump: %s\n", frame_dump_file);
+    return !frame_dump.m_failed;
+  };
+
+  if (replay_file) {
+    raybox.prep(true);
+    if (!raybox.load_map(map_given ? map_file : log.m_map.c_str())) return EXIT_FAILURE;
+    if (sprites > 0) raybox.scatter_sprites(sprites);
+    bool ok = raybox.replay(log, replay_checksums);
+    ok = close_trace_stream() && ok;
+    ok = close_frame_dump() && ok;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
   raybox.prep();
-  raybox.load_map(MAP_FILE);
+  raybox.load_map(map_file);
+  if (sprites > 0) raybox.scatter_sprites(sprites);
   raybox.debug_print();
+  RayboxInputLog recorder;
+  if (record_file) {
+    if (!recorder.create(record_file, raybox.m_view_width, raybox.m_view_height, raybox.m_backend, map_file, raybox.camera())) return EXIT_FAILURE;
+    raybox.m_recorder = &recorder;
+  }
   raybox.run();
+  if (record_file) printf("Recorded %d frame(s) of input to %s\n", recorder.m_frames, record_file);
+  if (!close_trace_stream() || !close_frame_dump()) return EXIT_FAILURE;
 
   printf("Bye!\n");
 